@@ -1,7 +1,34 @@
 {"mysqla_create_query", gsc_mysqla_create_level_query, 0},
+{"mysqla_create_cached_query", gsc_mysqla_create_level_cached_query, 0},
+{"mysqla_create_group_query", gsc_mysqla_create_level_group_query, 0},
+{"mysqla_create_stream_query", gsc_mysqla_create_level_stream_query, 0},
+{"mysqla_prepare", gsc_mysqla_prepare, 0},
+{"mysqla_execute_statement", gsc_mysqla_execute_level_statement, 0},
 {"mysqla_initializer", gsc_mysqla_initializer, 0},
+{"mysqla_add_replica", gsc_mysqla_add_replica, 0},
+{"mysqla_set_pool_size", gsc_mysqla_set_pool_size, 0},
+{"mysqla_set_read_your_writes", gsc_mysqla_set_read_your_writes, 0},
+{"mysqla_set_query_timeout", gsc_mysqla_set_query_timeout, 0},
+{"mysqla_set_health_check", gsc_mysqla_set_health_check, 0},
+{"mysqla_get_ready_connections", gsc_mysqla_get_ready_connections, 0},
+{"mysqla_get_pool_stats", gsc_mysqla_get_pool_stats, 0},
+{"mysqla_set_insert_coalescing", gsc_mysqla_set_insert_coalescing, 0},
+{"mysqla_set_batch_delivery", gsc_mysqla_set_batch_delivery, 0},
+{"mysqla_set_single_flight", gsc_mysqla_set_single_flight, 0},
+{"mysqla_set_result_cache", gsc_mysqla_set_result_cache, 0},
+{"mysqla_set_queue_limits", gsc_mysqla_set_queue_limits, 0},
+{"mysqla_get_queue_pressure", gsc_mysqla_get_queue_pressure, 0},
+{"mysqla_set_scheduling", gsc_mysqla_set_scheduling, 0},
+{"mysqla_get_queue_stats", gsc_mysqla_get_queue_stats, 0},
+{"mysqla_get_memory_stats", gsc_mysqla_get_memory_stats, 0},
+{"mysqla_get_stats", gsc_mysqla_get_stats, 0},
+{"mysqla_set_stats_interval", gsc_mysqla_set_stats_interval, 0},
+#ifdef MYSQLA_BENCHMARK
+{"mysqla_benchmark_dispatch", gsc_mysqla_benchmark_dispatch, 0},
+#endif
 {"mysql_real_connect", gsc_mysqls_real_connect, 0},
 {"mysql_query", gsc_mysqls_query, 0},
+{"mysql_query_nonblocking", gsc_mysqls_query_nonblocking, 0},
 {"mysql_real_escape_string", gsc_mysqls_real_escape_string, 0},
 {"hexstringtoint", Gsc_Utils_HexStringToInt, 0},
 {"inttohexstring", Gsc_Utils_IntToHexString, 0},
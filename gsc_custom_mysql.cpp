@@ -7,49 +7,450 @@
 
 /* Includes */
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#include <mysql/mysqld_error.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
 #include "gsc_custom_mysql.hpp"
 
 /* Defines */
 #define  MYSQL_NO_ERROR         0
 #define  MYSQLA_TASK_BUSY       0
 
+#define  MYSQLA_STATE_WAITING   0       // Task hasn't been handed to a connection yet
+#define  MYSQLA_STATE_STARTED   1       // Task was handed to a connection
+#define  MYSQLA_STATE_CANCELLED 2       // Task won't be executed, the dispatcher hands it straight back
+
+#define  MYSQLA_FLAG_PERSIST    1       // Execute the task even if its entity disconnects before it starts
+#define  MYSQLA_FLAG_READ       2       // Query doesn't write, so it may run on a replica (SELECTs are detected without this)
+#define  MYSQLA_FLAG_PRIMARY    4       // Run on the primary even if it is a read (e.g. SELECT ... FOR UPDATE)
+#define  MYSQLA_FLAG_ORDERED    8       // Run after the entity's earlier ordered tasks have finished (the entity's lane)
+#define  MYSQLA_FLAG_IDEMPOTENT 16      // Executing the write twice does no harm, so it's spooled even if the connection was lost during it
+
+#define  MYSQLA_LANE_BUCKETS    256     // Hash buckets of the lanes with a running task (power of 2)
+#define  MYSQLA_FLIGHT_BUCKETS  256     // Hash buckets of the reads in flight that identical reads may join (power of 2)
+
+#define  MYSQLA_ROUTE_PRIMARY   0       // Tasks executed by the primary's connections
+#define  MYSQLA_ROUTE_REPLICA   1       // Reads spread over the replicas' connections
+#define  MYSQLA_ROUTES          2
+
+#define  MYSQLA_CONNECTION_CLOSED   ((mysqla_task_t *)1) // Placeholder task of a connection closed by the pool sizing, or not connected yet
+#define  MYSQLA_CONNECTION_PING     ((mysqla_task_t *)2) // Placeholder task asking the worker to check its idle connection
+
+#define  MYSQLA_CONNECT_RETRY_MS        1000    // Wait before connecting again after a failed connect, doubled on each failure
+#define  MYSQLA_CONNECT_RETRY_MAX_MS    30000   // Longest wait between connect attempts
+#define  MYSQLA_WATCHDOG_INTERVAL_MS 50     // How often running queries are checked against their deadlines
+#define  MYSQLA_SIZING_CHECK_MS     250     // How often the dispatcher looks at queue waits and idle connections while pools are sized
+#define  MYSQLA_BREAKER_PROBE_MS    1000    // How often idle connections are pinged while their pool's circuit breaker is open
+
+#define  MYSQLA_POLICY_REJECT       0   // A full queue rejects new tasks
+#define  MYSQLA_POLICY_DROP_OLDEST  1   // A full queue cancels the oldest waiting bulk task to make room
+#define  MYSQLA_POLICY_BLOCK        2   // A full queue makes the game thread wait (up to a timeout) for tasks to finish
+
+#define  MYSQLA_MAX_ENTITIES    1024    // Size of g_entities (MAX_GENTITIES)
+
+#define  MYSQLA_SAVE_SCALAR     2       // saveResult value to get a single-row, single-column result as the value itself
+
+#define  MYSQLA_CELL_STRING     's'     // Type tags of the values stored in a row buffer
+#define  MYSQLA_CELL_INT        'i'
+#define  MYSQLA_CELL_FLOAT      'f'
+
+#define  MYSQLA_TASK_SLAB_COUNT 64      // How many task objects are allocated at once when no recycled one is left
+#define  MYSQLA_TEXT_CHUNK_SIZE 65536   // Size of the memory chunks query text blocks are carved from
+#define  MYSQLA_TEXT_MIN_SHIFT  6       // Smallest query text block is 64 (2^6) bytes
+#define  MYSQLA_TEXT_STEPS      4       // Size classes per doubling (64, 80, 96, 112, 128, 160, ...), so at most a fifth of a block is unused
+#define  MYSQLA_TEXT_CLASSES    41      // Query text block sizes 64 bytes up to the chunk size. Longer queries are malloc'd
+
+#define  MYSQLA_MAX_STATEMENT_PARAMS    64  // Maximum amount of parameters a prepared statement can be executed with
+
+#define  MYSQLA_STREAM_WINDOW   2       // Chunks a streaming query may fetch ahead of what GSC has received
+
+#define  MYSQLA_COALESCE_MAX_GROUPS     16      // Maximum amount of different INSERT shapes coalesced per frame
+#define  MYSQLA_COALESCE_MAX_LENGTH     65536   // Maximum length of a coalesced INSERT (keep well below max_allowed_packet)
+
+#define  MYSQLA_PRIORITY_INTERACTIVE    0   // Tasks a player is waiting on (e.g. loading a profile on connect)
+#define  MYSQLA_PRIORITY_NORMAL         1   // Default priority class
+#define  MYSQLA_PRIORITY_BULK           2   // Background work that may wait (e.g. stat writes)
+#define  MYSQLA_PRIORITY_CLASSES        3
+
+#define  MYSQLA_SPOOL_MAGIC     0x4c4f4f50  // Marks a valid spool file ("POOL")
+#define  MYSQLA_SPOOL_GROW_SIZE 1048576     // The spool file grows in steps of 1MB
+#define  MYSQLA_SPOOL_MAX_SIZE  268435456   // Writes are lost (and logged) once the spool file reaches 256MB
+#define  MYSQLA_SPOOL_RETRY_MS  1000        // How long the replayer waits before trying an unreachable database again
+
+#define  MYSQLA_HISTOGRAM_BUCKETS   32  // Power of 2 buckets of the metrics histograms
+#define  MYSQLA_STATS_GSC           0   // Reader of the connection busy times: the GSC builtin
+#define  MYSQLA_STATS_FILE          1   // Reader of the connection busy times: the stats file writer
+
+#define  MYSQLA_DELIVERY_TASK   0       // The result callback is called once per finished task
+#define  MYSQLA_DELIVERY_FRAME  1       // The batch callback is called once per frame on the level with all finished tasks
+#define  MYSQLA_DELIVERY_ENTITY 2       // The batch callback is called once per frame for each entity (and the level) with its finished tasks
+
+#define  MYSQLA_CACHE_BUCKETS   256     // Hash buckets of the result cache (power of 2)
+#define  MYSQLA_MAX_WORD        65      // Longest keyword or table name looked at when classifying queries (MySQL names are at most 64 chars)
+
+#define  MYSQLS_STEP_QUERY      0       // Non-blocking query is sending the query and reading its status
+#define  MYSQLS_STEP_STORE      1       // Non-blocking query is reading the result rows
+#define  MYSQLS_STEP_DONE       2       // Non-blocking query finished, GSC hasn't been notified yet
+
 /* Typedefs */
+typedef struct mysqla_qnode
+{
+    struct mysqla_qnode *next;  // Next node in the queue (linked by producers, followed by the consumer)
+} mysqla_qnode_t;
+
+typedef struct mysqla_queue // Intrusive wait-free multi-producer single-consumer queue
+{
+    mysqla_qnode_t *head;       // Most recently pushed node (swapped by producers)
+    mysqla_qnode_t *tail;       // Oldest node that hasn't been popped yet (consumer only)
+    mysqla_qnode_t stub;        // Placeholder node so producers never have to touch the tail
+} mysqla_queue_t;
+
+typedef struct mysqla_param // Typed parameter of a prepared statement execution
+{
+    int type;                   // STACK_INT, STACK_FLOAT, STACK_STRING or STACK_UNDEFINED (bound as NULL)
+    union
+    {
+        int intVal;
+        float floatVal;
+    };
+    char *strVal;               // String value, stored in the same block as the parameter array
+    unsigned long strLen;       // Length of the string value
+} mysqla_param_t;
+
+typedef struct mysqla_rows // Result rows copied out of the client library, so no client library calls are needed to read them
+{
+    int numRows;
+    int numFields;
+    int *offsets;               // numRows * numFields offsets of the field values in data, -1 for NULL
+    char *types;                // Type (MYSQLA_CELL_*) of each column, taken from the field metadata
+    char *data;                 // Field values, each a type tag followed by an int, a float or a terminated string
+    int dataLen;                // Bytes of data used
+    int dataSize;               // Bytes of data allocated
+    bool dataInline;            // Whether data is part of the same allocation as the offsets (pre-sized buffers)
+    int refs;                   // Owners of the rows (the task and/or the result cache), freed when the last one lets go
+} mysqla_rows_t;
+
+typedef struct mysqla_chunk // Part of the rows of a streaming query, passed from the worker to the game thread
+{
+    mysqla_qnode_t node;        // Chunk queue link, must be the first member
+    mysqla_rows_t *rows;        // Rows of this chunk, or NULL for the end of the stream
+    int status;                 // 0 for rows, 1 for the end of the stream, -1 if the stream failed
+} mysqla_chunk_t;
+
+typedef struct mysqla_priority_stats // Queue wait of a priority class. Updated by the dispatcher, read by GSC
+{
+    int queued;                 // Tasks waiting for a connection
+    int started;                // Tasks handed to a connection so far
+    int waitCount;              // Tasks whose wait is in totalWaitUs (reset when read)
+    long long totalWaitUs;      // Summed queue wait (reset when read)
+    int maxWaitUs;              // Longest queue wait (reset when read)
+} mysqla_priority_stats_t;
+
+typedef struct mysqla_histogram // Distribution of a measured value, updated with relaxed atomics from any thread
+{
+    int buckets[MYSQLA_HISTOGRAM_BUCKETS]; // Bucket i counts the values below 2^i (and from 2^(i-1) on)
+    int count;                  // Amount of measured values
+    long long sum;              // Sum of the measured values
+    int max;                    // Largest measured value
+} mysqla_histogram_t;
+
+typedef struct mysqla_metrics // Counters of the async subsystem since it was started
+{
+    mysqla_histogram_t queueDepth;  // Queued tasks, sampled whenever a task is queued
+    mysqla_histogram_t queueWaitUs; // Time between handing a task to the dispatcher and starting it
+    mysqla_histogram_t execUs;      // Time a worker spent executing a task
+    mysqla_histogram_t resultRows;  // Rows of each saved result
+    mysqla_histogram_t resultBytes; // Bytes of each saved result
+    int peakQueued;             // Most tasks queued at once
+    int executed;               // Tasks executed by the workers
+    int errors;                 // MySQL errors logged
+    int connectionErrors;       // Of which were caused by an unreachable database
+    int spooled;                // Writes spooled
+    int rejected;               // Tasks rejected by the queue limits
+    int dropped;                // Tasks cancelled to make room in the queue
+    int cancelled;              // Tasks cancelled because their player disconnected
+    int cacheHits;              // Cached queries answered from the result cache
+    int cacheMisses;            // Cached queries that had to be executed
+    int timedOut;               // Tasks whose deadline passed
+    int poolGrown;              // Connections opened by the pool sizing
+    int poolShrunk;             // Idle connections closed by the pool sizing
+    int reconnects;             // Connections replaced after a failed ping or a lost connection
+    int failedFast;             // Tasks failed without executing them while the circuit breaker was open
+    int deduplicated;           // Reads that shared the result of an identical read in flight
+} mysqla_metrics_t;
+
+typedef struct mysqla_statement // Prepared statement registered from GSC
+{
+    char *query;                // Statement text with ? placeholders
+    int numParams;              // Amount of placeholders in the statement text
+} mysqla_statement_t;
+
 typedef struct mysqla_task
 {
+    mysqla_qnode_t node;        // Submission/completion queue link, must be the first member
     int taskId;                 // ID of the task
-    struct mysqla_task *prev;   // Previous linked list entry
-    struct mysqla_task *next;   // Next linked list entry
-    MYSQL_RES *result;          // MySQL resulting rows of the task's query
+    struct mysqla_task *prev;   // Previous linked list entry (game thread only)
+    struct mysqla_task *next;   // Next linked list entry, or next recycled task when not in use (game thread only)
+    struct mysqla_task *pending; // Next entry in the dispatcher's list of tasks waiting for a connection or for their lane (dispatcher only)
+    mysqla_rows_t *rows;        // Resulting rows of the task, copied out of the MySQL result by the worker
     gentity_t *entity;          // The entity upon which this query was called (or NULL)
     bool entityDisconnected;    // Whether the entity has disconnected since the task was scheduled
-    bool done;                  // Whether or not the task is finished
-    bool started;               // Whether or not the task has started
+    struct mysqla_task *prevOfEntity; // Previous outstanding task of the same entity (game thread only)
+    struct mysqla_task *nextOfEntity; // Next outstanding task of the same entity (game thread only)
+    bool persist;               // Whether the task is executed even if its entity disconnects before it starts
+    bool idempotent;            // Whether the write may be replayed although the server may have executed it already
+    int state;                  // MYSQLA_STATE_*, changed with compare-and-swap as the game thread and dispatcher race for it
+    int queuedBytes;            // Bytes counted against the queue limits until the task finishes, see mysqla_admit_task()
     bool save;                  // Whether or not the result will be saved
-    char query[1024 + 1];  // The (to be) executed query
-} mysqla_task_t; // Allocate this dynamically due to 1024 chars being reserved
+    bool scalar;                // Whether a single-row, single-column result is passed as the value itself
+    int queryLen;               // Length of the query (excluding terminator)
+    char *query;                // The (to be) executed query, stored in a recycled text block
+    int stmtId;                 // Handle of the prepared statement to execute, 0 for a plain query
+    int numParams;              // Amount of prepared statement parameters
+    int paramBytes;             // Size of the block holding the parameters
+    mysqla_param_t *params;     // Prepared statement parameters, stored in a recycled block
+    int groupSize;              // Amount of statements if this task is a group executed as one transaction, otherwise 0
+    bool groupFailed;           // Whether the group's transaction was rolled back
+    mysqla_rows_t **groupResults; // Resulting rows of each statement of the group (if saved)
+    int streamChunkRows;        // Rows per chunk if this is a streaming query, otherwise 0
+    int streamCallback;         // GSC function receiving the chunks of a streaming query
+    sem_t streamSlots;          // Chunks the worker may still fetch ahead (streaming only)
+    mysqla_queue_t streamChunks; // Fetched chunks not yet passed to GSC (streaming only)
+    struct mysqla_task *nextStream; // Next streaming task that hasn't finished yet (game thread only)
+    int valuesOffset;           // Offset of the first VALUES row in the query if it can be coalesced, otherwise 0
+    struct mysqla_task *coalesced; // Next task whose INSERT row was merged into this task's query (set by the game thread before dispatch)
+    int cacheTtl;               // Milliseconds the result may be kept in the result cache, 0 if it isn't cached
+    int priority;               // Priority class (MYSQLA_PRIORITY_*) the dispatcher schedules the task in
+    bool read;                  // Whether the task may be executed on a replica
+    int lane;                   // Key of the lane the task is executed in order in, 0 if it isn't in one
+    long long queuedAt;         // mysqla_time_us() at which the task was handed to the dispatcher
+    struct mysqla_task *nextInBatch; // Next task delivered in the same batch callback (game thread only)
+    int timeoutMs;              // Time the task may take from submission to its result, 0 for no deadline
+    long long deadlineUs;       // mysqla_time_us() at which the task times out, 0 for no deadline
+    bool timedOut;              // Whether the deadline passed before the task finished (its result is dropped)
+    bool inFlight;              // Whether identical reads may still join this task (game thread only)
+    unsigned int flightHash;    // Hash of the query text while in flight
+    struct mysqla_task *nextInFlight; // Next read in flight in the same hash bucket (game thread only)
+    struct mysqla_task *followers; // First task that joined this read and gets its result (game thread only)
+    struct mysqla_task *nextFollower; // Next task that joined the same read (game thread only)
+} mysqla_task_t; // Allocated from the task slab, see mysqla_alloc_task()
+
+typedef struct mysqla_coalesce_group // INSERTs of the same shape waiting to be merged at the end of the frame
+{
+    mysqla_task_t *leader;      // Task that will execute the merged INSERT
+    mysqla_task_t *last;        // Last task of the leader's coalesced chain
+    int rowCount;               // Amount of rows in the group
+    int length;                 // Length of the merged query
+} mysqla_coalesce_group_t;
+
+typedef struct mysqla_cache_entry // Result of a read query kept for reuse until it expires or a write touches its tables
+{
+    struct mysqla_cache_entry *nextInBucket; // Next entry with the same hash bucket
+    struct mysqla_cache_entry *newer;   // Next more recently used entry
+    struct mysqla_cache_entry *older;   // Next less recently used entry
+    unsigned int hash;          // Hash of the key
+    long long expires;          // mysqla_time_ms() after which the entry is no longer used
+    int size;                   // Bytes counted against the cache's memory cap
+    mysqla_rows_t *rows;        // Cached rows, shared with the tasks they're handed to
+    char key[1];                // Normalized query text, allocated along with the entry
+} mysqla_cache_entry_t;
+
+typedef struct mysqla_spool_header // Start of the spool file, followed by the spooled writes (see mysqla_spool_append())
+{
+    unsigned int magic;             // MYSQLA_SPOOL_MAGIC
+    unsigned int reserved;
+    unsigned long long readOffset;  // Offset of the oldest write that hasn't been replayed yet
+    unsigned long long writeOffset; // Offset the next write is appended at
+} mysqla_spool_header_t;
+
+typedef struct mysqls_nb_query // Query on the synchronous connection that is advanced a step each frame
+{
+    struct mysqls_nb_query *next; // Next query in submission order
+    int id;                     // Passed to GSC along with the result
+    int saveResult;             // Whether the rows are wanted, MYSQLA_SAVE_SCALAR for the value itself
+    int step;                   // MYSQLS_STEP_*
+    int waitStatus;             // What the client library waits for (MYSQL_WAIT_*), 0 if the step hasn't been started
+    long long timeoutAt;        // mysqla_time_ms() at which a MYSQL_WAIT_TIMEOUT wait is over
+    int queryRet;               // Result of the query step
+    int error;                  // MySQL error code once done, 0 on success
+    MYSQL_RES *result;          // Stored rows once done (if wanted and the query returned any)
+    char query[1];              // Query text, allocated along with the query
+} mysqls_nb_query_t;
+
+typedef struct mysqla_lane // Tasks executed one after another, in submission order (dispatcher only)
+{
+    struct mysqla_lane *next;   // Next lane in the same hash bucket, or next recycled lane
+    int key;                    // Caller-supplied key (positive) or entity number (negative, see mysqla_entity_lane())
+    mysqla_task_t *firstHeld;   // Oldest task waiting for the lane's running task to finish, linked by pending
+    mysqla_task_t *lastHeld;
+} mysqla_lane_t; // A lane only exists while one of its tasks is pending or running
+
+typedef struct mysqla_pool // Connections to one database server
+{
+    struct mysqla_pool *next;   // Next pool (game thread only)
+    char *name;                 // Name given by GSC, "primary" for the connections of mysqla_initializer()
+    bool replica;               // Whether the server is a read replica of the primary
+    char *host;                 // Server the connections go to, kept for connections opened later on
+    char *user;
+    char *pass;
+    char *db;
+    int port;
+    int connectionCount;        // Open connections to the server, including those still connecting (changed by the dispatcher and the opener thread)
+    int readyConnections;       // Of which are connected (added to by the workers, subtracted from by the dispatcher)
+    int minConnections;         // Connections kept open while the pool is sized dynamically
+    int maxConnections;         // Most connections opened, 0 if the pool has a fixed size
+    int growWaitMs;             // Queue wait at which another connection is opened
+    int idleTimeoutMs;          // Idle time after which a connection above the minimum is closed
+    int opening;                // Connections requested from the opener thread that aren't open yet
+    int connecting;             // Connections the opener thread opened whose worker isn't connected yet
+    MYSQL *killConnection;      // Side connection the watchdog kills queries through (watchdog only)
+    int outstanding;            // Tasks being executed on the pool's connections (added to by the dispatcher, subtracted from by the workers)
+    int executed;               // Tasks executed by the pool's connections so far
+    int failures;               // Consecutive failed connects, the circuit breaker is open at mysqla_breaker_threshold
+} mysqla_pool_t;
 
 typedef struct mysqla_connection
 {
     struct mysqla_connection *prev; // Previous linked list entry
     struct mysqla_connection *next; // Next linked list entry
-    mysqla_task_t *task; // Each connection can have multiple tasks
+    mysqla_task_t *task; // Task being executed (NULL when idle). Set by the dispatcher, cleared by the worker
+    mysqla_pool_t *pool; // Pool (server) the connection belongs to
+    mysqla_lane_t *lane; // Lane of the task being executed, released once the connection is idle again (dispatcher only)
     MYSQL *connection;   // The actual MySQL connection
+    pthread_t worker;    // Persistent thread executing the tasks handed to this connection
+    bool closed;         // Whether the worker closed the connection and ended after the pool sizing retired it
+    bool grown;          // Whether the pool sizing opened the connection and it counts as connecting until its worker is connected
+    long long checkedUs; // mysqla_time_us() at which the worker last pinged the idle connection
+    long long idleSinceUs;       // mysqla_time_us() at which the connection last became idle
+    pthread_mutex_t deadlineLock; // Keeps the watchdog from killing a query once the worker is done with it
+    long long deadlineUs;        // Deadline of the running task, 0 if it has none (protected by deadlineLock)
+    bool deadlineHit;            // Whether the watchdog killed the running task (protected by deadlineLock)
+    bool killing;                // Whether the watchdog is sending the KILL QUERY right now (protected by deadlineLock)
+    pthread_cond_t killDone;     // Signalled (under deadlineLock) once the KILL QUERY is sent
+    unsigned long serverThreadId; // Server-side id of the connection, which KILL QUERY takes
+    pthread_mutex_t lock;        // Protects the task hand-over between the dispatcher and the worker
+    pthread_cond_t taskAssigned; // Signalled (under lock) when the dispatcher hands over a task
+    MYSQL_STMT **statements;     // Prepared statements of this connection, indexed by handle (worker only)
+    int statementCount;          // Size of the statements array
+    long long busyUs;            // Time the worker spent executing tasks (added to by the worker)
+    long long statsBusyUs[2];    // busyUs at the previous read of each stats reader (MYSQLA_STATS_*)
 } mysqla_connection_t;
 
 //typedef void (*mysql_result_callback_t)(int id, unsigned int result);
 
 
 /* Global variables */
-static mysqla_connection_t  *first_async_connection; // Pointer to first connection (start of linked list)
-static mysqla_task_t        *first_async_task;       // Pointer to first task (start of linked list)
+static mysqla_connection_t  *first_async_connection; // Pointer to first connection (start of linked list). Connections are only ever prepended
+static mysqla_task_t        *first_async_task;       // Pointer to first task not yet delivered to GSC (game thread only)
+static mysqla_task_t        *last_async_task;        // Pointer to last task not yet delivered to GSC (game thread only)
+static mysqla_queue_t        mysqla_submit_queue;     // Tasks submitted by the game thread, consumed by the dispatcher
+static mysqla_queue_t        mysqla_done_queue;       // Tasks finished by the workers, consumed by the game thread
 static MYSQL                *sync_mysql_connection;
-static pthread_mutex_t       mysqla_lock;
+static mysqls_nb_query_t    *mysqls_nb_first;        // Oldest non-blocking query GSC hasn't been notified of (game thread only)
+static mysqls_nb_query_t    *mysqls_nb_last;         // Newest non-blocking query
+static int                   mysqls_nb_next_id;      // Id handed out to the next non-blocking query
+static pthread_mutex_t       mysqla_lock;             // Only used for the dispatcher to sleep on, never held while doing work
 static pthread_mutex_t       mysqla_file_lock;
+static pthread_cond_t        mysqla_dispatch_cond;    // Wakes up the dispatcher (used with mysqla_lock)
+static bool                  mysqla_dispatch_pending; // Whether the dispatcher has work to look at (protected by mysqla_lock)
 
 //static mysql_result_callback_t mysql_result_callback;
 static int mysql_result_callback;
+static int mysqla_batch_callback;                             // GSC function receiving batches of results, see mysqla_set_batch_delivery()
+static int mysqla_delivery_mode;                              // MYSQLA_DELIVERY_*
+
+// Task and query text memory. Tasks are only created and freed by the game thread, so none of this needs locking
+static mysqla_task_t        *mysqla_free_tasks;                      // Recycled task objects
+static char                 *mysqla_free_text[MYSQLA_TEXT_CLASSES];  // Recycled query text blocks, per size class
+static char                 *mysqla_text_chunk;                      // Chunk new query text blocks are carved from
+static int                   mysqla_text_chunk_used;                 // Bytes of mysqla_text_chunk handed out so far
+static int                   mysqla_live_tasks;                      // Tasks currently allocated
+static int                   mysqla_slab_bytes;                      // Bytes allocated for tasks and query text
+
+static mysqla_coalesce_group_t mysqla_coalesce_groups[MYSQLA_COALESCE_MAX_GROUPS]; // INSERTs held back this frame (game thread only)
+static int                   mysqla_coalesce_group_count;
+static int                   mysqla_coalesce_max_rows;                // Rows per coalesced INSERT, 0 (default) disables coalescing
+
+static mysqla_task_t        *mysqla_streams;                          // Streaming tasks that haven't ended yet (game thread only)
+
+static mysqla_task_t        *mysqla_flights[MYSQLA_FLIGHT_BUCKETS];   // Reads in flight identical reads may join (game thread only)
+static int                   mysqla_flight_count;
+static bool                  mysqla_single_flight;                    // Whether identical reads share one execution, false (default) to execute each
+
+static mysqla_statement_t   *mysqla_statements;                      // Registered prepared statements, handle - 1 is the index (game thread only)
+static int                   mysqla_statement_count;
+
+static mysqla_task_t        *mysqla_entity_tasks[MYSQLA_MAX_ENTITIES]; // Outstanding tasks per entity number (game thread only)
+
+// Queue limits. Set by GSC, the counters are increased by the game thread and decreased by whoever finishes a task
+static int                   mysqla_queued_tasks;                    // Tasks submitted but not finished by a worker yet
+static int                   mysqla_queued_bytes;                    // Query text and parameter bytes of those tasks
+static int                   mysqla_max_queued_tasks;                // 0 (default) for no limit
+static int                   mysqla_max_queued_bytes;                // 0 (default) for no limit
+static int                   mysqla_queue_policy;                    // MYSQLA_POLICY_* applied when a limit is reached
+static int                   mysqla_block_timeout_ms;                // Longest wait of MYSQLA_POLICY_BLOCK
+static bool                  mysqla_admission_waiting;               // Whether the game thread waits for tasks to finish
+static pthread_mutex_t       mysqla_admission_lock;
+static pthread_cond_t        mysqla_admission_cond;                  // Signalled when a task finishes while the game thread waits
+
+// Ordered execution. Only the dispatcher ever touches the lanes, so they need no locking
+static mysqla_lane_t        *mysqla_lanes[MYSQLA_LANE_BUCKETS];     // Lanes with a pending or running task, hashed by key
+static mysqla_lane_t        *mysqla_free_lanes;                     // Recycled lanes
+
+// Servers the connections go to. Reads are routed to the replicas if there are any
+static mysqla_pool_t        *mysqla_pools;                           // Primary and replica pools (added by the game thread, walked by the dispatcher and the opener)
+static int                   mysqla_default_timeout_ms;              // Deadline of tasks created without one, 0 (default) for none
+static bool                  mysqla_watchdog_started;                // Whether the thread killing queries past their deadline runs
+static bool                  mysqla_sizing_enabled;                  // Whether any pool is sized dynamically
+static int                   mysqla_ping_interval_ms = 60000;        // Idle time after which a connection is pinged, 0 for never
+static int                   mysqla_breaker_threshold = 3;           // Consecutive failures that open a pool's circuit breaker, 0 to never open it
+static bool                  mysqla_opener_started;                  // Whether the thread opening connections for the pool sizing runs
+static bool                  mysqla_opener_pending;                  // Whether the opener has requests to look at (protected by mysqla_opener_lock)
+static pthread_mutex_t       mysqla_opener_lock;
+static pthread_cond_t        mysqla_opener_cond;                     // Wakes up the opener when a pool needs another connection
+static int                   mysqla_replica_connections;             // Connected connections to replicas, read by the dispatcher
+static long long             mysqla_entity_write_ms[MYSQLA_MAX_ENTITIES]; // mysqla_time_ms() of each entity's last write (game thread only)
+static int                   mysqla_read_your_writes_ms = 2000;      // How long an entity's reads stay on the primary after it wrote
+
+// Database the connections were made to, kept for connections made later on
+static char                 *mysqla_db_host;
+static char                 *mysqla_db_user;
+static char                 *mysqla_db_pass;
+static char                 *mysqla_db_name;
+static int                   mysqla_db_port;
+
+// Spool of writes that couldn't reach the database. Protected by mysqla_spool_lock
+static pthread_mutex_t       mysqla_spool_lock;
+static pthread_cond_t        mysqla_spool_cond;                      // Wakes up the replayer when a write is spooled
+static int                   mysqla_spool_fd = -1;
+static char                 *mysqla_spool_map;                       // The mapped spool file
+static size_t                mysqla_spool_size;                      // Mapped size of the spool file
+static bool                  mysqla_spool_pending;                   // Whether the spool holds writes (also read without the lock)
+
+// Scheduling of the priority classes. Set by GSC, read by the dispatcher
+static int                   mysqla_reserved_connections;            // Connections kept free for interactive tasks
+static int                   mysqla_priority_weights[MYSQLA_PRIORITY_CLASSES] = { 4, 2, 1 }; // Share of the connections per class
+static mysqla_priority_stats_t mysqla_priority_stats[MYSQLA_PRIORITY_CLASSES];
+
+static mysqla_metrics_t      mysqla_metrics;
+static long long             mysqla_stats_read_us[2];                // When each stats reader (MYSQLA_STATS_*) last read the busy times
+static int                   mysqla_stats_interval = 60;             // Seconds between writes of the stats file, 0 disables it
+
+// Result cache, only used by the game thread
+static mysqla_cache_entry_t *mysqla_cache_buckets[MYSQLA_CACHE_BUCKETS];
+static mysqla_cache_entry_t *mysqla_cache_newest;                    // Most recently used entry
+static mysqla_cache_entry_t *mysqla_cache_oldest;                    // Least recently used entry, evicted first
+static int                   mysqla_cache_bytes;                     // Bytes used by the cached entries
+static int                   mysqla_cache_max_bytes;                 // Memory cap of the cache, 0 (default) disables caching
 
 
 /* Const variables */
@@ -58,509 +459,6530 @@ static int mysql_result_callback;
 
 /* Local functions */
 
+/*
+ * Initialize an empty queue
+ */
+static void mysqla_queue_init(mysqla_queue_t *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
 
+/*
+ * Append a node to the queue. Wait-free, may be called from any thread.
+ */
+static void mysqla_queue_push(mysqla_queue_t *queue, mysqla_qnode_t *node)
+{
+    node->next = NULL;
+    
+    // Claim the head first, then link the previous head to us. Until that link is made the consumer
+    // simply doesn't see this node yet and picks it up on a later pop.
+    mysqla_qnode_t *prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
 
-/* Public functions */
-
-/************************************************************
- *              Functions !NOT! callable from GSC           *
- ************************************************************/
- 
 /*
- * Push all fields of all rows from result to the GSC caller
+ * Remove the oldest node from the queue, or return NULL if there is none (yet).
+ * Note: Only the single consumer of the queue may call this.
  */
-static void pushResultRows(MYSQL_RES *result)
+static mysqla_qnode_t *mysqla_queue_pop(mysqla_queue_t *queue)
 {
-    stackPushArray();
+    mysqla_qnode_t *tail = queue->tail;
+    mysqla_qnode_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
     
-    int num_rows = mysql_num_rows(result);
-    for(int i = 0; i < num_rows; i++)
+    // Skip over the stub node
+    if(tail == &queue->stub)
     {
-        MYSQL_ROW row = mysql_fetch_row(result);
-        
-        stackPushArray();
-        
-        int num_fields = mysql_num_fields(result);
-        for(int j = 0; j < num_fields; j++)
-        {
-            if(row[j])
-                stackPushString(row[j]);
-            else
-                stackPushUndefined();
-            
-            stackPushArrayLast();
-        }
+        if(next == NULL)
+            return NULL;
         
-        stackPushArrayLast();
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
     }
+    
+    if(next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    
+    // A producer is halfway through a push, the node will be available on a later pop
+    if(tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    
+    // The tail is the very last node. Put the stub behind it so it can be handed out
+    mysqla_queue_push(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if(next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    
+    return NULL;
 }
- 
+
 /*
- * Call the result callback for each finished MySQL task.
- * Note: This is called from onFrame function by the server.
- *       If this starts lagging, add a break statement after calling a callback.
+ * Get the size of the query text blocks of a size class
  */
-void mysql_handle_result_callbacks(void)
+static int mysqla_text_class_size(int sizeClass)
 {
-    // Ensure we have a callback function active
-    if(mysql_result_callback == 0)
-        return;
+    int base = 1 << (MYSQLA_TEXT_MIN_SHIFT + sizeClass / MYSQLA_TEXT_STEPS);
+    return base + (sizeClass % MYSQLA_TEXT_STEPS) * (base / MYSQLA_TEXT_STEPS);
+}
+
+/*
+ * Get the size class of a query text block that can hold size bytes.
+ * Returns MYSQLA_TEXT_CLASSES if it's too large for any class.
+ */
+static int mysqla_text_class(int size)
+{
+    if(size <= (1 << MYSQLA_TEXT_MIN_SHIFT))
+        return 0;
     
-    pthread_mutex_lock(&mysqla_lock);
+    // The power of two below size picks the doubling, the rest of it the step within that doubling
+    int shift = 31 - __builtin_clz(size - 1);
+    int base = 1 << shift;
+    int sizeClass = (shift - MYSQLA_TEXT_MIN_SHIFT) * MYSQLA_TEXT_STEPS + (size - 1 - base) / (base / MYSQLA_TEXT_STEPS) + 1;
     
-    mysqla_task_t *ptr_taskIterator = first_async_task;
-    while(ptr_taskIterator != NULL)
+    return (sizeClass < MYSQLA_TEXT_CLASSES) ? sizeClass : MYSQLA_TEXT_CLASSES;
+}
+
+/*
+ * Put a block on the recycled list of its size class
+ */
+static void mysqla_recycle_text(char *block, int sizeClass)
+{
+    *(char **)block = mysqla_free_text[sizeClass];
+    mysqla_free_text[sizeClass] = block;
+}
+
+/*
+ * Take a recycled block (for query text or statement parameters) just large enough to hold size bytes
+ */
+static char *mysqla_alloc_block(int size)
+{
+    int sizeClass = mysqla_text_class(size);
+    char *block;
+    
+    if(sizeClass == MYSQLA_TEXT_CLASSES) // Huge queries are rare, don't bother recycling them
+    {
+        block = (char *)malloc(size);
+        if(block == NULL)
+            return NULL;
+        
+        mysqla_slab_bytes += size;
+    }
+    else if(mysqla_free_text[sizeClass] != NULL)
     {
-        // Remember the next task in case we're about to delete the current task
-        mysqla_task_t *ptr_nextTask = ptr_taskIterator->next;
+        block = mysqla_free_text[sizeClass];
+        mysqla_free_text[sizeClass] = *(char **)block;
+    }
+    else
+    {
+        int blockSize = mysqla_text_class_size(sizeClass);
         
-        // Check if the task is done
-        if(ptr_taskIterator->done)
+        // Start a new chunk when this one is full. Its leftover space is recycled as smaller blocks
+        if(mysqla_text_chunk == NULL || mysqla_text_chunk_used + blockSize > MYSQLA_TEXT_CHUNK_SIZE)
         {
-            // Result could be NULL due to MySQL error
-            if(ptr_taskIterator->result != NULL)
-            {
-                // Pass the results to the GSC
-                pushResultRows(ptr_taskIterator->result);
-                
-                // Free the MySQL result structure
-                mysql_free_result(ptr_taskIterator->result);
-                ptr_taskIterator->result = NULL;
-            }
-            else // No result, probably due to error
-            {
-                stackPushUndefined();
-            }
-            
-            stackPushInt(ptr_taskIterator->taskId);
-            
-            // Call the callback. If the query was executed on a player, call it on a specific player
-            bool startedThread = false;
-            int threadId;
-            if(ptr_taskIterator->entity != NULL)
+            if(mysqla_text_chunk != NULL)
             {
-                // We don't want to call a callback on a disconnected player
-                if(ptr_taskIterator->entityDisconnected == false)
+                for(int i = MYSQLA_TEXT_CLASSES - 1; i >= 0; i--)
                 {
-										printf("trying to call the callback on a player\n");
-                    startedThread = true;
-                    threadId = Scr_ExecEntThread(ptr_taskIterator->entity, (int)mysql_result_callback, 2);
+                    int leftoverSize = mysqla_text_class_size(i);
+                    while(mysqla_text_chunk_used + leftoverSize <= MYSQLA_TEXT_CHUNK_SIZE)
+                    {
+                        mysqla_recycle_text(mysqla_text_chunk + mysqla_text_chunk_used, i);
+                        mysqla_text_chunk_used += leftoverSize;
+                    }
                 }
             }
-            else
-            {
-								printf("trying to call the callback on the level\n");
-                startedThread = true;
-                threadId = Scr_ExecThread((int)mysql_result_callback, 2);
-            }
-            
-            // Regardless of who it was called on, free the thread
-            if(startedThread)
-                Scr_FreeThread(threadId);
             
-            // Remove the task from the linked list as it's finished now
-            if(ptr_taskIterator->prev != NULL)
-                ptr_taskIterator->prev->next = ptr_taskIterator->next;
-            else
-                first_async_task = ptr_taskIterator->next;
-            
-            if(ptr_taskIterator->next != NULL)
-                ptr_taskIterator->next->prev = ptr_taskIterator->prev;
+            char *chunk = (char *)malloc(MYSQLA_TEXT_CHUNK_SIZE);
+            if(chunk == NULL)
+                return NULL;
             
-            // Free up the memory used by this task
-            delete ptr_taskIterator;
+            mysqla_text_chunk = chunk;
+            mysqla_text_chunk_used = 0;
+            mysqla_slab_bytes += MYSQLA_TEXT_CHUNK_SIZE;
         }
         
-        // We may have deleted the current task
-        ptr_taskIterator = ptr_nextTask;
+        block = mysqla_text_chunk + mysqla_text_chunk_used;
+        mysqla_text_chunk_used += blockSize;
     }
     
-    pthread_mutex_unlock(&mysqla_lock);
+    return block;
 }
 
 /*
- * Log a MySQL error to the server's MySQL file (which gets created if it doesn't exist)
+ * Give a block obtained from mysqla_alloc_block() back for reuse
  */
-static void log_mysql_error(const char *query, const int error, const char *strError)
+static void mysqla_free_block(char *block, int size)
 {
-    char filePathBuf[32] = {0};
-    snprintf(filePathBuf, sizeof(filePathBuf), "../mysql_errors_%d.log", Shared_GetPort());
+    int sizeClass = mysqla_text_class(size);
+    if(sizeClass == MYSQLA_TEXT_CLASSES)
+    {
+        free(block);
+        mysqla_slab_bytes -= size;
+    }
+    else
+    {
+        mysqla_recycle_text(block, sizeClass);
+    }
+}
+
+/*
+ * Copy query text into a recycled text block just large enough to hold it (without truncating)
+ */
+static char *mysqla_alloc_text(const char *text, int len)
+{
+    char *block = mysqla_alloc_block(len + 1);
+    if(block == NULL)
+        return NULL;
     
-    pthread_mutex_lock(&mysqla_file_lock);
+    memcpy(block, text, len);
+    block[len] = '\0';
     
-    FILE *mysqlFile = fopen(filePathBuf, "a");
-    if(mysqlFile != NULL)
+    return block;
+}
+
+/*
+ * Take a task object from the recycled list, allocating a new slab of them if needed.
+ * The task's query text is copied into a text block of the required size.
+ */
+static mysqla_task_t *mysqla_alloc_task(const char *query)
+{
+    if(mysqla_free_tasks == NULL)
     {
-        fprintf(mysqlFile, "Query \"%s\" caused error %d (%s)\n", query, error, strError);
-        fclose(mysqlFile);
+        mysqla_task_t *ptr_slab = (mysqla_task_t *)malloc(sizeof(mysqla_task_t) * MYSQLA_TASK_SLAB_COUNT);
+        if(ptr_slab == NULL)
+            return NULL;
+        
+        mysqla_slab_bytes += sizeof(mysqla_task_t) * MYSQLA_TASK_SLAB_COUNT;
+        
+        for(int i = 0; i < MYSQLA_TASK_SLAB_COUNT; i++)
+        {
+            ptr_slab[i].next = mysqla_free_tasks;
+            mysqla_free_tasks = &ptr_slab[i];
+        }
     }
     
-    pthread_mutex_unlock(&mysqla_file_lock);
+    int queryLen = strlen(query);
+    char *ptr_text = mysqla_alloc_text(query, queryLen);
+    if(ptr_text == NULL)
+        return NULL;
+    
+    mysqla_task_t *ptr_task = mysqla_free_tasks;
+    mysqla_free_tasks = ptr_task->next;
+    
+    ptr_task->query = ptr_text;
+    ptr_task->queryLen = queryLen;
+    ptr_task->stmtId = 0;
+    ptr_task->numParams = 0;
+    ptr_task->paramBytes = 0;
+    ptr_task->params = NULL;
+    ptr_task->groupSize = 0;
+    ptr_task->groupFailed = false;
+    ptr_task->groupResults = NULL;
+    ptr_task->streamChunkRows = 0;
+    ptr_task->valuesOffset = 0;
+    ptr_task->coalesced = NULL;
+    ptr_task->cacheTtl = 0;
+    ptr_task->priority = MYSQLA_PRIORITY_NORMAL;
+    ptr_task->persist = false;
+    ptr_task->idempotent = false;
+    ptr_task->state = MYSQLA_STATE_WAITING;
+    ptr_task->timeoutMs = 0;
+    ptr_task->deadlineUs = 0;
+    ptr_task->lane = 0;
+    ptr_task->timedOut = false;
+    ptr_task->inFlight = false;
+    ptr_task->followers = NULL;
+    
+    mysqla_live_tasks++;
+    
+    return ptr_task;
 }
 
 /*
- * Asynchronously execute a MySQL query with the specified connection handler
+ * Give a task object, its query text and its parameters back for reuse
  */
-static void *mysqla_execute_query(void *ptr_conn_arg)
+static void mysqla_free_task(mysqla_task_t *ptr_task)
 {
-    mysqla_connection_t *ptr_conn = (mysqla_connection_t *)ptr_conn_arg;
-    printf("trying to execute query %s\n", ptr_conn->task->query);
-    if(mysql_query(ptr_conn->connection, ptr_conn->task->query) == MYSQL_NO_ERROR)
+    mysqla_free_block(ptr_task->query, ptr_task->queryLen + 1);
+    
+    if(ptr_task->params != NULL)
+        mysqla_free_block((char *)ptr_task->params, ptr_task->paramBytes);
+    
+    ptr_task->next = mysqla_free_tasks;
+    mysqla_free_tasks = ptr_task;
+    
+    mysqla_live_tasks--;
+}
+
+/*
+ * Count the ? placeholders of a statement, skipping quoted strings
+ */
+static int mysqla_count_placeholders(const char *query)
+{
+    int count = 0;
+    char quote = 0;
+    
+    for(const char *c = query; *c != '\0'; c++)
     {
-        // Only store the result if GSC wanted us to
-        if(ptr_conn->task->save)
+        if(quote != 0)
         {
-            // Check if we can obtain a result from the query
-            ptr_conn->task->result = mysql_store_result(ptr_conn->connection);
+            if(*c == '\\' && c[1] != '\0')
+                c++;
+            else if(*c == quote)
+                quote = 0;
         }
-        else
+        else if(*c == '\'' || *c == '"' || *c == '`')
         {
-            MYSQL_RES *result = mysql_store_result(ptr_conn->connection);
-            if(result != NULL)
-            {
-                mysql_free_result(result);
-            }
+            quote = *c;
+        }
+        else if(*c == '?')
+        {
+            count++;
         }
-    }
-    else
-    {
-        const char *strError = mysql_error(ptr_conn->connection);
-        const int error = mysql_errno(ptr_conn->connection);
-        
-        printf("ERROR: MySQL query (%s) failed with error %d (%s)\n", ptr_conn->task->query, error, strError);
-        
-        // Handle the file IO for appending to our mysql error log file
-        log_mysql_error(ptr_conn->task->query, error, strError);
     }
     
-    pthread_mutex_lock(&mysqla_lock);
+    return count;
+}
 
-    ptr_conn->task->done = true;
-    ptr_conn->task = NULL;
+/*
+ * Skip a quoted string or a parenthesized expression (which may contain quoted strings).
+ * Returns a pointer just past the closing character, or NULL if it isn't closed.
+ */
+static const char *mysqla_skip_group(const char *c)
+{
+    char open = *c;
+    char close = (open == '(') ? ')' : open;
+    int depth = 0;
     
-    pthread_mutex_unlock(&mysqla_lock);
+    for(c++; *c != '\0'; c++)
+    {
+        if(open != '(')
+        {
+            if(*c == '\\' && c[1] != '\0')
+                c++;
+            else if(*c == close)
+                return c + 1;
+        }
+        else if(*c == '\'' || *c == '"' || *c == '`')
+        {
+            c = mysqla_skip_group(c);
+            if(c == NULL)
+                return NULL;
+            c--;
+        }
+        else if(*c == '(')
+        {
+            depth++;
+        }
+        else if(*c == ')')
+        {
+            if(depth == 0)
+                return c + 1;
+            depth--;
+        }
+    }
     
     return NULL;
 }
 
 /*
- * Asynchronous background MySQL handler.
- * Handles starting threads for each new MySQL query.
+ * Check whether a query is a plain "INSERT INTO table [(columns)] VALUES (...)[, (...)]" that can be merged
+ * with other INSERTs of the same shape. Returns the offset of the first row, or 0 if it can't be merged.
  */
-static void *mysqla_query_handler(void *unused)
+static int mysqla_get_values_offset(const char *query)
 {
-    // Only need to start the handler once. Starting it multiple times is a developer error.
-    static bool started = false;
-    if(started)
-    {
-        printf("ERROR: mysqla_query_handler() async handler already started.\n");
-        return NULL;
-    }
+    const char *c = query;
+    while(*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r')
+        c++;
     
-    started = true;
+    if(strncasecmp(c, "INSERT", 6) != 0)
+        return 0;
     
-    // The first connection should be initialized before this function is called!
-    mysqla_connection_t *ptr_conn = first_async_connection;
-    if(ptr_conn == NULL)
+    // Find the VALUES keyword, outside of strings and parentheses
+    const char *values = NULL;
+    for(c += 6; *c != '\0' && values == NULL; )
     {
-        printf("ERROR: mysqla_query_handler() async handler started before any connection was initialized\n");
-        started = false;
-        return NULL;
+        if(*c == '\'' || *c == '"' || *c == '`' || *c == '(')
+        {
+            c = mysqla_skip_group(c);
+            if(c == NULL)
+                return 0;
+        }
+        else if(strncasecmp(c, "VALUES", 6) == 0 && (c[6] == ' ' || c[6] == '(' || c[6] == '\t' || c[6] == '\n'))
+        {
+            values = c + 6;
+        }
+        else if(strncasecmp(c, "SELECT", 6) == 0)
+        {
+            return 0;
+        }
+        else
+        {
+            c++;
+        }
     }
     
-    // Infinite loop, because this threaded function is the background handler
-    mysqla_task_t *ptr_task;
-    while(true)
+    if(values == NULL)
+        return 0;
+    
+    // Everything after VALUES must be rows, nothing like ON DUPLICATE KEY UPDATE
+    while(*values == ' ' || *values == '\t' || *values == '\n' || *values == '\r')
+        values++;
+    
+    const char *row = values;
+    while(*row == '(')
     {
-        // Lock access to MySQL global variables
-        pthread_mutex_lock(&mysqla_lock);
+        row = mysqla_skip_group(row);
+        if(row == NULL)
+            return 0;
+        
+        while(*row == ' ' || *row == '\t' || *row == '\n' || *row == '\r')
+            row++;
         
-        // Grab the first entries of the linked list
-        ptr_task = first_async_task;
-        ptr_conn = first_async_connection;
-        while(ptr_task != NULL)
+        if(*row == ',')
+        {
+            row++;
+            while(*row == ' ' || *row == '\t' || *row == '\n' || *row == '\r')
+                row++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    
+    if(*row == ';')
+        row++;
+    
+    while(*row == ' ' || *row == '\t' || *row == '\n' || *row == '\r')
+        row++;
+    
+    if(row == values || *row != '\0')
+        return 0;
+    
+    return values - query;
+}
+
+/*
+ * Length of the rows part of a query that can be coalesced, without a trailing semicolon or whitespace
+ */
+static int mysqla_get_values_length(const mysqla_task_t *ptr_task)
+{
+    int end = ptr_task->queryLen;
+    while(end > ptr_task->valuesOffset && strchr(" \t\n\r;", ptr_task->query[end - 1]) != NULL)
+        end--;
+    
+    return end - ptr_task->valuesOffset;
+}
+
+/*
+ * Allocate an empty row buffer with room for the offsets of maxRows rows.
+ * If the size of the data is known up front, it's allocated in the same block (and never has to grow).
+ */
+static mysqla_rows_t *mysqla_alloc_rows(int maxRows, int numFields, int dataSize)
+{
+    int offsetsSize = sizeof(int) * maxRows * numFields;
+    
+    mysqla_rows_t *rows = (mysqla_rows_t *)malloc(sizeof(mysqla_rows_t) + offsetsSize + numFields + dataSize);
+    if(rows == NULL)
+        return NULL;
+    
+    rows->numRows = 0;
+    rows->numFields = numFields;
+    rows->offsets = (int *)(rows + 1);
+    rows->types = (char *)rows->offsets + offsetsSize;
+    rows->data = (dataSize > 0) ? rows->types + numFields : NULL;
+    rows->dataLen = 0;
+    rows->dataSize = dataSize;
+    rows->dataInline = (dataSize > 0);
+    rows->refs = 1;
+    
+    memset(rows->types, MYSQLA_CELL_STRING, numFields);
+    
+    return rows;
+}
+
+/*
+ * Get the type the values of a column are passed to GSC as, the same for every row.
+ * Integer columns whose values may not fit in a GSC int (BIGINT, INT UNSIGNED) are passed as strings,
+ * as are DECIMALs, which a float can't hold exactly.
+ */
+static char mysqla_column_type(const MYSQL_FIELD *field)
+{
+    switch(field->type)
+    {
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_YEAR:
+            return MYSQLA_CELL_INT;
+        case MYSQL_TYPE_LONG:
+            return (field->flags & UNSIGNED_FLAG) ? MYSQLA_CELL_STRING : MYSQLA_CELL_INT;
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+            return MYSQLA_CELL_FLOAT;
+        default:
+            return MYSQLA_CELL_STRING;
+    }
+}
+
+/*
+ * Set the column types of a row buffer from the field metadata of the result
+ */
+static void mysqla_set_column_types(mysqla_rows_t *rows, const MYSQL_FIELD *fields)
+{
+    for(int j = 0; j < rows->numFields; j++)
+        rows->types[j] = mysqla_column_type(&fields[j]);
+}
+
+/*
+ * Get the amount of bytes a value of a column takes in a row buffer
+ */
+static int mysqla_cell_size(char columnType, unsigned long len)
+{
+    if(columnType == MYSQLA_CELL_STRING)
+        return 1 + len + 1;
+    
+    return 1 + sizeof(int);
+}
+
+/*
+ * Make sure the data of a row buffer can grow by at least len bytes
+ */
+static bool mysqla_reserve_rows(mysqla_rows_t *rows, int len)
+{
+    if(rows->dataLen + len <= rows->dataSize)
+        return true;
+    
+    int newSize = (rows->dataSize == 0) ? 256 : rows->dataSize;
+    while(newSize < rows->dataLen + len)
+        newSize *= 2;
+    
+    char *data;
+    if(rows->dataInline) // Pre-sized too small, move the data out of the block
+    {
+        data = (char *)malloc(newSize);
+        if(data != NULL)
+            memcpy(data, rows->data, rows->dataLen);
+    }
+    else
+    {
+        data = (char *)realloc(rows->data, newSize);
+    }
+    
+    if(data == NULL)
+        return false;
+    
+    rows->data = data;
+    rows->dataSize = newSize;
+    rows->dataInline = false;
+    
+    return true;
+}
+
+/*
+ * Convert a (terminated) value of the specified column to its type and add it to the end of a row buffer
+ */
+static bool mysqla_append_cell(mysqla_rows_t *rows, int *offset, int column, const char *value, unsigned long len)
+{
+    if(value == NULL)
+    {
+        *offset = -1;
+        return true;
+    }
+    
+    char type = rows->types[column];
+    int size = mysqla_cell_size(type, len);
+    
+    if(!mysqla_reserve_rows(rows, size))
+        return false;
+    
+    char *cell = rows->data + rows->dataLen;
+    cell[0] = type;
+    
+    if(type == MYSQLA_CELL_INT)
+    {
+        int intVal = atoi(value);
+        memcpy(cell + 1, &intVal, sizeof(int));
+    }
+    else if(type == MYSQLA_CELL_FLOAT)
+    {
+        float floatVal = strtod(value, NULL);
+        memcpy(cell + 1, &floatVal, sizeof(float));
+    }
+    else
+    {
+        memcpy(cell + 1, value, len);
+        cell[1 + len] = '\0';
+    }
+    
+    *offset = rows->dataLen;
+    rows->dataLen += size;
+    
+    return true;
+}
+
+/*
+ * Copy a row fetched from a MySQL result to the end of a row buffer
+ */
+static bool mysqla_append_row(mysqla_rows_t *rows, MYSQL_ROW row, const unsigned long *lengths)
+{
+    int *offsets = rows->offsets + rows->numRows * rows->numFields;
+    for(int j = 0; j < rows->numFields; j++)
+    {
+        if(!mysqla_append_cell(rows, &offsets[j], j, row[j], lengths[j]))
+            return false;
+    }
+    
+    rows->numRows++;
+    
+    return true;
+}
+
+/*
+ * Let go of result rows copied out of the client library, freeing them if nobody else holds them
+ */
+static void mysqla_free_rows(mysqla_rows_t *rows)
+{
+    if(--rows->refs > 0)
+        return;
+    
+    if(!rows->dataInline)
+        free(rows->data);
+    
+    free(rows);
+}
+
+/*
+ * Copy all rows of a stored MySQL result into a single pre-sized row buffer, so the result can be freed right away
+ * Note: Called from worker threads, so the game thread never has to walk a MySQL result.
+ */
+static mysqla_rows_t *mysqla_materialize_result(MYSQL_RES *result)
+{
+    int numRows = mysql_num_rows(result);
+    int numFields = mysql_num_fields(result);
+    MYSQL_FIELD *fields = mysql_fetch_fields(result);
+    
+    // The rows are already in client memory, so measuring them first is cheap and saves growing the buffer
+    int dataSize = 0;
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(result)) != NULL)
+    {
+        unsigned long *lengths = mysql_fetch_lengths(result);
+        for(int j = 0; j < numFields; j++)
+        {
+            if(row[j] != NULL)
+                dataSize += mysqla_cell_size(mysqla_column_type(&fields[j]), lengths[j]);
+        }
+    }
+    
+    mysqla_rows_t *rows = mysqla_alloc_rows(numRows, numFields, dataSize);
+    if(rows == NULL)
+        return NULL;
+    
+    mysqla_set_column_types(rows, fields);
+    
+    mysql_data_seek(result, 0);
+    while((row = mysql_fetch_row(result)) != NULL)
+        mysqla_append_row(rows, row, mysql_fetch_lengths(result));
+    
+    return rows;
+}
+
+/*
+ * Wake up the dispatcher because a task was submitted or a connection became idle
+ */
+static void mysqla_wake_dispatcher(void)
+{
+    pthread_mutex_lock(&mysqla_lock);
+    
+    mysqla_dispatch_pending = true;
+    pthread_cond_signal(&mysqla_dispatch_cond);
+    
+    pthread_mutex_unlock(&mysqla_lock);
+}
+
+/*
+ * Get a monotonic timestamp in microseconds
+ */
+static long long mysqla_time_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Get a monotonic timestamp in milliseconds
+ */
+static long long mysqla_time_ms(void)
+{
+    return mysqla_time_us() / 1000;
+}
+
+/*
+ * Count an event in one of the metrics counters. May be called from any thread.
+ */
+static void mysqla_metric_inc(int *counter)
+{
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add a measured value to a metrics histogram. May be called from any thread.
+ */
+static void mysqla_histogram_add(mysqla_histogram_t *histogram, int value)
+{
+    if(value < 0)
+        value = 0;
+    
+    int bucket = 0;
+    while(bucket < MYSQLA_HISTOGRAM_BUCKETS - 1 && (value >> bucket) != 0)
+        bucket++;
+    
+    __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum, value, __ATOMIC_RELAXED);
+    
+    int max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while(value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Estimate a percentile (0 to 100) of a metrics histogram, as the upper bound of the bucket it falls in
+ */
+static int mysqla_histogram_percentile(const mysqla_histogram_t *histogram, int percentile)
+{
+    int count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    int max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    if(count == 0)
+        return 0;
+    
+    long long wanted = ((long long)count * percentile + 99) / 100;
+    long long seen = 0;
+    for(int i = 0; i < MYSQLA_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if(seen >= wanted)
+        {
+            int bound = (i == 0) ? 0 : (int)((1u << i) - 1);
+            return (bound < max) ? bound : max;
+        }
+    }
+    
+    return max;
+}
+
+/*
+ * Get the average of a metrics histogram
+ */
+static float mysqla_histogram_average(const mysqla_histogram_t *histogram)
+{
+    int count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    if(count == 0)
+        return 0;
+    
+    return __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / (float)count;
+}
+
+/*
+ * Read the next keyword or name of a query into word (lowercased, without backticks).
+ * Quoted strings, numbers and symbols are skipped. Returns the position after the word, or NULL at the end of the query.
+ */
+static const char *mysqla_next_word(const char *c, char *word)
+{
+    while(*c != '\0')
+    {
+        if(*c == '\'' || *c == '"')
         {
-            if(!ptr_task->started)
+            char quote = *c++;
+            while(*c != '\0' && *c != quote)
             {
-                // Find an idle or unused connection 
-                while(ptr_conn != NULL && ptr_conn->task != NULL)
-                {
-                    ptr_conn = ptr_conn->next;
-                }
+                if(*c == '\\' && c[1] != '\0')
+                    c++;
                 
-                // Looped through all connections are there are none available
-                if(ptr_conn == NULL)
-                    break;
-                
-                ptr_task->started = true;
-                ptr_conn->task = ptr_task;
-                
-                // Create thread because we handle the query asynchronously.
-                // Let threaded mysqla_execute_query do the work
-                pthread_t query_thread;
-                int error = pthread_create(&query_thread, NULL, mysqla_execute_query, ptr_conn);
-                
-                if(error)
-                {
-                    printf("ERROR: mysqla_query_handler() can't create thread (%i)\n", error);
-                    break;
-                }
+                c++;
+            }
+            
+            if(*c != '\0')
+                c++;
+        }
+        else if(*c == '`' || isalpha((unsigned char)*c) || *c == '_')
+        {
+            bool quoted = (*c == '`');
+            if(quoted)
+                c++;
+            
+            int len = 0;
+            while(*c != '\0' && (quoted ? *c != '`' : (isalnum((unsigned char)*c) || *c == '_' || *c == '$')))
+            {
+                if(len < MYSQLA_MAX_WORD - 1)
+                    word[len++] = tolower((unsigned char)*c);
                 
-                // Allow the system to immediately dispose the thread when it's done
-                pthread_detach(query_thread);
-                ptr_conn = ptr_conn->next;
+                c++;
             }
             
-            // Loop through all tasks
-            ptr_task = ptr_task->next;
+            if(quoted && *c != '\0')
+                c++;
+            
+            word[len] = '\0';
+            return c;
         }
-        pthread_mutex_unlock(&mysqla_lock);
-        usleep(10000);
+        else if(isdigit((unsigned char)*c))
+        {
+            while(isalnum((unsigned char)*c) || *c == '.')
+                c++;
+        }
+        else
+        {
+            c++;
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * Whether a query holds more than one statement, i.e. a semicolon outside quotes that isn't trailing
+ */
+static bool mysqla_query_is_multiple(const char *query)
+{
+    char quote = 0;
+    for(const char *c = query; *c != '\0'; c++)
+    {
+        if(quote != 0)
+        {
+            if(*c == '\\' && c[1] != '\0')
+                c++;
+            else if(*c == quote)
+                quote = 0;
+        }
+        else if(*c == '\'' || *c == '"' || *c == '`')
+        {
+            quote = *c;
+        }
+        else if(*c == ';')
+        {
+            const char *rest = c + 1;
+            while(isspace((unsigned char)*rest) || *rest == ';')
+                rest++;
+            
+            if(*rest != '\0')
+                return true;
+        }
+    }
+    
+    return false;
+}
+
+/*
+ * Whether a query only reads data (and may be cached), judging by its first keyword.
+ * Stacked statements never count as a read, whatever comes after the first one may write.
+ */
+static bool mysqla_query_is_read(const char *query)
+{
+    if(mysqla_query_is_multiple(query))
+        return false;
+    
+    while(isspace((unsigned char)*query) || *query == '(')
+        query++;
+    
+    char word[MYSQLA_MAX_WORD];
+    if(mysqla_next_word(query, word) == NULL)
+        return false;
+    
+    return (strcmp(word, "select") == 0 || strcmp(word, "show") == 0 || strcmp(word, "describe") == 0 || strcmp(word, "desc") == 0 || strcmp(word, "explain") == 0);
+}
+
+/*
+ * Whether a query mentions the specified (lowercase) table name anywhere
+ */
+static bool mysqla_query_mentions(const char *query, const char *table)
+{
+    char word[MYSQLA_MAX_WORD];
+    while((query = mysqla_next_word(query, word)) != NULL)
+    {
+        if(strcmp(word, table) == 0)
+            return true;
+    }
+    
+    return false;
+}
+
+/*
+ * Copy a query into key with whitespace runs outside of strings collapsed into one space,
+ * and leading/trailing whitespace and semicolons removed. key must hold strlen(query) + 1 bytes.
+ * Returns the length of the key.
+ */
+static int mysqla_normalize_query(const char *query, char *key)
+{
+    int len = 0;
+    char quote = 0;
+    
+    while(isspace((unsigned char)*query))
+        query++;
+    
+    for(const char *c = query; *c != '\0'; c++)
+    {
+        if(quote != 0)
+        {
+            key[len++] = *c;
+            if(*c == '\\' && c[1] != '\0')
+                key[len++] = *++c;
+            else if(*c == quote)
+                quote = 0;
+        }
+        else if(isspace((unsigned char)*c))
+        {
+            if(len > 0 && key[len - 1] != ' ')
+                key[len++] = ' ';
+        }
+        else
+        {
+            if(*c == '\'' || *c == '"' || *c == '`')
+                quote = *c;
+            
+            key[len++] = *c;
+        }
+    }
+    
+    while(len > 0 && (key[len - 1] == ' ' || key[len - 1] == ';'))
+        len--;
+    
+    key[len] = '\0';
+    
+    return len;
+}
+
+/*
+ * FNV-1a hash of a cache key
+ */
+static unsigned int mysqla_cache_hash(const char *key)
+{
+    unsigned int hash = 2166136261u;
+    for(; *key != '\0'; key++)
+        hash = (hash ^ (unsigned char)*key) * 16777619u;
+    
+    return hash;
+}
+
+/*
+ * Remove an entry from the result cache and let go of its rows
+ */
+static void mysqla_cache_remove(mysqla_cache_entry_t *ptr_entry)
+{
+    mysqla_cache_entry_t **ptr_link = &mysqla_cache_buckets[ptr_entry->hash & (MYSQLA_CACHE_BUCKETS - 1)];
+    while(*ptr_link != ptr_entry)
+        ptr_link = &(*ptr_link)->nextInBucket;
+    
+    *ptr_link = ptr_entry->nextInBucket;
+    
+    if(ptr_entry->newer != NULL)
+        ptr_entry->newer->older = ptr_entry->older;
+    else
+        mysqla_cache_newest = ptr_entry->older;
+    
+    if(ptr_entry->older != NULL)
+        ptr_entry->older->newer = ptr_entry->newer;
+    else
+        mysqla_cache_oldest = ptr_entry->newer;
+    
+    mysqla_cache_bytes -= ptr_entry->size;
+    
+    mysqla_free_rows(ptr_entry->rows);
+    free(ptr_entry);
+}
+
+/*
+ * Find the unexpired cache entry of a normalized query, or return NULL
+ */
+static mysqla_cache_entry_t *mysqla_cache_find(const char *key)
+{
+    unsigned int hash = mysqla_cache_hash(key);
+    
+    mysqla_cache_entry_t *ptr_entry = mysqla_cache_buckets[hash & (MYSQLA_CACHE_BUCKETS - 1)];
+    while(ptr_entry != NULL && (ptr_entry->hash != hash || strcmp(ptr_entry->key, key) != 0))
+        ptr_entry = ptr_entry->nextInBucket;
+    
+    if(ptr_entry != NULL && ptr_entry->expires <= mysqla_time_ms())
+    {
+        mysqla_cache_remove(ptr_entry);
+        return NULL;
+    }
+    
+    return ptr_entry;
+}
+
+/*
+ * Look up the cached rows of a query. A hit becomes the most recently used entry.
+ * Returns the rows with a reference taken for the caller, or NULL on a miss.
+ */
+static mysqla_rows_t *mysqla_cache_lookup(const char *query)
+{
+    char *key = (char *)malloc(strlen(query) + 1);
+    if(key == NULL)
+        return NULL;
+    
+    mysqla_normalize_query(query, key);
+    mysqla_cache_entry_t *ptr_entry = mysqla_cache_find(key);
+    free(key);
+    
+    if(ptr_entry == NULL)
+        return NULL;
+    
+    // Move it to the front of the eviction order
+    if(ptr_entry->newer != NULL)
+    {
+        ptr_entry->newer->older = ptr_entry->older;
+        if(ptr_entry->older != NULL)
+            ptr_entry->older->newer = ptr_entry->newer;
+        else
+            mysqla_cache_oldest = ptr_entry->newer;
+        
+        ptr_entry->older = mysqla_cache_newest;
+        ptr_entry->newer = NULL;
+        mysqla_cache_newest->newer = ptr_entry;
+        mysqla_cache_newest = ptr_entry;
+    }
+    
+    ptr_entry->rows->refs++;
+    
+    return ptr_entry->rows;
+}
+
+/*
+ * Keep the result of a finished cacheable task, evicting the least recently used entries to stay below the memory cap
+ */
+static void mysqla_cache_store(mysqla_task_t *ptr_task)
+{
+    mysqla_rows_t *rows = ptr_task->rows;
+    int size = sizeof(mysqla_cache_entry_t) + ptr_task->queryLen + sizeof(mysqla_rows_t)
+        + rows->numRows * rows->numFields * sizeof(int) + rows->numFields + rows->dataSize;
+    
+    if(size > mysqla_cache_max_bytes)
+        return;
+    
+    mysqla_cache_entry_t *ptr_entry = (mysqla_cache_entry_t *)malloc(sizeof(mysqla_cache_entry_t) + ptr_task->queryLen);
+    if(ptr_entry == NULL)
+        return;
+    
+    mysqla_normalize_query(ptr_task->query, ptr_entry->key);
+    
+    // Another task for the same query may have finished first
+    mysqla_cache_entry_t *ptr_old = mysqla_cache_find(ptr_entry->key);
+    if(ptr_old != NULL)
+        mysqla_cache_remove(ptr_old);
+    
+    while(mysqla_cache_oldest != NULL && mysqla_cache_bytes + size > mysqla_cache_max_bytes)
+        mysqla_cache_remove(mysqla_cache_oldest);
+    
+    ptr_entry->hash = mysqla_cache_hash(ptr_entry->key);
+    ptr_entry->expires = mysqla_time_ms() + ptr_task->cacheTtl;
+    ptr_entry->size = size;
+    ptr_entry->rows = rows;
+    rows->refs++;
+    
+    mysqla_cache_entry_t **ptr_bucket = &mysqla_cache_buckets[ptr_entry->hash & (MYSQLA_CACHE_BUCKETS - 1)];
+    ptr_entry->nextInBucket = *ptr_bucket;
+    *ptr_bucket = ptr_entry;
+    
+    ptr_entry->newer = NULL;
+    ptr_entry->older = mysqla_cache_newest;
+    if(mysqla_cache_newest != NULL)
+        mysqla_cache_newest->newer = ptr_entry;
+    else
+        mysqla_cache_oldest = ptr_entry;
+    
+    mysqla_cache_newest = ptr_entry;
+    mysqla_cache_bytes += size;
+}
+
+/*
+ * Get the index of an entity in g_entities, or -1 if it isn't one
+ */
+static int mysqla_entity_index(gentity_t *entity)
+{
+    if(entity == NULL)
+        return -1;
+    
+    int num = entity - g_entities;
+    if(num < 0 || num >= MYSQLA_MAX_ENTITIES)
+        return -1;
+    
+    return num;
+}
+
+/*
+ * Whether a task may share the result of an identical read, or let identical reads share its own
+ */
+static bool mysqla_may_share_flight(const mysqla_task_t *ptr_task)
+{
+    if(!mysqla_single_flight || !ptr_task->save || !ptr_task->read || ptr_task->rows != NULL)
+        return false;
+    
+    if(ptr_task->stmtId != 0 || ptr_task->groupSize != 0 || ptr_task->streamChunkRows != 0 || ptr_task->lane != 0)
+        return false;
+    
+    // A read that is already running may not see the player's latest write yet
+    int num = mysqla_entity_index(ptr_task->entity);
+    if(num >= 0 && mysqla_time_ms() - mysqla_entity_write_ms[num] < mysqla_read_your_writes_ms)
+        return false;
+    
+    return true;
+}
+
+/*
+ * Let identical reads submitted from now on join a task that is about to be dispatched
+ */
+static void mysqla_enter_flight(mysqla_task_t *ptr_task)
+{
+    ptr_task->flightHash = mysqla_cache_hash(ptr_task->query);
+    ptr_task->inFlight = true;
+    
+    mysqla_task_t **ptr_bucket = &mysqla_flights[ptr_task->flightHash & (MYSQLA_FLIGHT_BUCKETS - 1)];
+    ptr_task->nextInFlight = *ptr_bucket;
+    *ptr_bucket = ptr_task;
+    mysqla_flight_count++;
+}
+
+/*
+ * Stop identical reads from joining a task, because it finished or may not see a write submitted after it
+ */
+static void mysqla_leave_flight(mysqla_task_t *ptr_task)
+{
+    if(!ptr_task->inFlight)
+        return;
+    
+    mysqla_task_t **ptr_link = &mysqla_flights[ptr_task->flightHash & (MYSQLA_FLIGHT_BUCKETS - 1)];
+    while(*ptr_link != ptr_task)
+        ptr_link = &(*ptr_link)->nextInFlight;
+    
+    *ptr_link = ptr_task->nextInFlight;
+    ptr_task->inFlight = false;
+    mysqla_flight_count--;
+}
+
+/*
+ * Find a read in flight with the same query text as a new task, so the new task can share its result.
+ * Returns NULL if the new task has to be executed itself.
+ */
+static mysqla_task_t *mysqla_find_flight(mysqla_task_t *ptr_task)
+{
+    if(mysqla_flight_count == 0 || !mysqla_may_share_flight(ptr_task))
+        return NULL;
+    
+    unsigned int hash = mysqla_cache_hash(ptr_task->query);
+    
+    mysqla_task_t *ptr_leader = mysqla_flights[hash & (MYSQLA_FLIGHT_BUCKETS - 1)];
+    while(ptr_leader != NULL && (ptr_leader->flightHash != hash || ptr_leader->queryLen != ptr_task->queryLen || strcmp(ptr_leader->query, ptr_task->query) != 0))
+        ptr_leader = ptr_leader->nextInFlight;
+    
+    if(ptr_leader == NULL)
+        return NULL;
+    
+    // A cancelled or expired read won't have a result to share
+    if(__atomic_load_n(&ptr_leader->state, __ATOMIC_ACQUIRE) == MYSQLA_STATE_CANCELLED)
+        return NULL;
+    
+    if(ptr_leader->deadlineUs != 0 && mysqla_time_us() >= ptr_leader->deadlineUs)
+        return NULL;
+    
+    return ptr_leader;
+}
+
+/*
+ * Hand the result of a finished read to the tasks that joined it, they complete along with it.
+ * Each follower takes a reference to the rows, and gets the read's timeout if it had one.
+ */
+static void mysqla_land_flight(mysqla_task_t *ptr_task)
+{
+    mysqla_leave_flight(ptr_task);
+    
+    mysqla_task_t *ptr_follower = ptr_task->followers;
+    ptr_task->followers = NULL;
+    
+    while(ptr_follower != NULL)
+    {
+        mysqla_task_t *ptr_next = ptr_follower->nextFollower;
+        
+        ptr_follower->rows = ptr_task->rows;
+        if(ptr_follower->rows != NULL)
+            ptr_follower->rows->refs++;
+        
+        ptr_follower->timedOut = ptr_task->timedOut;
+        mysqla_queue_push(&mysqla_done_queue, &ptr_follower->node);
+        
+        ptr_follower = ptr_next;
+    }
+}
+
+/*
+ * Drop every cached result, and keep results of cacheable tasks still in flight out of the cache
+ * (and from being shared with new reads)
+ */
+static void mysqla_cache_clear(void)
+{
+    while(mysqla_cache_oldest != NULL)
+        mysqla_cache_remove(mysqla_cache_oldest);
+    
+    for(mysqla_task_t *ptr_task = first_async_task; ptr_task != NULL; ptr_task = ptr_task->next)
+    {
+        ptr_task->cacheTtl = 0;
+        mysqla_leave_flight(ptr_task);
+    }
+}
+
+/*
+ * Drop the cached results that mention a table, including those of cacheable tasks still in flight
+ * (they may have read the table before the write). Reads in flight that mention it aren't shared anymore either.
+ */
+static void mysqla_cache_invalidate_table(const char *table)
+{
+    mysqla_cache_entry_t *ptr_entry = mysqla_cache_newest;
+    while(ptr_entry != NULL)
+    {
+        mysqla_cache_entry_t *ptr_older = ptr_entry->older;
+        if(mysqla_query_mentions(ptr_entry->key, table))
+            mysqla_cache_remove(ptr_entry);
+        
+        ptr_entry = ptr_older;
+    }
+    
+    for(mysqla_task_t *ptr_task = first_async_task; ptr_task != NULL; ptr_task = ptr_task->next)
+    {
+        if((ptr_task->cacheTtl > 0 || ptr_task->inFlight) && mysqla_query_mentions(ptr_task->query, table))
+        {
+            ptr_task->cacheTtl = 0;
+            mysqla_leave_flight(ptr_task);
+        }
+    }
+}
+
+/*
+ * Drop the cached results a query may change. Each name following UPDATE, INTO, FROM, JOIN, TABLE etc. is
+ * taken as a written table, which errs on the side of dropping too much. If no table can be found, everything is dropped.
+ */
+static void mysqla_cache_invalidate(const char *query)
+{
+    static const char *targets[] = { "update", "into", "from", "join", "table", "truncate", "insert", "replace", "delete", NULL };
+    static const char *modifiers[] = { "low_priority", "high_priority", "delayed", "ignore", "quick", "temporary", "if", "not", "exists", NULL };
+    
+    bool found = false;
+    bool expectTable = false;
+    char word[MYSQLA_MAX_WORD];
+    
+    const char *c = query;
+    while((c = mysqla_next_word(c, word)) != NULL)
+    {
+        bool isTarget = false;
+        for(int i = 0; targets[i] != NULL && !isTarget; i++)
+            isTarget = (strcmp(word, targets[i]) == 0);
+        
+        if(isTarget)
+        {
+            expectTable = true;
+            continue;
+        }
+        
+        if(!expectTable)
+            continue;
+        
+        bool isModifier = false;
+        for(int i = 0; modifiers[i] != NULL && !isModifier; i++)
+            isModifier = (strcmp(word, modifiers[i]) == 0);
+        
+        if(isModifier)
+            continue;
+        
+        // Qualified as database.table, the table is what cached queries mention
+        while(*c == '.')
+        {
+            const char *next = mysqla_next_word(c + 1, word);
+            if(next == NULL)
+                break;
+            
+            c = next;
+        }
+        
+        mysqla_cache_invalidate_table(word);
+        found = true;
+        expectTable = false;
+    }
+    
+    if(!found)
+        mysqla_cache_clear();
+}
+
+/*
+ * Stop counting a task (and the INSERTs merged into it) against the queue limits, waking up the game thread
+ * if it's waiting for room. Called once per task, by whoever finishes or cancels it.
+ */
+static void mysqla_leave_queue(mysqla_task_t *ptr_task)
+{
+    for(; ptr_task != NULL; ptr_task = ptr_task->coalesced)
+    {
+        __atomic_sub_fetch(&mysqla_queued_tasks, 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&mysqla_queued_bytes, ptr_task->queuedBytes, __ATOMIC_SEQ_CST);
+    }
+    
+    if(__atomic_load_n(&mysqla_admission_waiting, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&mysqla_admission_lock);
+        pthread_cond_signal(&mysqla_admission_cond);
+        pthread_mutex_unlock(&mysqla_admission_lock);
+    }
+}
+
+/*
+ * Cancel a task that hasn't been started yet. Returns false if the dispatcher already started it.
+ * Note: Only called from the game thread. The dispatcher hands cancelled tasks straight back to it.
+ */
+static bool mysqla_cancel_task(mysqla_task_t *ptr_task)
+{
+    int state = MYSQLA_STATE_WAITING;
+    if(!__atomic_compare_exchange_n(&ptr_task->state, &state, MYSQLA_STATE_CANCELLED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return false;
+    
+    mysqla_leave_queue(ptr_task);
+    return true;
+}
+
+
+/* Public functions */
+
+/************************************************************
+ *              Functions !NOT! callable from GSC           *
+ ************************************************************/
+ 
+/*
+ * Push a field value from a MySQL result to the GSC caller as an int, float, string or undefined (NULL)
+ */
+static void pushResultValue(const MYSQL_FIELD *field, const char *value)
+{
+    if(value == NULL)
+    {
+        stackPushUndefined();
+        return;
+    }
+    
+    switch(mysqla_column_type(field))
+    {
+        case MYSQLA_CELL_INT:
+            stackPushInt(atoi(value));
+            break;
+        case MYSQLA_CELL_FLOAT:
+            stackPushFloat(strtod(value, NULL));
+            break;
+        default:
+            stackPushString(value);
+            break;
+    }
+}
+
+/*
+ * Push all fields of all rows from result to the GSC caller.
+ * With scalar set, a single-row, single-column result is pushed as the value itself (and no rows as undefined).
+ */
+static void pushResultRows(MYSQL_RES *result, bool scalar)
+{
+    int num_rows = mysql_num_rows(result);
+    int num_fields = mysql_num_fields(result);
+    MYSQL_FIELD *fields = mysql_fetch_fields(result);
+    
+    if(scalar && num_rows <= 1 && num_fields == 1)
+    {
+        if(num_rows == 0)
+            stackPushUndefined();
+        else
+            pushResultValue(&fields[0], mysql_fetch_row(result)[0]);
+        
+        return;
+    }
+    
+    stackPushArray();
+    
+    for(int i = 0; i < num_rows; i++)
+    {
+        MYSQL_ROW row = mysql_fetch_row(result);
+        
+        stackPushArray();
+        
+        for(int j = 0; j < num_fields; j++)
+        {
+            pushResultValue(&fields[j], row[j]);
+            stackPushArrayLast();
+        }
+        
+        stackPushArrayLast();
+    }
+}
+
+/*
+ * Push a value stored in a row buffer to the GSC caller
+ */
+static void pushRowValue(const mysqla_rows_t *rows, int offset)
+{
+    if(offset < 0)
+    {
+        stackPushUndefined();
+        return;
+    }
+    
+    const char *cell = rows->data + offset;
+    switch(cell[0])
+    {
+        case MYSQLA_CELL_INT:
+        {
+            int intVal;
+            memcpy(&intVal, cell + 1, sizeof(int));
+            stackPushInt(intVal);
+            break;
+        }
+        case MYSQLA_CELL_FLOAT:
+        {
+            float floatVal;
+            memcpy(&floatVal, cell + 1, sizeof(float));
+            stackPushFloat(floatVal);
+            break;
+        }
+        default:
+            stackPushString((char *)cell + 1);
+            break;
+    }
+}
+
+/*
+ * Push all fields of all rows copied out of the client library to the GSC caller
+ * With scalar set, a single-row, single-column result is pushed as the value itself (and no rows as undefined).
+ */
+static void pushRowBuffer(const mysqla_rows_t *rows, bool scalar)
+{
+    if(scalar && rows->numRows <= 1 && rows->numFields == 1)
+    {
+        if(rows->numRows == 0)
+            stackPushUndefined();
+        else
+            pushRowValue(rows, rows->offsets[0]);
+        
+        return;
+    }
+    
+    stackPushArray();
+    
+    const int *offset = rows->offsets;
+    for(int i = 0; i < rows->numRows; i++)
+    {
+        stackPushArray();
+        
+        for(int j = 0; j < rows->numFields; j++, offset++)
+        {
+            pushRowValue(rows, *offset);
+            stackPushArrayLast();
+        }
+        
+        stackPushArrayLast();
+    }
+}
+ 
+/*
+ * Free the per-statement results of a group task
+ */
+static void mysqla_free_group_results(mysqla_task_t *ptr_task)
+{
+    if(ptr_task->groupResults == NULL)
+        return;
+    
+    for(int i = 0; i < ptr_task->groupSize; i++)
+    {
+        if(ptr_task->groupResults[i] != NULL)
+            mysqla_free_rows(ptr_task->groupResults[i]);
+    }
+    
+    free(ptr_task->groupResults);
+    ptr_task->groupResults = NULL;
+}
+
+/*
+ * Push the per-statement results of a group task to the GSC caller, or undefined if the transaction failed
+ */
+static void pushGroupResults(mysqla_task_t *ptr_task)
+{
+    if(ptr_task->groupFailed)
+    {
+        stackPushUndefined();
+        return;
+    }
+    
+    stackPushArray();
+    
+    for(int i = 0; i < ptr_task->groupSize; i++)
+    {
+        if(ptr_task->groupResults != NULL && ptr_task->groupResults[i] != NULL)
+            pushRowBuffer(ptr_task->groupResults[i], ptr_task->scalar);
+        else
+            stackPushUndefined();
+        
+        stackPushArrayLast();
+    }
+}
+
+/*
+ * Free the result of a finished task nobody is interested in anymore
+ * Returns whether the task's result was discarded.
+ */
+static bool mysqla_discard_result(mysqla_task_t *ptr_task)
+{
+    // We don't want to call a callback on a disconnected player
+    if(ptr_task->entity == NULL || !ptr_task->entityDisconnected)
+        return false;
+    
+    if(ptr_task->rows != NULL)
+        mysqla_free_rows(ptr_task->rows);
+    
+    ptr_task->rows = NULL;
+    mysqla_free_group_results(ptr_task);
+    return true;
+}
+
+/*
+ * Pass the result of a finished task to GSC and free it
+ */
+static void pushTaskResult(mysqla_task_t *ptr_task)
+{
+    // Whatever a task got before its deadline passed is dropped, the timeout is reported instead
+    if(ptr_task->timedOut)
+    {
+        if(ptr_task->rows != NULL)
+            mysqla_free_rows(ptr_task->rows);
+        
+        ptr_task->rows = NULL;
+        mysqla_free_group_results(ptr_task);
+        stackPushUndefined();
+    }
+    else if(ptr_task->groupSize > 0)
+    {
+        pushGroupResults(ptr_task);
+        mysqla_free_group_results(ptr_task);
+    }
+    else if(ptr_task->rows != NULL)
+    {
+        // Pass the results to the GSC
+        pushRowBuffer(ptr_task->rows, ptr_task->scalar);
+        
+        // Free the copied rows
+        mysqla_free_rows(ptr_task->rows);
+        ptr_task->rows = NULL;
+    }
+    else // No result, probably due to error
+    {
+        stackPushUndefined();
+    }
+}
+
+/*
+ * Call the result callback for a finished task and free its result
+ */
+static void mysqla_deliver_result(mysqla_task_t *ptr_task)
+{
+    if(mysqla_discard_result(ptr_task))
+        return;
+    
+    // callback(id, result, timedOut)
+    stackPushInt(ptr_task->timedOut);
+    pushTaskResult(ptr_task);
+    stackPushInt(ptr_task->taskId);
+    
+    // Call the callback. If the query was executed on a player, call it on a specific player
+    int threadId;
+    if(ptr_task->entity != NULL)
+    {
+        printf("trying to call the callback on a player\n");
+        threadId = Scr_ExecEntThread(ptr_task->entity, (int)mysql_result_callback, 3);
+    }
+    else
+    {
+        printf("trying to call the callback on the level\n");
+        threadId = Scr_ExecThread((int)mysql_result_callback, 3);
+    }
+    
+    // Regardless of who it was called on, free the thread
+    Scr_FreeThread(threadId);
+}
+
+/*
+ * Remove a task from the list of tasks not yet delivered to GSC and recycle it
+ */
+static void mysqla_release_task(mysqla_task_t *ptr_task)
+{
+    int num = mysqla_entity_index(ptr_task->entity);
+    if(num >= 0)
+    {
+        if(ptr_task->prevOfEntity != NULL)
+            ptr_task->prevOfEntity->nextOfEntity = ptr_task->nextOfEntity;
+        else
+            mysqla_entity_tasks[num] = ptr_task->nextOfEntity;
+        
+        if(ptr_task->nextOfEntity != NULL)
+            ptr_task->nextOfEntity->prevOfEntity = ptr_task->prevOfEntity;
+    }
+    
+    if(ptr_task->prev != NULL)
+        ptr_task->prev->next = ptr_task->next;
+    else
+        first_async_task = ptr_task->next;
+    
+    if(ptr_task->next != NULL)
+        ptr_task->next->prev = ptr_task->prev;
+    else
+        last_async_task = ptr_task->prev;
+    
+    // Recycle the memory used by this task
+    mysqla_free_task(ptr_task);
+}
+
+/*
+ * Call the batch callback once for a list of finished tasks (linked by nextInBatch) and release the tasks.
+ * The callback gets an array of [id, result, timedOut] entries, with the entity (or undefined) as a fourth element if withEntity is set.
+ * It is called on the entity if there is one, otherwise on the level.
+ */
+static void mysqla_deliver_batch(mysqla_task_t *ptr_first, gentity_t *entity, bool withEntity)
+{
+    stackPushArray();
+    
+    for(mysqla_task_t *ptr_task = ptr_first; ptr_task != NULL; ptr_task = ptr_task->nextInBatch)
+    {
+        stackPushArray();
+        
+        stackPushInt(ptr_task->taskId);
+        stackPushArrayLast();
+        
+        pushTaskResult(ptr_task);
+        stackPushArrayLast();
+        
+        stackPushInt(ptr_task->timedOut);
+        stackPushArrayLast();
+        
+        if(withEntity)
+        {
+            if(ptr_task->entity != NULL)
+                stackPushEntity(ptr_task->entity);
+            else
+                stackPushUndefined();
+            stackPushArrayLast();
+        }
+        
+        stackPushArrayLast();
+    }
+    
+    int threadId;
+    if(entity != NULL)
+        threadId = Scr_ExecEntThread(entity, mysqla_batch_callback, 1);
+    else
+        threadId = Scr_ExecThread(mysqla_batch_callback, 1);
+    
+    Scr_FreeThread(threadId);
+    
+    while(ptr_first != NULL)
+    {
+        mysqla_task_t *ptr_next = ptr_first->nextInBatch;
+        mysqla_release_task(ptr_first);
+        ptr_first = ptr_next;
+    }
+}
+
+/*
+ * Deliver the tasks finished this frame (linked by nextInBatch) in as few batch callbacks as the delivery mode allows
+ */
+static void mysqla_deliver_batches(mysqla_task_t *ptr_first)
+{
+    if(mysqla_delivery_mode == MYSQLA_DELIVERY_FRAME)
+    {
+        mysqla_deliver_batch(ptr_first, NULL, true);
+        return;
+    }
+    
+    // Split the tasks by entity (index MYSQLA_MAX_ENTITIES is the level), keeping their order
+    static mysqla_task_t *ptr_firstOf[MYSQLA_MAX_ENTITIES + 1];
+    static mysqla_task_t *ptr_lastOf[MYSQLA_MAX_ENTITIES + 1];
+    static int order[MYSQLA_MAX_ENTITIES + 1];
+    int count = 0;
+    
+    mysqla_task_t *ptr_task = ptr_first;
+    while(ptr_task != NULL)
+    {
+        mysqla_task_t *ptr_next = ptr_task->nextInBatch;
+        
+        int num = mysqla_entity_index(ptr_task->entity);
+        if(num < 0)
+            num = MYSQLA_MAX_ENTITIES;
+        
+        ptr_task->nextInBatch = NULL;
+        if(ptr_firstOf[num] == NULL)
+        {
+            ptr_firstOf[num] = ptr_task;
+            order[count++] = num;
+        }
+        else
+        {
+            ptr_lastOf[num]->nextInBatch = ptr_task;
+        }
+        ptr_lastOf[num] = ptr_task;
+        
+        ptr_task = ptr_next;
+    }
+    
+    for(int i = 0; i < count; i++)
+    {
+        int num = order[i];
+        mysqla_deliver_batch(ptr_firstOf[num], (num < MYSQLA_MAX_ENTITIES) ? &g_entities[num] : NULL, false);
+        
+        ptr_firstOf[num] = NULL;
+        ptr_lastOf[num] = NULL;
+    }
+}
+
+static void mysqla_dispatch_task(mysqla_task_t *ptr_task);
+static void mysqls_pump_nonblocking(bool wait);
+static void mysqls_notify_nonblocking(void);
+
+/*
+ * Merge each group of INSERTs held back this frame into a single multi-row INSERT and hand it to the dispatcher
+ */
+static void mysqla_flush_coalesced(void)
+{
+    for(int i = 0; i < mysqla_coalesce_group_count; i++)
+    {
+        mysqla_coalesce_group_t *ptr_group = &mysqla_coalesce_groups[i];
+        mysqla_task_t *ptr_leader = ptr_group->leader;
+        
+        if(ptr_leader->coalesced != NULL)
+        {
+            char *ptr_merged = mysqla_alloc_block(ptr_group->length + 1);
+            if(ptr_merged != NULL)
+            {
+                int len = ptr_leader->valuesOffset + mysqla_get_values_length(ptr_leader);
+                memcpy(ptr_merged, ptr_leader->query, len);
+                
+                for(mysqla_task_t *ptr_task = ptr_leader->coalesced; ptr_task != NULL; ptr_task = ptr_task->coalesced)
+                {
+                    int valuesLen = mysqla_get_values_length(ptr_task);
+                    ptr_merged[len++] = ',';
+                    memcpy(ptr_merged + len, ptr_task->query + ptr_task->valuesOffset, valuesLen);
+                    len += valuesLen;
+                }
+                
+                ptr_merged[len] = '\0';
+                
+                mysqla_free_block(ptr_leader->query, ptr_leader->queryLen + 1);
+                ptr_leader->query = ptr_merged;
+                ptr_leader->queryLen = len;
+            }
+            else // Out of memory, so just execute them one by one
+            {
+                printf("ERROR: mysqla_flush_coalesced() out of memory, executing INSERTs separately\n");
+                
+                mysqla_task_t *ptr_task = ptr_leader->coalesced;
+                ptr_leader->coalesced = NULL;
+                while(ptr_task != NULL)
+                {
+                    mysqla_task_t *ptr_next = ptr_task->coalesced;
+                    ptr_task->coalesced = NULL;
+                    mysqla_dispatch_task(ptr_task);
+                    ptr_task = ptr_next;
+                }
+            }
+        }
+        
+        mysqla_dispatch_task(ptr_leader);
+    }
+    
+    mysqla_coalesce_group_count = 0;
+}
+
+/*
+ * Hold back an INSERT until the end of the frame so it can be merged with others of the same shape.
+ * Returns false if it can't be held back, in which case the caller should dispatch it.
+ */
+static bool mysqla_coalesce_task(mysqla_task_t *ptr_task)
+{
+    int valuesLen = mysqla_get_values_length(ptr_task);
+    
+    for(int i = 0; i < mysqla_coalesce_group_count; i++)
+    {
+        mysqla_coalesce_group_t *ptr_group = &mysqla_coalesce_groups[i];
+        mysqla_task_t *ptr_leader = ptr_group->leader;
+        
+        // Same table and columns? The merged INSERT is dispatched with the leader's priority, so that has to match as well
+        if(ptr_leader->valuesOffset != ptr_task->valuesOffset || strncmp(ptr_leader->query, ptr_task->query, ptr_task->valuesOffset) != 0)
+            continue;
+        
+        if(ptr_leader->priority != ptr_task->priority)
+            continue;
+        
+        if(ptr_group->rowCount >= mysqla_coalesce_max_rows || ptr_group->length + 1 + valuesLen > MYSQLA_COALESCE_MAX_LENGTH)
+            continue;
+        
+        ptr_group->last->coalesced = ptr_task;
+        ptr_group->last = ptr_task;
+        ptr_group->rowCount++;
+        ptr_group->length += 1 + valuesLen;
+        return true;
+    }
+    
+    if(mysqla_coalesce_group_count == MYSQLA_COALESCE_MAX_GROUPS)
+        return false;
+    
+    mysqla_coalesce_group_t *ptr_group = &mysqla_coalesce_groups[mysqla_coalesce_group_count++];
+    ptr_group->leader = ptr_task;
+    ptr_group->last = ptr_task;
+    ptr_group->rowCount = 1;
+    ptr_group->length = ptr_task->valuesOffset + valuesLen;
+    return true;
+}
+
+/*
+ * Pass the next chunk of each streaming query to its GSC callback. At most one chunk per stream is passed
+ * each frame, so a huge result is spread over multiple frames.
+ */
+static void mysqla_pump_streams(void)
+{
+    mysqla_task_t **ptr_link = &mysqla_streams;
+    while(*ptr_link != NULL)
+    {
+        mysqla_task_t *ptr_task = *ptr_link;
+        bool disconnected = (ptr_task->entity != NULL && ptr_task->entityDisconnected);
+        bool finished = false;
+        
+        // Nobody is interested in the chunks for a disconnected player, so get rid of them all at once
+        do
+        {
+            mysqla_chunk_t *ptr_chunk = (mysqla_chunk_t *)mysqla_queue_pop(&ptr_task->streamChunks);
+            if(ptr_chunk == NULL)
+                break;
+            
+            if(!disconnected)
+            {
+                // Arguments are pushed in reverse order, the callback is called as callback(id, rows, status)
+                stackPushInt(ptr_chunk->status);
+                
+                if(ptr_chunk->rows != NULL)
+                    pushRowBuffer(ptr_chunk->rows, false);
+                else
+                    stackPushUndefined();
+                
+                stackPushInt(ptr_task->taskId);
+                
+                int threadId;
+                if(ptr_task->entity != NULL)
+                    threadId = Scr_ExecEntThread(ptr_task->entity, ptr_task->streamCallback, 3);
+                else
+                    threadId = Scr_ExecThread(ptr_task->streamCallback, 3);
+                
+                Scr_FreeThread(threadId);
+            }
+            
+            if(ptr_chunk->rows != NULL)
+            {
+                mysqla_free_rows(ptr_chunk->rows);
+                
+                // Let the worker fetch the next chunk
+                sem_post(&ptr_task->streamSlots);
+            }
+            else
+            {
+                finished = true;
+            }
+            
+            free(ptr_chunk);
+        } while(disconnected && !finished);
+        
+        if(finished)
+        {
+            *ptr_link = ptr_task->nextStream;
+            
+            sem_destroy(&ptr_task->streamSlots);
+            mysqla_release_task(ptr_task);
+        }
+        else
+        {
+            ptr_link = &ptr_task->nextStream;
+        }
+    }
+}
+
+/*
+ * Call the result callback for each finished MySQL task.
+ * Note: This is called from onFrame function by the server.
+ *       If this starts lagging, add a break statement after calling a callback.
+ *       No locking happens here: the workers push finished tasks onto a wait-free queue and this is its only consumer.
+ */
+void mysql_handle_result_callbacks(void)
+{
+    // INSERTs held back during the previous frame go out now, merged
+    if(mysqla_coalesce_group_count > 0)
+        mysqla_flush_coalesced();
+    
+    // Streams have their own callbacks
+    if(mysqla_streams != NULL)
+        mysqla_pump_streams();
+    
+    // Non-blocking queries of the synchronous connection take one step and notify GSC when they're done
+    if(mysqls_nb_first != NULL)
+    {
+        mysqls_pump_nonblocking(false);
+        mysqls_notify_nonblocking();
+    }
+    
+    // Ensure we have a callback function active
+    if(mysql_result_callback == 0)
+        return;
+    
+    // Batched delivery collects the finished tasks first and calls the batch callback only once per frame (or entity)
+    bool batched = (mysqla_delivery_mode != MYSQLA_DELIVERY_TASK);
+    mysqla_task_t *ptr_batchFirst = NULL;
+    mysqla_task_t *ptr_batchLast = NULL;
+    
+    mysqla_qnode_t *ptr_node;
+    while((ptr_node = mysqla_queue_pop(&mysqla_done_queue)) != NULL)
+    {
+        mysqla_task_t *ptr_task = (mysqla_task_t *)ptr_node;
+        
+        // Keep the rows for identical queries, unless a write touched the table in the meantime
+        if(ptr_task->cacheTtl > 0 && ptr_task->rows != NULL && !ptr_task->timedOut && mysqla_cache_max_bytes > 0)
+            mysqla_cache_store(ptr_task);
+        
+        // Identical reads that joined this one while it was in flight complete with the same rows
+        if(ptr_task->inFlight || ptr_task->followers != NULL)
+            mysqla_land_flight(ptr_task);
+        
+        if(batched)
+        {
+            // Each INSERT merged into this task is a result of its own
+            bool timedOut = ptr_task->timedOut;
+            while(ptr_task != NULL)
+            {
+                mysqla_task_t *ptr_next = ptr_task->coalesced;
+                ptr_task->timedOut = timedOut;
+                
+                if(mysqla_discard_result(ptr_task))
+                {
+                    mysqla_release_task(ptr_task);
+                }
+                else
+                {
+                    ptr_task->nextInBatch = NULL;
+                    if(ptr_batchLast == NULL)
+                        ptr_batchFirst = ptr_task;
+                    else
+                        ptr_batchLast->nextInBatch = ptr_task;
+                    ptr_batchLast = ptr_task;
+                }
+                
+                ptr_task = ptr_next;
+            }
+            
+            continue;
+        }
+        
+        mysqla_deliver_result(ptr_task);
+        
+        // Each INSERT merged into this task gets its own callback
+        mysqla_task_t *ptr_coalesced = ptr_task->coalesced;
+        while(ptr_coalesced != NULL)
+        {
+            mysqla_task_t *ptr_next = ptr_coalesced->coalesced;
+            
+            ptr_coalesced->timedOut = ptr_task->timedOut;
+            mysqla_deliver_result(ptr_coalesced);
+            mysqla_release_task(ptr_coalesced);
+            
+            ptr_coalesced = ptr_next;
+        }
+        
+        mysqla_release_task(ptr_task);
+    }
+    
+    if(ptr_batchFirst != NULL)
+        mysqla_deliver_batches(ptr_batchFirst);
+}
+
+/*
+ * Whether a MySQL error means the database couldn't be reached (as opposed to the query being wrong)
+ */
+static bool mysqla_is_connection_error(int error)
+{
+    return (error == CR_CONNECTION_ERROR || error == CR_CONN_HOST_ERROR || error == CR_SERVER_GONE_ERROR || error == CR_SERVER_LOST);
+}
+
+/*
+ * Log a MySQL error to the server's MySQL file (which gets created if it doesn't exist)
+ */
+static void log_mysql_error(const char *query, const int error, const char *strError)
+{
+    mysqla_metric_inc(&mysqla_metrics.errors);
+    if(mysqla_is_connection_error(error))
+        mysqla_metric_inc(&mysqla_metrics.connectionErrors);
+    
+    char filePathBuf[32] = {0};
+    snprintf(filePathBuf, sizeof(filePathBuf), "../mysql_errors_%d.log", Shared_GetPort());
+    
+    pthread_mutex_lock(&mysqla_file_lock);
+    
+    FILE *mysqlFile = fopen(filePathBuf, "a");
+    if(mysqlFile != NULL)
+    {
+        fprintf(mysqlFile, "Query \"%s\" caused error %d (%s)\n", query, error, strError);
+        fclose(mysqlFile);
+    }
+    
+    pthread_mutex_unlock(&mysqla_file_lock);
+}
+
+/*
+ * Start the current step of a non-blocking query
+ * Returns what the client library waits for (MYSQL_WAIT_*), or 0 if the step is already done
+ */
+static int mysqls_nb_start_step(mysqls_nb_query_t *ptr_query)
+{
+#ifdef MYSQL_WAIT_READ
+    if(ptr_query->step == MYSQLS_STEP_QUERY)
+        return mysql_real_query_start(&ptr_query->queryRet, sync_mysql_connection, ptr_query->query, strlen(ptr_query->query));
+    
+    return mysql_store_result_start(&ptr_query->result, sync_mysql_connection);
+#else
+    // Not reached, gsc_mysqls_query_nonblocking() refuses queries without the non-blocking client API
+    return 0;
+#endif
+}
+
+/*
+ * Continue the current step of a non-blocking query once what it waits for is there
+ * Returns what the client library waits for (MYSQL_WAIT_*), 0 once the step is done, or -1 if it has to keep waiting
+ */
+static int mysqls_nb_continue_step(mysqls_nb_query_t *ptr_query, bool wait)
+{
+#ifdef MYSQL_WAIT_READ
+    struct pollfd pfd;
+    pfd.fd = mysql_get_socket(sync_mysql_connection);
+    pfd.events = 0;
+    pfd.revents = 0;
+    if(ptr_query->waitStatus & MYSQL_WAIT_READ)
+        pfd.events |= POLLIN;
+    if(ptr_query->waitStatus & MYSQL_WAIT_WRITE)
+        pfd.events |= POLLOUT;
+    if(ptr_query->waitStatus & MYSQL_WAIT_EXCEPT)
+        pfd.events |= POLLPRI;
+    
+    // Don't wait at all from the frame loop, and no longer than the client library's own timeout otherwise
+    int timeout = (wait ? -1 : 0);
+    if(ptr_query->waitStatus & MYSQL_WAIT_TIMEOUT)
+    {
+        long long left = ptr_query->timeoutAt - mysqla_time_ms();
+        if(left < 0)
+            left = 0;
+        if(wait || left == 0)
+            timeout = (int)left;
+    }
+    
+    int ready = 0;
+    if(poll(&pfd, 1, timeout) > 0)
+    {
+        if(pfd.revents & (POLLIN | POLLHUP | POLLERR))
+            ready |= MYSQL_WAIT_READ;
+        if(pfd.revents & (POLLOUT | POLLHUP | POLLERR))
+            ready |= MYSQL_WAIT_WRITE;
+        if(pfd.revents & POLLPRI)
+            ready |= MYSQL_WAIT_EXCEPT;
+        ready &= ptr_query->waitStatus;
+    }
+    else if((ptr_query->waitStatus & MYSQL_WAIT_TIMEOUT) && mysqla_time_ms() >= ptr_query->timeoutAt)
+    {
+        ready = MYSQL_WAIT_TIMEOUT;
+    }
+    
+    if(ready == 0)
+        return -1;
+    
+    if(ptr_query->step == MYSQLS_STEP_QUERY)
+        return mysql_real_query_cont(&ptr_query->queryRet, sync_mysql_connection, ready);
+    
+    return mysql_store_result_cont(&ptr_query->result, sync_mysql_connection, ready);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Advance the oldest unfinished non-blocking queries of the synchronous connection
+ * Without waiting, this only does what the socket allows right now, so it can be called every frame.
+ * Waiting runs all of them to completion (needed before the connection is used for anything else).
+ */
+static void mysqls_pump_nonblocking(bool wait)
+{
+    mysqls_nb_query_t *ptr_query = mysqls_nb_first;
+    while(ptr_query != NULL)
+    {
+        if(ptr_query->step == MYSQLS_STEP_DONE)
+        {
+            ptr_query = ptr_query->next;
+            continue;
+        }
+        
+        int status;
+        if(ptr_query->waitStatus == 0)
+            status = mysqls_nb_start_step(ptr_query);
+        else
+            status = mysqls_nb_continue_step(ptr_query, wait);
+        
+        // Socket isn't ready, try again next frame
+        if(status < 0)
+            return;
+        
+        if(status != 0)
+        {
+            ptr_query->waitStatus = status;
+#ifdef MYSQL_WAIT_READ
+            if(status & MYSQL_WAIT_TIMEOUT)
+                ptr_query->timeoutAt = mysqla_time_ms() + mysql_get_timeout_value_ms(sync_mysql_connection);
+#endif
+            continue;
+        }
+        
+        // The step is done. Rows have to be read even if they aren't wanted, or the next query would fail
+        ptr_query->waitStatus = 0;
+        if(ptr_query->step == MYSQLS_STEP_QUERY && ptr_query->queryRet == 0)
+        {
+            ptr_query->step = MYSQLS_STEP_STORE;
+            continue;
+        }
+        
+        if(ptr_query->queryRet != 0 || (ptr_query->result == NULL && mysql_field_count(sync_mysql_connection) != 0))
+        {
+            const char *strError = mysql_error(sync_mysql_connection);
+            ptr_query->error = mysql_errno(sync_mysql_connection);
+            
+            printf("ERROR: MySQL query (%s) failed with error %d (%s)\n", ptr_query->query, ptr_query->error, strError);
+            log_mysql_error(ptr_query->query, ptr_query->error, strError);
+        }
+        
+        if(ptr_query->result != NULL && ptr_query->saveResult == 0)
+        {
+            mysql_free_result(ptr_query->result);
+            ptr_query->result = NULL;
+        }
+        
+        ptr_query->step = MYSQLS_STEP_DONE;
+        ptr_query = ptr_query->next;
+    }
+}
+
+/*
+ * Notify GSC of the non-blocking queries that are done, in submission order
+ * Scripts get them with: level waittill("mysql_query_done", id, result, error);
+ */
+static void mysqls_notify_nonblocking(void)
+{
+    while(mysqls_nb_first != NULL && mysqls_nb_first->step == MYSQLS_STEP_DONE)
+    {
+        mysqls_nb_query_t *ptr_query = mysqls_nb_first;
+        mysqls_nb_first = ptr_query->next;
+        if(mysqls_nb_first == NULL)
+            mysqls_nb_last = NULL;
+        
+        // Notify arguments are pushed last one first
+        stackPushInt(ptr_query->error);
+        if(ptr_query->result != NULL)
+        {
+            pushResultRows(ptr_query->result, (ptr_query->saveResult == MYSQLA_SAVE_SCALAR));
+            mysql_free_result(ptr_query->result);
+        }
+        else
+        {
+            stackPushUndefined();
+        }
+        stackPushInt(ptr_query->id);
+        
+        stackNotifyLevel("mysql_query_done", 3);
+        
+        free(ptr_query);
+    }
+}
+
+/*
+ * Get the size a write takes in the spool: its length, its text and padding to keep the lengths aligned
+ */
+static size_t mysqla_spool_record_size(unsigned int len)
+{
+    return (sizeof(unsigned int) + len + 3) & ~(size_t)3;
+}
+
+/*
+ * Map at least size bytes of the spool file, growing the file if needed.
+ * Note: Called with mysqla_spool_lock held, or before the replayer is started.
+ */
+static bool mysqla_spool_map_file(size_t size)
+{
+    if(mysqla_spool_map != NULL && size <= mysqla_spool_size)
+        return true;
+    
+    size = (size + MYSQLA_SPOOL_GROW_SIZE - 1) / MYSQLA_SPOOL_GROW_SIZE * MYSQLA_SPOOL_GROW_SIZE;
+    if(size > MYSQLA_SPOOL_MAX_SIZE)
+        return false;
+    
+    if(ftruncate(mysqla_spool_fd, size) != 0)
+        return false;
+    
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mysqla_spool_fd, 0);
+    if(map == MAP_FAILED)
+        return false;
+    
+    if(mysqla_spool_map != NULL)
+        munmap(mysqla_spool_map, mysqla_spool_size);
+    
+    mysqla_spool_map = (char *)map;
+    mysqla_spool_size = size;
+    
+    return true;
+}
+
+/*
+ * Open (or create) the spool file of this server. Writes left in it by a previous run are replayed as well.
+ */
+static bool mysqla_spool_open(void)
+{
+    char filePathBuf[32] = {0};
+    snprintf(filePathBuf, sizeof(filePathBuf), "../mysql_spool_%d.dat", Shared_GetPort());
+    
+    mysqla_spool_fd = open(filePathBuf, O_RDWR | O_CREAT, 0644);
+    if(mysqla_spool_fd < 0)
+    {
+        printf("ERROR: mysqla_spool_open() can't open %s\n", filePathBuf);
+        return false;
+    }
+    
+    struct stat st;
+    if(fstat(mysqla_spool_fd, &st) != 0 || !mysqla_spool_map_file((st.st_size > (off_t)sizeof(mysqla_spool_header_t)) ? st.st_size : sizeof(mysqla_spool_header_t)))
+    {
+        printf("ERROR: mysqla_spool_open() can't map %s\n", filePathBuf);
+        close(mysqla_spool_fd);
+        mysqla_spool_fd = -1;
+        return false;
+    }
+    
+    mysqla_spool_header_t *ptr_header = (mysqla_spool_header_t *)mysqla_spool_map;
+    if(ptr_header->magic != MYSQLA_SPOOL_MAGIC || ptr_header->readOffset < sizeof(mysqla_spool_header_t)
+        || ptr_header->readOffset > ptr_header->writeOffset || ptr_header->writeOffset > mysqla_spool_size)
+    {
+        if(st.st_size > 0)
+            printf("WARN: mysqla_spool_open() %s is damaged, starting an empty spool\n", filePathBuf);
+        
+        ptr_header->magic = MYSQLA_SPOOL_MAGIC;
+        ptr_header->readOffset = sizeof(mysqla_spool_header_t);
+        ptr_header->writeOffset = sizeof(mysqla_spool_header_t);
+    }
+    
+    if(ptr_header->readOffset < ptr_header->writeOffset)
+    {
+        printf("mysqla_spool_open() replaying %llu bytes of writes spooled by a previous run\n", ptr_header->writeOffset - ptr_header->readOffset);
+        mysqla_spool_pending = true;
+    }
+    
+    return true;
+}
+
+/*
+ * Append a write to the spool and wake up the replayer. Returns false if it couldn't be spooled.
+ * May be called from any thread.
+ */
+static bool mysqla_spool_append(const char *query, unsigned int len)
+{
+    if(mysqla_spool_fd < 0)
+        return false;
+    
+    pthread_mutex_lock(&mysqla_spool_lock);
+    
+    size_t recordSize = mysqla_spool_record_size(len);
+    bool spooled = mysqla_spool_map_file(((mysqla_spool_header_t *)mysqla_spool_map)->writeOffset + recordSize);
+    if(spooled)
+    {
+        // Growing the file may have moved the mapping
+        mysqla_spool_header_t *ptr_header = (mysqla_spool_header_t *)mysqla_spool_map;
+        char *ptr_record = mysqla_spool_map + ptr_header->writeOffset;
+        
+        memcpy(ptr_record, &len, sizeof(unsigned int));
+        memcpy(ptr_record + sizeof(unsigned int), query, len);
+        
+        // The write only counts once the header includes it, so a crash halfway through can't leave a broken record behind
+        ptr_header->writeOffset += recordSize;
+        msync(mysqla_spool_map, ptr_header->writeOffset, MS_ASYNC);
+        
+        // Once per outage, the spooled writes themselves are counted in the stats
+        if(!mysqla_spool_pending)
+            printf("WARN: MySQL writes are spooled until the database can be reached again\n");
+        
+        __atomic_store_n(&mysqla_spool_pending, true, __ATOMIC_RELEASE);
+        pthread_cond_signal(&mysqla_spool_cond);
+        
+        mysqla_metric_inc(&mysqla_metrics.spooled);
+    }
+    
+    pthread_mutex_unlock(&mysqla_spool_lock);
+    
+    return spooled;
+}
+
+/*
+ * Spool a write that failed because the database is unreachable. Returns true if it was spooled.
+ * A connection lost in the middle of a write may have lost it after the server committed it, so such a write is
+ * only replayed if executing it twice does no harm (MYSQLA_FLAG_IDEMPOTENT). Otherwise it's logged as failed.
+ * Note: Prepared statements aren't spooled, their parameters only exist in binary form.
+ */
+static bool mysqla_spool_failed_write(mysqla_task_t *ptr_task, int error)
+{
+    if(!mysqla_is_connection_error(error) || ptr_task->stmtId != 0 || mysqla_query_is_read(ptr_task->query))
+        return false;
+    
+    // Only a failed connect proves the write never reached the server
+    bool sent = (error == CR_SERVER_GONE_ERROR || error == CR_SERVER_LOST);
+    if(sent && !ptr_task->idempotent)
+        return false;
+    
+    if(!mysqla_spool_append(ptr_task->query, ptr_task->queryLen))
+    {
+        printf("ERROR: MySQL write (%s) lost, it couldn't be spooled\n", ptr_task->query);
+        return false;
+    }
+    
+    return true;
+}
+
+/*
+ * Execute a spooled write (which may be a group of statements) on the replayer's connection.
+ * Like the async connections, the connection only allows multiple statements while a group runs.
+ * Returns 0 on success, otherwise the MySQL error.
+ */
+static int mysqla_spool_execute(MYSQL *mysql, const char *query)
+{
+    bool multiple = mysqla_query_is_multiple(query);
+    
+    int status = MYSQL_NO_ERROR;
+    if(multiple)
+        status = mysql_set_server_option(mysql, MYSQL_OPTION_MULTI_STATEMENTS_ON);
+    
+    if(status == MYSQL_NO_ERROR)
+        status = mysql_query(mysql, query);
+    
+    while(status == MYSQL_NO_ERROR)
+    {
+        MYSQL_RES *result = mysql_store_result(mysql);
+        if(result != NULL)
+            mysql_free_result(result);
+        
+        status = mysql_next_result(mysql);
+    }
+    
+    if(status <= 0)
+    {
+        if(multiple)
+            mysql_set_server_option(mysql, MYSQL_OPTION_MULTI_STATEMENTS_OFF);
+        
+        return MYSQL_NO_ERROR;
+    }
+    
+    const char *strError = mysql_error(mysql);
+    const int error = mysql_errno(mysql);
+    
+    printf("ERROR: MySQL spooled write (%s) failed with error %d (%s)\n", query, error, strError);
+    log_mysql_error(query, error, strError);
+    
+    // A spooled group may have failed halfway through its transaction
+    if(!mysqla_is_connection_error(error))
+    {
+        mysql_query(mysql, "ROLLBACK");
+        if(multiple)
+            mysql_set_server_option(mysql, MYSQL_OPTION_MULTI_STATEMENTS_OFF);
+    }
+    
+    return error;
+}
+
+/*
+ * Background thread replaying the spooled writes in order, on its own connection, once the database can be reached.
+ * Writes the database rejects for another reason are logged and skipped, they'd block the spool forever otherwise.
+ */
+static void *mysqla_spool_replayer(void *unused)
+{
+    mysql_thread_init();
+    
+    MYSQL *mysql = NULL;
+    char *query = NULL;
+    unsigned int querySize = 0;
+    
+    while(true)
+    {
+        pthread_mutex_lock(&mysqla_spool_lock);
+        
+        while(!mysqla_spool_pending)
+            pthread_cond_wait(&mysqla_spool_cond, &mysqla_spool_lock);
+        
+        // Copy the oldest write out, appending may move the mapping while we execute it
+        mysqla_spool_header_t *ptr_header = (mysqla_spool_header_t *)mysqla_spool_map;
+        unsigned int len;
+        memcpy(&len, mysqla_spool_map + ptr_header->readOffset, sizeof(unsigned int));
+        
+        if(len + 1 > querySize)
+        {
+            char *ptr_query = (char *)realloc(query, len + 1);
+            if(ptr_query != NULL)
+            {
+                query = ptr_query;
+                querySize = len + 1;
+            }
+        }
+        
+        if(len + 1 <= querySize)
+        {
+            memcpy(query, mysqla_spool_map + ptr_header->readOffset + sizeof(unsigned int), len);
+            query[len] = '\0';
+        }
+        
+        pthread_mutex_unlock(&mysqla_spool_lock);
+        
+        if(len + 1 > querySize)
+        {
+            printf("ERROR: mysqla_spool_replayer() out of memory\n");
+            usleep(MYSQLA_SPOOL_RETRY_MS * 1000);
+            continue;
+        }
+        
+        if(mysql == NULL)
+        {
+            mysql = mysql_init(NULL);
+            if(mysql != NULL && mysql_real_connect(mysql, mysqla_db_host, mysqla_db_user, mysqla_db_pass, mysqla_db_name, mysqla_db_port, NULL, CLIENT_MULTI_RESULTS) == NULL)
+            {
+                mysql_close(mysql);
+                mysql = NULL;
+            }
+            
+            if(mysql == NULL)
+            {
+                usleep(MYSQLA_SPOOL_RETRY_MS * 1000);
+                continue;
+            }
+        }
+        
+        if(mysqla_is_connection_error(mysqla_spool_execute(mysql, query)))
+        {
+            // Still unreachable, try again later with a new connection
+            mysql_close(mysql);
+            mysql = NULL;
+            usleep(MYSQLA_SPOOL_RETRY_MS * 1000);
+            continue;
+        }
+        
+        pthread_mutex_lock(&mysqla_spool_lock);
+        
+        ptr_header = (mysqla_spool_header_t *)mysqla_spool_map;
+        ptr_header->readOffset += mysqla_spool_record_size(len);
+        
+        // Start at the front of the file again once everything is replayed
+        if(ptr_header->readOffset == ptr_header->writeOffset)
+        {
+            ptr_header->readOffset = sizeof(mysqla_spool_header_t);
+            ptr_header->writeOffset = sizeof(mysqla_spool_header_t);
+            __atomic_store_n(&mysqla_spool_pending, false, __ATOMIC_RELEASE);
+        }
+        
+        msync(mysqla_spool_map, sizeof(mysqla_spool_header_t), MS_ASYNC);
+        
+        bool drained = !mysqla_spool_pending;
+        
+        pthread_mutex_unlock(&mysqla_spool_lock);
+        
+        // No need to hold on to a connection until the next outage
+        if(drained)
+        {
+            printf("mysqla_spool_replayer() all spooled writes replayed\n");
+            mysql_close(mysql);
+            mysql = NULL;
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * Get the prepared statement of a connection, preparing it first if this connection hasn't used it before.
+ * Note: Only called from the connection's own worker thread.
+ */
+static MYSQL_STMT *mysqla_get_statement(mysqla_connection_t *ptr_conn, mysqla_task_t *ptr_task)
+{
+    if(ptr_task->stmtId > ptr_conn->statementCount)
+    {
+        MYSQL_STMT **ptr_statements = (MYSQL_STMT **)realloc(ptr_conn->statements, sizeof(MYSQL_STMT *) * ptr_task->stmtId);
+        if(ptr_statements == NULL)
+            return NULL;
+        
+        for(int i = ptr_conn->statementCount; i < ptr_task->stmtId; i++)
+            ptr_statements[i] = NULL;
+        
+        ptr_conn->statements = ptr_statements;
+        ptr_conn->statementCount = ptr_task->stmtId;
+    }
+    
+    MYSQL_STMT *stmt = ptr_conn->statements[ptr_task->stmtId - 1];
+    if(stmt != NULL)
+        return stmt;
+    
+    stmt = mysql_stmt_init(ptr_conn->connection);
+    if(stmt == NULL)
+        return NULL;
+    
+    if(mysql_stmt_prepare(stmt, ptr_task->query, ptr_task->queryLen) != MYSQL_NO_ERROR)
+    {
+        const int error = mysql_stmt_errno(stmt);
+        const char *strError = mysql_stmt_error(stmt);
+        
+        printf("ERROR: MySQL statement (%s) failed to prepare with error %d (%s)\n", ptr_task->query, error, strError);
+        log_mysql_error(ptr_task->query, error, strError);
+        
+        mysql_stmt_close(stmt);
+        return NULL;
+    }
+    
+    ptr_conn->statements[ptr_task->stmtId - 1] = stmt;
+    return stmt;
+}
+
+/*
+ * Forget a cached prepared statement, e.g. because the server no longer knows it after a reconnect
+ */
+static void mysqla_drop_statement(mysqla_connection_t *ptr_conn, int stmtId)
+{
+    mysql_stmt_close(ptr_conn->statements[stmtId - 1]);
+    ptr_conn->statements[stmtId - 1] = NULL;
+}
+
+/*
+ * Copy all result rows of an executed prepared statement
+ */
+static mysqla_rows_t *mysqla_fetch_statement_rows(MYSQL_STMT *stmt)
+{
+    if(mysql_stmt_store_result(stmt) != MYSQL_NO_ERROR)
+        return NULL;
+    
+    int numRows = mysql_stmt_num_rows(stmt);
+    int numFields = mysql_stmt_field_count(stmt);
+    
+    mysqla_rows_t *rows = mysqla_alloc_rows(numRows, numFields, 0);
+    MYSQL_RES *metadata = mysql_stmt_result_metadata(stmt);
+    MYSQL_BIND *binds = (MYSQL_BIND *)calloc(numFields, sizeof(MYSQL_BIND));
+    unsigned long *lengths = (unsigned long *)calloc(numFields, sizeof(unsigned long));
+    my_bool *isNull = (my_bool *)calloc(numFields, sizeof(my_bool));
+    char *value = NULL;
+    unsigned long valueSize = 0;
+    
+    if(rows == NULL || metadata == NULL || binds == NULL || lengths == NULL || isNull == NULL)
+    {
+        free(rows);
+        rows = NULL;
+    }
+    else
+    {
+        mysqla_set_column_types(rows, mysql_fetch_fields(metadata));
+        
+        // Bind without buffers, so fetching a row only reports the lengths. The values are then fetched
+        // per column and converted to their type.
+        for(int j = 0; j < numFields; j++)
+        {
+            binds[j].buffer_type = MYSQL_TYPE_STRING;
+            binds[j].length = &lengths[j];
+            binds[j].is_null = &isNull[j];
+        }
+        
+        bool failed = (mysql_stmt_bind_result(stmt, binds) != MYSQL_NO_ERROR);
+        
+        while(!failed && rows->numRows < numRows)
+        {
+            int ret = mysql_stmt_fetch(stmt);
+            if(ret == MYSQL_NO_DATA)
+                break;
+            
+            if(ret != MYSQL_NO_ERROR && ret != MYSQL_DATA_TRUNCATED)
+            {
+                failed = true;
+                break;
+            }
+            
+            int *offsets = rows->offsets + rows->numRows * numFields;
+            for(int j = 0; j < numFields && !failed; j++)
+            {
+                if(isNull[j])
+                {
+                    offsets[j] = -1;
+                    continue;
+                }
+                
+                if(lengths[j] + 1 > valueSize)
+                {
+                    char *ptr_value = (char *)realloc(value, lengths[j] + 1);
+                    if(ptr_value == NULL)
+                    {
+                        failed = true;
+                        break;
+                    }
+                    
+                    value = ptr_value;
+                    valueSize = lengths[j] + 1;
+                }
+                
+                MYSQL_BIND column;
+                memset(&column, 0, sizeof(column));
+                column.buffer_type = MYSQL_TYPE_STRING;
+                column.buffer = value;
+                column.buffer_length = lengths[j] + 1;
+                
+                if(lengths[j] > 0 && mysql_stmt_fetch_column(stmt, &column, j, 0) != MYSQL_NO_ERROR)
+                {
+                    failed = true;
+                    break;
+                }
+                
+                value[lengths[j]] = '\0';
+                if(!mysqla_append_cell(rows, &offsets[j], j, value, lengths[j]))
+                    failed = true;
+            }
+            
+            rows->numRows++;
+        }
+        
+        if(failed)
+        {
+            mysqla_free_rows(rows);
+            rows = NULL;
+        }
+    }
+    
+    if(metadata != NULL)
+        mysql_free_result(metadata);
+    
+    free(binds);
+    free(lengths);
+    free(isNull);
+    free(value);
+    
+    mysql_stmt_free_result(stmt);
+    
+    return rows;
+}
+
+/*
+ * Execute a prepared statement task with its typed parameters.
+ * Note: Only called from the connection's own worker thread.
+ */
+static void mysqla_execute_statement(mysqla_connection_t *ptr_conn, mysqla_task_t *ptr_task)
+{
+    MYSQL_BIND binds[MYSQLA_MAX_STATEMENT_PARAMS];
+    memset(binds, 0, sizeof(MYSQL_BIND) * ptr_task->numParams);
+    
+    for(int i = 0; i < ptr_task->numParams; i++)
+    {
+        mysqla_param_t *ptr_param = &ptr_task->params[i];
+        switch(ptr_param->type)
+        {
+            case STACK_INT:
+                binds[i].buffer_type = MYSQL_TYPE_LONG;
+                binds[i].buffer = &ptr_param->intVal;
+                break;
+            case STACK_FLOAT:
+                binds[i].buffer_type = MYSQL_TYPE_FLOAT;
+                binds[i].buffer = &ptr_param->floatVal;
+                break;
+            case STACK_STRING:
+                binds[i].buffer_type = MYSQL_TYPE_STRING;
+                binds[i].buffer = ptr_param->strVal;
+                binds[i].buffer_length = ptr_param->strLen;
+                binds[i].length = &ptr_param->strLen;
+                break;
+            default:
+                binds[i].buffer_type = MYSQL_TYPE_NULL;
+                break;
+        }
+    }
+    
+    // A cached statement becomes invalid when the connection was lost (and reconnected), so retry once with a fresh one
+    for(int attempt = 0; attempt < 2; attempt++)
+    {
+        MYSQL_STMT *stmt = mysqla_get_statement(ptr_conn, ptr_task);
+        if(stmt == NULL)
+            return;
+        
+        if(mysql_stmt_param_count(stmt) != (unsigned long)ptr_task->numParams)
+        {
+            printf("ERROR: MySQL statement (%s) expects %lu parameters, got %d\n", ptr_task->query, mysql_stmt_param_count(stmt), ptr_task->numParams);
+            return;
+        }
+        
+        if(mysql_stmt_bind_param(stmt, binds) == MYSQL_NO_ERROR && mysql_stmt_execute(stmt) == MYSQL_NO_ERROR)
+        {
+            if(mysql_stmt_field_count(stmt) == 0)
+                return;
+            
+            if(ptr_task->save)
+            {
+                ptr_task->rows = mysqla_fetch_statement_rows(stmt);
+            }
+            else
+            {
+                mysql_stmt_store_result(stmt);
+                mysql_stmt_free_result(stmt);
+            }
+            
+            return;
+        }
+        
+        const int error = mysql_stmt_errno(stmt);
+        const char *strError = mysql_stmt_error(stmt);
+        
+        if(attempt == 0 && (error == ER_UNKNOWN_STMT_HANDLER || error == CR_SERVER_LOST || error == CR_SERVER_GONE_ERROR))
+        {
+            mysqla_drop_statement(ptr_conn, ptr_task->stmtId);
+            continue;
+        }
+        
+        printf("ERROR: MySQL statement (%s) failed with error %d (%s)\n", ptr_task->query, error, strError);
+        log_mysql_error(ptr_task->query, error, strError);
+        return;
+    }
+}
+
+/*
+ * Execute a group task: its statements are sent in one round trip, wrapped in a transaction.
+ * If any statement fails, the transaction is rolled back and the statements after it aren't executed.
+ * Multiple statements are only allowed on the connection for the duration of the group, so a plain
+ * query can never smuggle in a second statement.
+ * Note: Only called from the connection's own worker thread.
+ */
+static void mysqla_execute_group(mysqla_connection_t *ptr_conn, mysqla_task_t *ptr_task)
+{
+    MYSQL *mysql = ptr_conn->connection;
+    
+    if(mysql_set_server_option(mysql, MYSQL_OPTION_MULTI_STATEMENTS_ON) != MYSQL_NO_ERROR)
+    {
+        const char *strError = mysql_error(mysql);
+        const int error = mysql_errno(mysql);
+        
+        printf("ERROR: MySQL query group (%s) failed with error %d (%s)\n", ptr_task->query, error, strError);
+        log_mysql_error(ptr_task->query, error, strError);
+        mysqla_spool_failed_write(ptr_task, error);
+        
+        ptr_task->groupFailed = true;
+        return;
+    }
+    
+    if(ptr_task->save)
+        ptr_task->groupResults = (mysqla_rows_t **)calloc(ptr_task->groupSize, sizeof(mysqla_rows_t *));
+    
+    // Results are returned in statement order. The first one belongs to START TRANSACTION
+    int statement = -1;
+    int status = mysql_query(mysql, ptr_task->query);
+    while(status == MYSQL_NO_ERROR)
+    {
+        MYSQL_RES *result = mysql_store_result(mysql);
+        if(result == NULL && mysql_field_count(mysql) != 0)
+        {
+            status = 1;
+            break;
+        }
+        
+        if(result != NULL)
+        {
+            if(ptr_task->groupResults != NULL && statement >= 0 && statement < ptr_task->groupSize)
+                ptr_task->groupResults[statement] = mysqla_materialize_result(result);
+            
+            mysql_free_result(result);
+        }
+        
+        statement++;
+        
+        // 0 means there are more results, -1 means we're done and anything else is an error
+        status = mysql_next_result(mysql);
+    }
+    
+    if(status > 0)
+    {
+        const char *strError = mysql_error(mysql);
+        const int error = mysql_errno(mysql);
+        
+        printf("ERROR: MySQL query group (%s) failed with error %d (%s)\n", ptr_task->query, error, strError);
+        log_mysql_error(ptr_task->query, error, strError);
+        mysqla_spool_failed_write(ptr_task, error);
+        
+        ptr_task->groupFailed = true;
+        mysqla_free_group_results(ptr_task);
+        
+        if(mysql_query(mysql, "ROLLBACK") == MYSQL_NO_ERROR)
+        {
+            MYSQL_RES *result = mysql_store_result(mysql);
+            if(result != NULL)
+                mysql_free_result(result);
+        }
+    }
+    
+    // A lost connection is replaced anyway (and the new one starts with single statements)
+    if(mysql_set_server_option(mysql, MYSQL_OPTION_MULTI_STATEMENTS_OFF) != MYSQL_NO_ERROR)
+        printf("ERROR: mysqla_execute_group() couldn't switch multiple statements off again, error %d (%s)\n", mysql_errno(mysql), mysql_error(mysql));
+}
+
+/*
+ * Pass a chunk of a streaming query to the game thread.
+ * Rows wait until the game thread has room for them, the end of the stream is passed right away.
+ */
+static bool mysqla_push_chunk(mysqla_task_t *ptr_task, mysqla_rows_t *rows, int status)
+{
+    mysqla_chunk_t *ptr_chunk = (mysqla_chunk_t *)malloc(sizeof(mysqla_chunk_t));
+    if(ptr_chunk == NULL)
+        return false;
+    
+    if(rows != NULL)
+    {
+        while(sem_wait(&ptr_task->streamSlots) != 0)
+            ; // Interrupted by a signal
+    }
+    
+    ptr_chunk->rows = rows;
+    ptr_chunk->status = status;
+    
+    mysqla_queue_push(&ptr_task->streamChunks, &ptr_chunk->node);
+    
+    return true;
+}
+
+/*
+ * Execute a streaming query: rows are fetched one by one and passed to the game thread in chunks,
+ * so a huge result is never held in memory (or pushed to GSC) all at once.
+ * Note: Only called from the connection's own worker thread.
+ */
+static void mysqla_execute_stream(mysqla_connection_t *ptr_conn, mysqla_task_t *ptr_task)
+{
+    MYSQL *mysql = ptr_conn->connection;
+    MYSQL_RES *result = NULL;
+    int status = -1;
+    
+    if(mysql_query(mysql, ptr_task->query) == MYSQL_NO_ERROR)
+        result = mysql_use_result(mysql);
+    
+    if(result != NULL)
+    {
+        int numFields = mysql_num_fields(result);
+        mysqla_rows_t *rows = NULL;
+        MYSQL_ROW row;
+        
+        status = 1;
+        while((row = mysql_fetch_row(result)) != NULL)
+        {
+            if(rows == NULL)
+            {
+                rows = mysqla_alloc_rows(ptr_task->streamChunkRows, numFields, 0);
+                if(rows != NULL)
+                    mysqla_set_column_types(rows, mysql_fetch_fields(result));
+            }
+            
+            if(rows == NULL || !mysqla_append_row(rows, row, mysql_fetch_lengths(result)))
+            {
+                printf("ERROR: MySQL stream (%s) out of memory\n", ptr_task->query);
+                status = -1;
+                break;
+            }
+            
+            if(rows->numRows == ptr_task->streamChunkRows)
+            {
+                if(!mysqla_push_chunk(ptr_task, rows, 0))
+                {
+                    mysqla_free_rows(rows);
+                    status = -1;
+                    rows = NULL;
+                    break;
+                }
+                
+                rows = NULL;
+            }
+        }
+        
+        // Fetching stops at the end of the rows, but also when the connection fails
+        if(mysql_errno(mysql) != MYSQL_NO_ERROR)
+            status = -1;
+        
+        if(rows != NULL && (status < 0 || !mysqla_push_chunk(ptr_task, rows, 0)))
+        {
+            mysqla_free_rows(rows);
+            status = -1;
+        }
+        
+        // Also discards any rows we didn't fetch
+        mysql_free_result(result);
+    }
+    
+    if(mysql_errno(mysql) != MYSQL_NO_ERROR)
+    {
+        const char *strError = mysql_error(mysql);
+        const int error = mysql_errno(mysql);
+        
+        printf("ERROR: MySQL stream (%s) failed with error %d (%s)\n", ptr_task->query, error, strError);
+        log_mysql_error(ptr_task->query, error, strError);
+    }
+    
+    mysqla_leave_queue(ptr_task);
+    
+    // The end of the stream has to get through, or the task would never be released
+    while(!mysqla_push_chunk(ptr_task, NULL, status))
+        usleep(1000);
+}
+
+/*
+ * Add the size of a task's saved result(s) to the metrics
+ */
+static void mysqla_count_result(const mysqla_task_t *ptr_task)
+{
+    if(ptr_task->rows != NULL)
+    {
+        mysqla_histogram_add(&mysqla_metrics.resultRows, ptr_task->rows->numRows);
+        mysqla_histogram_add(&mysqla_metrics.resultBytes, ptr_task->rows->dataLen);
+    }
+    
+    for(int i = 0; ptr_task->groupResults != NULL && i < ptr_task->groupSize; i++)
+    {
+        if(ptr_task->groupResults[i] != NULL)
+        {
+            mysqla_histogram_add(&mysqla_metrics.resultRows, ptr_task->groupResults[i]->numRows);
+            mysqla_histogram_add(&mysqla_metrics.resultBytes, ptr_task->groupResults[i]->dataLen);
+        }
+    }
+}
+
+/*
+ * Get the share of the time (0 to 1) each connection was busy since the previous read by the same stats reader
+ * and store them in busy, which has room for count connections. Returns the amount of connections.
+ */
+static int mysqla_read_busy_ratios(int reader, float *busy, int count)
+{
+    long long now = mysqla_time_us();
+    long long elapsed = now - mysqla_stats_read_us[reader];
+    mysqla_stats_read_us[reader] = now;
+    
+    int i = 0;
+    for(mysqla_connection_t *ptr_conn = first_async_connection; ptr_conn != NULL; ptr_conn = ptr_conn->next, i++)
+    {
+        long long busyUs = __atomic_load_n(&ptr_conn->busyUs, __ATOMIC_RELAXED);
+        if(i < count)
+            busy[i] = (elapsed > 0) ? (busyUs - ptr_conn->statsBusyUs[reader]) / (float)elapsed : 0;
+        
+        ptr_conn->statsBusyUs[reader] = busyUs;
+    }
+    
+    return (i < count) ? i : count;
+}
+
+/*
+ * Append a summary of a metrics histogram to the stats file
+ */
+static void mysqla_write_histogram(FILE *file, const char *name, const mysqla_histogram_t *histogram, float scale)
+{
+    fprintf(file, "%-14s count %d avg %.2f p50 %.2f p99 %.2f max %.2f\n", name, __atomic_load_n(&histogram->count, __ATOMIC_RELAXED),
+        mysqla_histogram_average(histogram) * scale, mysqla_histogram_percentile(histogram, 50) * scale,
+        mysqla_histogram_percentile(histogram, 99) * scale, __atomic_load_n(&histogram->max, __ATOMIC_RELAXED) * scale);
+}
+
+/*
+ * Background thread appending the metrics to the server's stats file every mysqla_stats_interval seconds
+ */
+static void *mysqla_stats_writer(void *unused)
+{
+    char filePathBuf[32] = {0};
+    snprintf(filePathBuf, sizeof(filePathBuf), "../mysql_stats_%d.log", Shared_GetPort());
+    
+    mysqla_stats_read_us[MYSQLA_STATS_FILE] = mysqla_time_us();
+    
+    while(true)
+    {
+        int interval = __atomic_load_n(&mysqla_stats_interval, __ATOMIC_RELAXED);
+        sleep((interval > 0) ? interval : 1);
+        
+        if(interval <= 0)
+            continue;
+        
+        float busy[64];
+        int connections = mysqla_read_busy_ratios(MYSQLA_STATS_FILE, busy, 64);
+        
+        pthread_mutex_lock(&mysqla_file_lock);
+        
+        FILE *statsFile = fopen(filePathBuf, "a");
+        if(statsFile != NULL)
+        {
+            time_t now = time(NULL);
+            struct tm localNow;
+            char timeBuf[32];
+            strftime(timeBuf, sizeof(timeBuf), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &localNow));
+            
+            fprintf(statsFile, "=== %s ===\n", timeBuf);
+            fprintf(statsFile, "queued %d (peak %d) executed %d errors %d (connection %d) spooled %d rejected %d dropped %d cancelled %d cache hits %d misses %d\n",
+                __atomic_load_n(&mysqla_queued_tasks, __ATOMIC_RELAXED), mysqla_metrics.peakQueued, mysqla_metrics.executed,
+                mysqla_metrics.errors, mysqla_metrics.connectionErrors, mysqla_metrics.spooled, mysqla_metrics.rejected,
+                mysqla_metrics.dropped, mysqla_metrics.cancelled, mysqla_metrics.cacheHits, mysqla_metrics.cacheMisses);
+            
+            fprintf(statsFile, "pools");
+            for(mysqla_pool_t *ptr_pool = __atomic_load_n(&mysqla_pools, __ATOMIC_ACQUIRE); ptr_pool != NULL; ptr_pool = ptr_pool->next)
+                fprintf(statsFile, " %s %d", ptr_pool->name, __atomic_load_n(&ptr_pool->connectionCount, __ATOMIC_RELAXED));
+            fprintf(statsFile, " (opened %d closed %d) timed out %d deduplicated %d reconnects %d failed fast %d\n", mysqla_metrics.poolGrown,
+                mysqla_metrics.poolShrunk, mysqla_metrics.timedOut, mysqla_metrics.deduplicated, mysqla_metrics.reconnects, mysqla_metrics.failedFast);
+            
+            mysqla_write_histogram(statsFile, "queue depth", &mysqla_metrics.queueDepth, 1);
+            mysqla_write_histogram(statsFile, "queue wait ms", &mysqla_metrics.queueWaitUs, 0.001f);
+            mysqla_write_histogram(statsFile, "exec ms", &mysqla_metrics.execUs, 0.001f);
+            mysqla_write_histogram(statsFile, "result rows", &mysqla_metrics.resultRows, 1);
+            mysqla_write_histogram(statsFile, "result bytes", &mysqla_metrics.resultBytes, 1);
+            
+            fprintf(statsFile, "busy %%");
+            for(int i = 0; i < connections; i++)
+                fprintf(statsFile, " %.1f", busy[i] * 100);
+            
+            fprintf(statsFile, "\n");
+            fclose(statsFile);
+        }
+        
+        pthread_mutex_unlock(&mysqla_file_lock);
+    }
+    
+    return NULL;
+}
+
+/*
+ * Stop the watchdog from killing the query of a connection. Waits for a KILL QUERY that is being sent,
+ * so it can't hit the connection's next query.
+ * Returns whether the watchdog killed it already.
+ */
+static bool mysqla_disarm_deadline(mysqla_connection_t *ptr_conn)
+{
+    pthread_mutex_lock(&ptr_conn->deadlineLock);
+    
+    while(ptr_conn->killing)
+        pthread_cond_wait(&ptr_conn->killDone, &ptr_conn->deadlineLock);
+    
+    bool hit = ptr_conn->deadlineHit;
+    ptr_conn->deadlineUs = 0;
+    ptr_conn->deadlineHit = false;
+    
+    pthread_mutex_unlock(&ptr_conn->deadlineLock);
+    
+    return hit;
+}
+
+/*
+ * Open the side connection of a pool that the watchdog kills queries through, if it isn't open yet.
+ * Returns whether it is open.
+ * Note: Only called from the watchdog, without any lock held: connecting may take a while.
+ */
+static bool mysqla_open_kill_connection(mysqla_pool_t *ptr_pool)
+{
+    if(ptr_pool->killConnection != NULL)
+        return true;
+    
+    ptr_pool->killConnection = mysql_init(NULL);
+    if(ptr_pool->killConnection == NULL)
+    {
+        printf("ERROR: mysqla_open_kill_connection() out of memory\n");
+        return false;
+    }
+    
+    my_bool reconnect = true;
+    mysql_options(ptr_pool->killConnection, MYSQL_OPT_RECONNECT, &reconnect);
+    
+    if(mysql_real_connect(ptr_pool->killConnection, ptr_pool->host, ptr_pool->user, ptr_pool->pass, ptr_pool->db, ptr_pool->port, NULL, 0) == NULL)
+    {
+        printf("ERROR: mysqla_open_kill_connection() side connection to %s (%s) failed with error %d (%s)\n", ptr_pool->host, ptr_pool->name, mysql_errno(ptr_pool->killConnection), mysql_error(ptr_pool->killConnection));
+        mysql_close(ptr_pool->killConnection);
+        ptr_pool->killConnection = NULL;
+        return false;
+    }
+    
+    return true;
+}
+
+/*
+ * Kill the query running on a server-side connection through the side connection of its pool (KILL QUERY keeps the connection usable)
+ * Note: Only called from the watchdog, once the side connection is open.
+ */
+static void mysqla_kill_query(mysqla_pool_t *ptr_pool, unsigned long serverThreadId)
+{
+    char query[32];
+    snprintf(query, sizeof(query), "KILL QUERY %lu", serverThreadId);
+    
+    if(mysql_query(ptr_pool->killConnection, query) != MYSQL_NO_ERROR)
+    {
+        const char *strError = mysql_error(ptr_pool->killConnection);
+        const int error = mysql_errno(ptr_pool->killConnection);
+        
+        printf("ERROR: MySQL query (%s) failed with error %d (%s)\n", query, error, strError);
+        log_mysql_error(query, error, strError);
+    }
+}
+
+/*
+ * Background thread killing queries that run past their task's deadline.
+ * Only started once a task with a deadline is created.
+ */
+static void *mysqla_deadline_watchdog(void *unused)
+{
+    mysql_thread_init();
+    
+    while(true)
+    {
+        usleep(MYSQLA_WATCHDOG_INTERVAL_MS * 1000);
+        
+        long long now = mysqla_time_us();
+        for(mysqla_connection_t *ptr_conn = __atomic_load_n(&first_async_connection, __ATOMIC_ACQUIRE); ptr_conn != NULL; ptr_conn = ptr_conn->next)
+        {
+            // Unlocked peek, checked again under the lock
+            long long deadlineUs = __atomic_load_n(&ptr_conn->deadlineUs, __ATOMIC_RELAXED);
+            if(deadlineUs == 0 || now < deadlineUs)
+                continue;
+            
+            // Only the deadline is taken under the lock, the side connection may have to be opened first
+            pthread_mutex_lock(&ptr_conn->deadlineLock);
+            
+            bool expired = (ptr_conn->deadlineUs != 0 && now >= ptr_conn->deadlineUs);
+            if(expired)
+            {
+                ptr_conn->deadlineUs = 0;
+                ptr_conn->deadlineHit = true;
+            }
+            
+            unsigned long serverThreadId = ptr_conn->serverThreadId;
+            
+            pthread_mutex_unlock(&ptr_conn->deadlineLock);
+            
+            if(!expired)
+                continue;
+            
+            mysqla_metric_inc(&mysqla_metrics.timedOut);
+            printf("WARN: mysqla query on connection %lu of pool %s passed its deadline, killing it\n", serverThreadId, ptr_conn->pool->name);
+            
+            if(!mysqla_open_kill_connection(ptr_conn->pool))
+                continue;
+            
+            // The worker may have finished the query meanwhile (which disarms it), then its next query must live on
+            pthread_mutex_lock(&ptr_conn->deadlineLock);
+            ptr_conn->killing = ptr_conn->deadlineHit;
+            pthread_mutex_unlock(&ptr_conn->deadlineLock);
+            
+            if(!ptr_conn->killing)
+                continue;
+            
+            mysqla_kill_query(ptr_conn->pool, serverThreadId);
+            
+            pthread_mutex_lock(&ptr_conn->deadlineLock);
+            ptr_conn->killing = false;
+            pthread_cond_signal(&ptr_conn->killDone);
+            pthread_mutex_unlock(&ptr_conn->deadlineLock);
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * Whether a pool's circuit breaker is open, i.e. its server is taken to be unreachable
+ */
+static bool mysqla_breaker_open(mysqla_pool_t *ptr_pool)
+{
+    int threshold = __atomic_load_n(&mysqla_breaker_threshold, __ATOMIC_RELAXED);
+    return (threshold > 0 && __atomic_load_n(&ptr_pool->failures, __ATOMIC_RELAXED) >= threshold);
+}
+
+/*
+ * Count a failed connect of a pool towards its circuit breaker. A lost connection that can be replaced right away
+ * doesn't count, the server just dropped it.
+ */
+static void mysqla_pool_failed(mysqla_pool_t *ptr_pool)
+{
+    int failures = __atomic_add_fetch(&ptr_pool->failures, 1, __ATOMIC_RELAXED);
+    if(failures == __atomic_load_n(&mysqla_breaker_threshold, __ATOMIC_RELAXED))
+    {
+        printf("WARN: mysqla circuit breaker of pool %s opened after %d failures, its reads fail right away\n", ptr_pool->name, failures);
+        
+        // The dispatcher doesn't poll, so let it fail the reads that are already waiting
+        mysqla_wake_dispatcher();
+    }
+}
+
+/*
+ * A connect, ping or query of a pool got through, which closes its circuit breaker
+ */
+static void mysqla_pool_reached(mysqla_pool_t *ptr_pool)
+{
+    if(__atomic_load_n(&ptr_pool->failures, __ATOMIC_RELAXED) == 0)
+        return;
+    
+    if(mysqla_breaker_open(ptr_pool))
+        printf("mysqla: circuit breaker of pool %s closed, the server can be reached again\n", ptr_pool->name);
+    
+    __atomic_store_n(&ptr_pool->failures, 0, __ATOMIC_RELAXED);
+}
+
+static void mysqla_reconnect(mysqla_connection_t *ptr_conn);
+
+/*
+ * Execute the INSERTs merged into a task one by one, after the merged INSERT failed. One bad row (e.g. a duplicate key)
+ * fails a merged INSERT as a whole, this way the other rows still get inserted and only the bad one is logged.
+ * Note: Only called from the connection's own worker thread.
+ */
+static void mysqla_execute_coalesced(mysqla_connection_t *ptr_conn, mysqla_task_t *ptr_leader)
+{
+    // The leader's own row is the start of the merged INSERT
+    int leaderLen = ptr_leader->queryLen;
+    for(mysqla_task_t *ptr_task = ptr_leader->coalesced; ptr_task != NULL; ptr_task = ptr_task->coalesced)
+        leaderLen -= 1 + mysqla_get_values_length(ptr_task);
+    
+    for(mysqla_task_t *ptr_task = ptr_leader; ptr_task != NULL; ptr_task = ptr_task->coalesced)
+    {
+        // Cut the leader's query off after its own row for now (this worker owns the task while executing it)
+        int len = (ptr_task == ptr_leader) ? leaderLen : ptr_task->queryLen;
+        char cut = ptr_task->query[len];
+        ptr_task->query[len] = '\0';
+        
+        int error = MYSQL_NO_ERROR;
+        if(mysql_query(ptr_conn->connection, ptr_task->query) != MYSQL_NO_ERROR)
+        {
+            const char *strError = mysql_error(ptr_conn->connection);
+            error = mysql_errno(ptr_conn->connection);
+            
+            printf("ERROR: MySQL query (%s) failed with error %d (%s)\n", ptr_task->query, error, strError);
+            log_mysql_error(ptr_task->query, error, strError);
+        }
+        
+        ptr_task->query[len] = cut;
+        
+        // The rows after it never reached the server, so they can wait in the spool
+        if(mysqla_is_connection_error(error))
+        {
+            for(ptr_task = ptr_task->coalesced; ptr_task != NULL; ptr_task = ptr_task->coalesced)
+            {
+                if(!mysqla_spool_append(ptr_task->query, ptr_task->queryLen))
+                    printf("ERROR: MySQL write (%s) lost, it couldn't be spooled\n", ptr_task->query);
+            }
+            
+            return;
+        }
+    }
+}
+
+/*
+ * Execute the task that was handed to the specified connection.
+ * Note: Only called from the connection's own worker thread.
+ */
+static void mysqla_execute_query(mysqla_connection_t *ptr_conn)
+{
+    long long startUs = mysqla_time_us();
+    
+    // Let the watchdog kill the query once its deadline passes
+    bool armed = (ptr_conn->task->deadlineUs != 0);
+    if(armed)
+    {
+        pthread_mutex_lock(&ptr_conn->deadlineLock);
+        ptr_conn->serverThreadId = mysql_thread_id(ptr_conn->connection);
+        ptr_conn->deadlineHit = false;
+        ptr_conn->deadlineUs = ptr_conn->task->deadlineUs;
+        pthread_mutex_unlock(&ptr_conn->deadlineLock);
+    }
+    
+    printf("trying to execute query %s\n", ptr_conn->task->query);
+    if(ptr_conn->task->streamChunkRows > 0)
+    {
+        // Streams pass their rows and their end to the game thread through their own chunk queue
+        mysqla_execute_stream(ptr_conn, ptr_conn->task);
+    }
+    else
+    {
+        if(ptr_conn->task->stmtId != 0)
+        {
+            mysqla_execute_statement(ptr_conn, ptr_conn->task);
+        }
+        else if(ptr_conn->task->groupSize > 0)
+        {
+            mysqla_execute_group(ptr_conn, ptr_conn->task);
+        }
+        else if(mysql_query(ptr_conn->connection, ptr_conn->task->query) == MYSQL_NO_ERROR)
+        {
+            MYSQL_RES *result = mysql_store_result(ptr_conn->connection);
+            if(result != NULL)
+            {
+                // Only keep the rows if GSC wanted us to. They are copied, so the result is freed right away
+                if(ptr_conn->task->save)
+                    ptr_conn->task->rows = mysqla_materialize_result(result);
+                
+                mysql_free_result(result);
+            }
+        
+            // A stored procedure returns more results (at least its status), discard them to keep the connection usable
+            int status;
+            while((status = mysql_next_result(ptr_conn->connection)) == MYSQL_NO_ERROR)
+            {
+                MYSQL_RES *result = mysql_store_result(ptr_conn->connection);
+                if(result != NULL)
+                    mysql_free_result(result);
+            }
+            
+            // A later result can still carry an error, e.g. of a statement inside the procedure
+            if(status > 0)
+            {
+                const char *strError = mysql_error(ptr_conn->connection);
+                const int error = mysql_errno(ptr_conn->connection);
+                
+                printf("ERROR: MySQL query (%s) failed with error %d (%s)\n", ptr_conn->task->query, error, strError);
+                log_mysql_error(ptr_conn->task->query, error, strError);
+            }
+        }
+        else
+        {
+            const int error = mysql_errno(ptr_conn->connection);
+            
+            // The rows of a merged INSERT the server rejected are tried one by one, so one bad row doesn't take
+            // the others down with it. Only the rows that fail on their own are logged then
+            if(ptr_conn->task->coalesced != NULL && !mysqla_is_connection_error(error))
+            {
+                mysqla_execute_coalesced(ptr_conn, ptr_conn->task);
+            }
+            else
+            {
+                const char *strError = mysql_error(ptr_conn->connection);
+                
+                printf("ERROR: MySQL query (%s) failed with error %d (%s)\n", ptr_conn->task->query, error, strError);
+                
+                // Handle the file IO for appending to our mysql error log file
+                log_mysql_error(ptr_conn->task->query, error, strError);
+                
+                // Writes are replayed once the database can be reached again
+                mysqla_spool_failed_write(ptr_conn->task, error);
+            }
+        }
+        
+        if(armed)
+        {
+            ptr_conn->task->timedOut = mysqla_disarm_deadline(ptr_conn);
+            armed = false;
+        }
+        
+        mysqla_count_result(ptr_conn->task);
+        mysqla_leave_queue(ptr_conn->task);
+        
+        // Hand the finished task to the game thread. From here on it may be freed at any time
+        mysqla_queue_push(&mysqla_done_queue, &ptr_conn->task->node);
+    }
+    
+    // Streams end on their own (a killed one fails), the task may be gone by now
+    if(armed)
+        mysqla_disarm_deadline(ptr_conn);
+    
+    long long execUs = mysqla_time_us() - startUs;
+    mysqla_histogram_add(&mysqla_metrics.execUs, execUs);
+    mysqla_metric_inc(&mysqla_metrics.executed);
+    __atomic_add_fetch(&ptr_conn->busyUs, execUs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ptr_conn->pool->executed, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&ptr_conn->pool->outstanding, 1, __ATOMIC_RELAXED);
+    
+    // The client library doesn't reconnect, so a lost connection is replaced before the next task reaches it
+    if(mysqla_is_connection_error(mysql_errno(ptr_conn->connection)))
+        mysqla_reconnect(ptr_conn);
+    else
+        mysqla_pool_reached(ptr_conn->pool);
+    
+    // This connection is idle again, so a queued task can be started on it right away
+    ptr_conn->idleSinceUs = mysqla_time_us();
+    __atomic_store_n(&ptr_conn->task, (mysqla_task_t *)NULL, __ATOMIC_RELEASE);
+    mysqla_wake_dispatcher();
+}
+
+/*
+ * Connect a connection to its pool's server, trying again (with a growing wait) until the server can be reached.
+ * Note: Only called from the connection's own worker thread, so the connections connect in parallel.
+ */
+static void mysqla_connect(mysqla_connection_t *ptr_conn)
+{
+    mysqla_pool_t *ptr_pool = ptr_conn->pool;
+    int retryMs = MYSQLA_CONNECT_RETRY_MS;
+    
+    while(true)
+    {
+        ptr_conn->connection = mysql_init(NULL);
+        if(ptr_conn->connection == NULL)
+        {
+            printf("ERROR: mysqla_connect() out of memory, connecting to %s (%s) again in %d ms\n", ptr_pool->host, ptr_pool->name, retryMs);
+        }
+        else
+        {
+            // Single statements only, groups switch multiple statements on while they run (see mysqla_execute_group()).
+            // Multiple results are still needed for those groups and for stored procedures
+            if(mysql_real_connect(ptr_conn->connection, ptr_pool->host, ptr_pool->user, ptr_pool->pass, ptr_pool->db, ptr_pool->port, NULL, CLIENT_MULTI_RESULTS) != NULL)
+                break;
+            
+            printf("ERROR: mysqla connection to %s (%s) failed with error %d (%s), connecting again in %d ms\n", ptr_pool->host, ptr_pool->name,
+                mysql_errno(ptr_conn->connection), mysql_error(ptr_conn->connection), retryMs);
+            
+            mysql_close(ptr_conn->connection);
+            ptr_conn->connection = NULL;
+            mysqla_pool_failed(ptr_pool);
+        }
+        
+        usleep(retryMs * 1000);
+        
+        retryMs *= 2;
+        if(retryMs > MYSQLA_CONNECT_RETRY_MAX_MS)
+            retryMs = MYSQLA_CONNECT_RETRY_MAX_MS;
+    }
+    
+    // A silent reconnect in the middle of a task loses the session (and prepared statements) without anyone noticing.
+    // The worker replaces a lost connection itself instead, see mysqla_reconnect()
+    my_bool reconnect = false;
+    mysql_options(ptr_conn->connection, MYSQL_OPT_RECONNECT, &reconnect);
+    
+    mysqla_pool_reached(ptr_pool);
+    ptr_conn->checkedUs = mysqla_time_us();
+    
+    __atomic_add_fetch(&ptr_pool->readyConnections, 1, __ATOMIC_RELAXED);
+    if(ptr_pool->replica)
+        __atomic_add_fetch(&mysqla_replica_connections, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Close a connection's prepared statements and the connection itself.
+ * Note: Only called from the connection's own worker thread.
+ */
+static void mysqla_disconnect(mysqla_connection_t *ptr_conn)
+{
+    for(int i = 0; i < ptr_conn->statementCount; i++)
+    {
+        if(ptr_conn->statements[i] != NULL)
+            mysql_stmt_close(ptr_conn->statements[i]);
+    }
+    
+    free(ptr_conn->statements);
+    ptr_conn->statements = NULL;
+    ptr_conn->statementCount = 0;
+    
+    mysql_close(ptr_conn->connection);
+    ptr_conn->connection = NULL;
+}
+
+/*
+ * Replace a connection that was lost, before the dispatcher hands it another task.
+ * The connection keeps the MYSQLA_CONNECTION_CLOSED placeholder until it is connected again.
+ * Note: Only called from the connection's own worker thread, while its connection isn't idle.
+ */
+static void mysqla_reconnect(mysqla_connection_t *ptr_conn)
+{
+    mysqla_pool_t *ptr_pool = ptr_conn->pool;
+    
+    __atomic_store_n(&ptr_conn->task, MYSQLA_CONNECTION_CLOSED, __ATOMIC_RELEASE);
+    
+    __atomic_sub_fetch(&ptr_pool->readyConnections, 1, __ATOMIC_RELAXED);
+    if(ptr_pool->replica)
+        __atomic_sub_fetch(&mysqla_replica_connections, 1, __ATOMIC_RELEASE);
+    
+    mysqla_metric_inc(&mysqla_metrics.reconnects);
+    
+    mysqla_disconnect(ptr_conn);
+    mysqla_connect(ptr_conn);
+}
+
+/*
+ * Check whether an idle connection still works, as the dispatcher asked for. A connection the server dropped
+ * (wait_timeout, a restart) is replaced, so no task has to find out the hard way.
+ * Note: Only called from the connection's own worker thread.
+ */
+static void mysqla_ping_connection(mysqla_connection_t *ptr_conn)
+{
+    if(mysql_ping(ptr_conn->connection) == MYSQL_NO_ERROR)
+    {
+        mysqla_pool_reached(ptr_conn->pool);
+    }
+    else
+    {
+        printf("WARN: mysqla ping on a connection of pool %s failed with error %d (%s), reconnecting\n", ptr_conn->pool->name,
+            mysql_errno(ptr_conn->connection), mysql_error(ptr_conn->connection));
+        
+        mysqla_reconnect(ptr_conn);
+    }
+    
+    ptr_conn->checkedUs = mysqla_time_us();
+    __atomic_store_n(&ptr_conn->task, (mysqla_task_t *)NULL, __ATOMIC_RELEASE);
+    mysqla_wake_dispatcher();
+}
+
+/*
+ * Persistent worker thread bound to a single connection.
+ * Connects the connection, then sleeps until the dispatcher hands a task to it, executes it and goes back to sleep.
+ * This saves a thread creation (and its latency) for every single query.
+ */
+static void *mysqla_connection_worker(void *ptr_conn_arg)
+{
+    mysqla_connection_t *ptr_conn = (mysqla_connection_t *)ptr_conn_arg;
+    
+    // Long-lived thread, so set up the per-thread client library state once
+    mysql_thread_init();
+    
+    mysqla_connect(ptr_conn);
+    
+    if(ptr_conn->grown)
+    {
+        ptr_conn->grown = false;
+        __atomic_sub_fetch(&ptr_conn->pool->connecting, 1, __ATOMIC_RELAXED);
+    }
+    
+    // Only now the dispatcher sees it as idle
+    ptr_conn->idleSinceUs = mysqla_time_us();
+    __atomic_store_n(&ptr_conn->task, (mysqla_task_t *)NULL, __ATOMIC_RELEASE);
+    mysqla_wake_dispatcher();
+    
+    while(true)
+    {
+        pthread_mutex_lock(&ptr_conn->lock);
+        
+        while(ptr_conn->task == NULL)
+            pthread_cond_wait(&ptr_conn->taskAssigned, &ptr_conn->lock);
+        
+        pthread_mutex_unlock(&ptr_conn->lock);
+        
+        // The pool sizing retired the connection, it stays in the list to be opened again later on
+        if(ptr_conn->task == MYSQLA_CONNECTION_CLOSED)
+            break;
+        
+        if(ptr_conn->task == MYSQLA_CONNECTION_PING)
+        {
+            mysqla_ping_connection(ptr_conn);
+            continue;
+        }
+        
+        // The task can't be taken away from us, so no need to hold the lock while executing it
+        mysqla_execute_query(ptr_conn);
+    }
+    
+    mysqla_disconnect(ptr_conn);
+    mysql_thread_end();
+    
+    __atomic_store_n(&ptr_conn->closed, true, __ATOMIC_RELEASE);
+    
+    return NULL;
+}
+
+/*
+ * Pick the priority class to start the next task from, by smooth weighted round-robin over the classes with
+ * pending tasks. Every class gets a share of at least weight 1, so a flood of one class can't starve another.
+ * Only interactive tasks may take one of the connections reserved for them.
+ * Each route keeps its own credits, as its classes compete for a different set of connections.
+ * Returns the class, or -1 if no task may be started.
+ * Note: Only called from the dispatcher.
+ */
+static int mysqla_pick_priority(mysqla_task_t **ptr_firstPending, int *credits, bool unreservedIdle)
+{
+    int best = -1;
+    int totalWeight = 0;
+    for(int i = 0; i < MYSQLA_PRIORITY_CLASSES; i++)
+    {
+        if(ptr_firstPending[i] == NULL || (i != MYSQLA_PRIORITY_INTERACTIVE && !unreservedIdle))
+            continue;
+        
+        int weight = __atomic_load_n(&mysqla_priority_weights[i], __ATOMIC_RELAXED);
+        if(weight < 1)
+            weight = 1;
+        
+        credits[i] += weight;
+        totalWeight += weight;
+        
+        if(best < 0 || credits[i] > credits[best])
+            best = i;
+    }
+    
+    if(best >= 0)
+        credits[best] -= totalWeight;
+    
+    return best;
+}
+
+/*
+ * Record the queue wait of a task the dispatcher is about to start
+ */
+static void mysqla_count_started(mysqla_task_t *ptr_task)
+{
+    mysqla_priority_stats_t *ptr_stats = &mysqla_priority_stats[ptr_task->priority];
+    int waitUs = mysqla_time_us() - ptr_task->queuedAt;
+    
+    __atomic_sub_fetch(&ptr_stats->queued, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ptr_stats->started, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ptr_stats->waitCount, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ptr_stats->totalWaitUs, waitUs, __ATOMIC_RELAXED);
+    
+    mysqla_histogram_add(&mysqla_metrics.queueWaitUs, waitUs);
+    
+    int maxWaitUs = __atomic_load_n(&ptr_stats->maxWaitUs, __ATOMIC_RELAXED);
+    while(waitUs > maxWaitUs && !__atomic_compare_exchange_n(&ptr_stats->maxWaitUs, &maxWaitUs, waitUs, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Find an idle connection for a task of the specified route (MYSQLA_ROUTE_*).
+ * Replica reads go to the replica with the least outstanding tasks, so a slower (or smaller) replica gets less work.
+ * Returns NULL if all connections of the route are busy.
+ * Note: Only called from the dispatcher.
+ */
+static mysqla_connection_t *mysqla_find_idle_connection(int route)
+{
+    mysqla_connection_t *ptr_best = NULL;
+    int bestOutstanding = 0;
+    
+    mysqla_connection_t *ptr_conn = __atomic_load_n(&first_async_connection, __ATOMIC_ACQUIRE);
+    for(; ptr_conn != NULL; ptr_conn = ptr_conn->next)
+    {
+        if(ptr_conn->pool->replica != (route == MYSQLA_ROUTE_REPLICA) || __atomic_load_n(&ptr_conn->task, __ATOMIC_ACQUIRE) != NULL)
+            continue;
+        
+        if(route == MYSQLA_ROUTE_PRIMARY)
+            return ptr_conn;
+        
+        int outstanding = __atomic_load_n(&ptr_conn->pool->outstanding, __ATOMIC_RELAXED);
+        if(ptr_best == NULL || outstanding < bestOutstanding)
+        {
+            ptr_best = ptr_conn;
+            bestOutstanding = outstanding;
+        }
+    }
+    
+    return ptr_best;
+}
+
+/*
+ * Append a task to the pending list of its route and priority class.
+ * Note: Only called from the dispatcher.
+ */
+static void mysqla_add_pending(mysqla_task_t *ptr_firstPending[MYSQLA_ROUTES][MYSQLA_PRIORITY_CLASSES], mysqla_task_t *ptr_lastPending[MYSQLA_ROUTES][MYSQLA_PRIORITY_CLASSES], mysqla_task_t *ptr_task, bool haveReplicas)
+{
+    // Reads only wait for a replica if there is one, otherwise everything goes to the primary
+    int route = ((ptr_task->read && haveReplicas) ? MYSQLA_ROUTE_REPLICA : MYSQLA_ROUTE_PRIMARY);
+    int priority = ptr_task->priority;
+    ptr_task->pending = NULL;
+    
+    if(ptr_lastPending[route][priority] == NULL)
+        ptr_firstPending[route][priority] = ptr_task;
+    else
+        ptr_lastPending[route][priority]->pending = ptr_task;
+    
+    ptr_lastPending[route][priority] = ptr_task;
+    __atomic_add_fetch(&mysqla_priority_stats[priority].queued, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Whether a task only reads, so it may be failed while its server can't be reached.
+ * A write is never failed that way: its script couldn't tell a write that was spooled from one that was lost.
+ */
+static bool mysqla_task_is_read(mysqla_task_t *ptr_task)
+{
+    if(ptr_task->read)
+        return true;
+    
+    // Reads kept on the primary, prepared statements and groups aren't known to be reads
+    return (ptr_task->stmtId == 0 && ptr_task->groupSize == 0 && mysqla_query_is_read(ptr_task->query));
+}
+
+/*
+ * Complete a pending read without executing it, because the circuit breaker of its route is open.
+ * The callback gets undefined right away instead of after a connect timeout.
+ * Note: Only called from the dispatcher.
+ */
+static void mysqla_fail_task(mysqla_task_t *ptr_task)
+{
+    // Cancelled while waiting, it's given back as it is
+    int state = MYSQLA_STATE_WAITING;
+    if(!__atomic_compare_exchange_n(&ptr_task->state, &state, MYSQLA_STATE_STARTED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        __atomic_sub_fetch(&mysqla_priority_stats[ptr_task->priority].queued, 1, __ATOMIC_RELAXED);
+        mysqla_queue_push(&mysqla_done_queue, &ptr_task->node);
+        return;
+    }
+    
+    mysqla_count_started(ptr_task);
+    mysqla_metric_inc(&mysqla_metrics.failedFast);
+    
+    mysqla_leave_queue(ptr_task);
+    mysqla_queue_push(&mysqla_done_queue, &ptr_task->node);
+}
+
+/*
+ * Spool a pending write instead of executing it, because the circuit breaker of its route is open.
+ * From then on new writes are spooled as they are submitted (see mysqla_spool_task()), so they stay in order.
+ * Returns false if the write can't be spooled (prepared statements, no spool), it has to wait for the server then.
+ * Note: Only called from the dispatcher.
+ */
+static bool mysqla_spool_waiting_task(mysqla_task_t *ptr_task)
+{
+    if(mysqla_spool_fd < 0 || ptr_task->stmtId != 0 || ptr_task->streamChunkRows > 0 || mysqla_query_is_read(ptr_task->query))
+        return false;
+    
+    // Cancelled while waiting, it's given back as it is
+    int state = MYSQLA_STATE_WAITING;
+    if(!__atomic_compare_exchange_n(&ptr_task->state, &state, MYSQLA_STATE_STARTED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        __atomic_sub_fetch(&mysqla_priority_stats[ptr_task->priority].queued, 1, __ATOMIC_RELAXED);
+        mysqla_queue_push(&mysqla_done_queue, &ptr_task->node);
+        return true;
+    }
+    
+    mysqla_count_started(ptr_task);
+    
+    // It never reached the server, so unlike a write whose connection was lost it's spooled even if it isn't idempotent
+    if(!mysqla_spool_append(ptr_task->query, ptr_task->queryLen))
+        printf("ERROR: MySQL write (%s) lost, it couldn't be spooled\n", ptr_task->query);
+    
+    mysqla_leave_queue(ptr_task);
+    mysqla_queue_push(&mysqla_done_queue, &ptr_task->node);
+    
+    return true;
+}
+
+/*
+ * Whether the circuit breakers of all pools of a route (MYSQLA_ROUTE_*) are open
+ * Note: Only called from the dispatcher.
+ */
+static bool mysqla_route_down(int route)
+{
+    bool found = false;
+    for(mysqla_pool_t *ptr_pool = __atomic_load_n(&mysqla_pools, __ATOMIC_ACQUIRE); ptr_pool != NULL; ptr_pool = ptr_pool->next)
+    {
+        if(ptr_pool->replica != (route == MYSQLA_ROUTE_REPLICA))
+            continue;
+        
+        if(!mysqla_breaker_open(ptr_pool))
+            return false;
+        
+        found = true;
+    }
+    
+    return found;
+}
+
+/*
+ * Find the lane with the specified key.
+ * Returns NULL if none of the lane's tasks is pending or running.
+ * Note: Only called from the dispatcher.
+ */
+static mysqla_lane_t *mysqla_find_lane(int key)
+{
+    mysqla_lane_t *ptr_lane = mysqla_lanes[(unsigned int)key & (MYSQLA_LANE_BUCKETS - 1)];
+    while(ptr_lane != NULL && ptr_lane->key != key)
+        ptr_lane = ptr_lane->next;
+    
+    return ptr_lane;
+}
+
+/*
+ * Put a submitted task into its lane.
+ * Returns true if the task may be started right away, false if it is held back until the lane's earlier tasks are done.
+ * Note: Only called from the dispatcher.
+ */
+static bool mysqla_enter_lane(mysqla_task_t *ptr_task)
+{
+    mysqla_lane_t *ptr_lane = mysqla_find_lane(ptr_task->lane);
+    if(ptr_lane != NULL)
+    {
+        ptr_task->pending = NULL;
+        if(ptr_lane->lastHeld == NULL)
+            ptr_lane->firstHeld = ptr_task;
+        else
+            ptr_lane->lastHeld->pending = ptr_task;
+        
+        ptr_lane->lastHeld = ptr_task;
+        return false;
+    }
+    
+    ptr_lane = mysqla_free_lanes;
+    if(ptr_lane != NULL)
+        mysqla_free_lanes = ptr_lane->next;
+    else
+        ptr_lane = (mysqla_lane_t *)malloc(sizeof(mysqla_lane_t));
+    
+    // Without memory for the lane the task just isn't ordered
+    if(ptr_lane == NULL)
+    {
+        printf("ERROR: mysqla_enter_lane() out of memory, task %d executed unordered\n", ptr_task->taskId);
+        ptr_task->lane = 0;
+        return true;
+    }
+    
+    int bucket = (unsigned int)ptr_task->lane & (MYSQLA_LANE_BUCKETS - 1);
+    ptr_lane->key = ptr_task->lane;
+    ptr_lane->firstHeld = NULL;
+    ptr_lane->lastHeld = NULL;
+    ptr_lane->next = mysqla_lanes[bucket];
+    mysqla_lanes[bucket] = ptr_lane;
+    
+    return true;
+}
+
+/*
+ * The current task of a lane is done (or was dropped). Moves the lane's next task to the pending lists,
+ * or removes the lane if nothing else of it is waiting.
+ * Note: Only called from the dispatcher.
+ */
+static void mysqla_advance_lane(mysqla_lane_t *ptr_lane, mysqla_task_t *ptr_firstPending[MYSQLA_ROUTES][MYSQLA_PRIORITY_CLASSES], mysqla_task_t *ptr_lastPending[MYSQLA_ROUTES][MYSQLA_PRIORITY_CLASSES], bool haveReplicas)
+{
+    mysqla_task_t *ptr_task = ptr_lane->firstHeld;
+    if(ptr_task != NULL)
+    {
+        ptr_lane->firstHeld = ptr_task->pending;
+        if(ptr_lane->firstHeld == NULL)
+            ptr_lane->lastHeld = NULL;
+        
+        mysqla_add_pending(ptr_firstPending, ptr_lastPending, ptr_task, haveReplicas);
+        return;
+    }
+    
+    mysqla_lane_t **ptr_link = &mysqla_lanes[(unsigned int)ptr_lane->key & (MYSQLA_LANE_BUCKETS - 1)];
+    while(*ptr_link != ptr_lane)
+        ptr_link = &(*ptr_link)->next;
+    
+    *ptr_link = ptr_lane->next;
+    ptr_lane->next = mysqla_free_lanes;
+    mysqla_free_lanes = ptr_lane;
+}
+
+/*
+ * Grow pools whose tasks wait too long and close connections that were idle for too long.
+ * Opening a connection takes a while, so that's left to the opener thread. Closing is done here, as only the
+ * dispatcher hands out tasks: an idle connection gets the MYSQLA_CONNECTION_CLOSED placeholder, its worker closes it.
+ * Note: Only called from the dispatcher.
+ */
+static void mysqla_resize_pools(mysqla_task_t *ptr_firstPending[MYSQLA_ROUTES][MYSQLA_PRIORITY_CLASSES])
+{
+    long long now = mysqla_time_us();
+    
+    // Longest wait of the tasks still pending on each route
+    int waitMs[MYSQLA_ROUTES];
+    for(int route = 0; route < MYSQLA_ROUTES; route++)
+    {
+        waitMs[route] = 0;
+        for(int i = 0; i < MYSQLA_PRIORITY_CLASSES; i++)
+        {
+            mysqla_task_t *ptr_task = ptr_firstPending[route][i];
+            if(ptr_task != NULL && (now - ptr_task->queuedAt) / 1000 > waitMs[route])
+                waitMs[route] = (now - ptr_task->queuedAt) / 1000;
+        }
+    }
+    
+    bool requested = false;
+    bool replicaRequested = false;
+    for(mysqla_pool_t *ptr_pool = __atomic_load_n(&mysqla_pools, __ATOMIC_ACQUIRE); ptr_pool != NULL; ptr_pool = ptr_pool->next)
+    {
+        int maxConnections = __atomic_load_n(&ptr_pool->maxConnections, __ATOMIC_RELAXED);
+        if(maxConnections == 0)
+            continue;
+        
+        // One connection at a time, a single slow burst shouldn't open all of them. Of the replicas, only one grows per check.
+        // A connection still connecting counts as well, or a slow connect would have another one opened each check
+        int count = __atomic_load_n(&ptr_pool->connectionCount, __ATOMIC_RELAXED);
+        int opening = __atomic_load_n(&ptr_pool->opening, __ATOMIC_RELAXED) + __atomic_load_n(&ptr_pool->connecting, __ATOMIC_RELAXED);
+        int route = (ptr_pool->replica ? MYSQLA_ROUTE_REPLICA : MYSQLA_ROUTE_PRIMARY);
+        int minConnections = __atomic_load_n(&ptr_pool->minConnections, __ATOMIC_RELAXED);
+        if(opening == 0 && count < maxConnections && (count < minConnections || waitMs[route] >= __atomic_load_n(&ptr_pool->growWaitMs, __ATOMIC_RELAXED)) && !(ptr_pool->replica && replicaRequested))
+        {
+            __atomic_add_fetch(&ptr_pool->opening, 1, __ATOMIC_RELAXED);
+            requested = true;
+            replicaRequested |= ptr_pool->replica;
+        }
+    }
+    
+    if(requested)
+    {
+        pthread_mutex_lock(&mysqla_opener_lock);
+        mysqla_opener_pending = true;
+        pthread_cond_signal(&mysqla_opener_cond);
+        pthread_mutex_unlock(&mysqla_opener_lock);
+    }
+    
+    for(mysqla_connection_t *ptr_conn = __atomic_load_n(&first_async_connection, __ATOMIC_ACQUIRE); ptr_conn != NULL; ptr_conn = ptr_conn->next)
+    {
+        mysqla_pool_t *ptr_pool = ptr_conn->pool;
+        int maxConnections = __atomic_load_n(&ptr_pool->maxConnections, __ATOMIC_RELAXED);
+        if(maxConnections == 0 || ptr_conn->lane != NULL || __atomic_load_n(&ptr_conn->task, __ATOMIC_ACQUIRE) != NULL)
+            continue;
+        
+        // Above the maximum (it was lowered) the idle time doesn't matter
+        int count = __atomic_load_n(&ptr_pool->connectionCount, __ATOMIC_RELAXED);
+        bool expired = (now - ptr_conn->idleSinceUs) / 1000 >= __atomic_load_n(&ptr_pool->idleTimeoutMs, __ATOMIC_RELAXED);
+        if(count <= 1 || !(count > maxConnections || (expired && count > __atomic_load_n(&ptr_pool->minConnections, __ATOMIC_RELAXED))))
+            continue;
+        
+        __atomic_sub_fetch(&ptr_pool->connectionCount, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&ptr_pool->readyConnections, 1, __ATOMIC_RELAXED);
+        if(ptr_pool->replica)
+            __atomic_sub_fetch(&mysqla_replica_connections, 1, __ATOMIC_RELEASE);
+        
+        mysqla_metric_inc(&mysqla_metrics.poolShrunk);
+        printf("mysqla: closing an idle connection of pool %s, %d left\n", ptr_pool->name, count - 1);
+        
+        pthread_mutex_lock(&ptr_conn->lock);
+        ptr_conn->task = MYSQLA_CONNECTION_CLOSED;
+        pthread_cond_signal(&ptr_conn->taskAssigned);
+        pthread_mutex_unlock(&ptr_conn->lock);
+    }
+}
+
+/*
+ * Let the workers ping connections that have been idle for a while, so a connection the server dropped
+ * (wait_timeout, a restart) is replaced before a task reaches it. While a pool's circuit breaker is open,
+ * its idle connections are pinged more often: the first ping that gets through closes the breaker.
+ * Returns when the next ping is due, 0 if none is.
+ * Note: Only called from the dispatcher.
+ */
+static long long mysqla_check_connections(void)
+{
+    long long now = mysqla_time_us();
+    long long dueUs = 0;
+    int intervalMs = __atomic_load_n(&mysqla_ping_interval_ms, __ATOMIC_RELAXED);
+    
+    for(mysqla_connection_t *ptr_conn = __atomic_load_n(&first_async_connection, __ATOMIC_ACQUIRE); ptr_conn != NULL; ptr_conn = ptr_conn->next)
+    {
+        if(ptr_conn->lane != NULL || __atomic_load_n(&ptr_conn->task, __ATOMIC_ACQUIRE) != NULL)
+            continue;
+        
+        int waitMs = intervalMs;
+        if(mysqla_breaker_open(ptr_conn->pool) && (waitMs == 0 || waitMs > MYSQLA_BREAKER_PROBE_MS))
+            waitMs = MYSQLA_BREAKER_PROBE_MS;
+        
+        if(waitMs == 0)
+            continue;
+        
+        // The connection's worker wakes us up once the ping is done, so only idle connections need a due time
+        long long lastUs = (ptr_conn->checkedUs > ptr_conn->idleSinceUs) ? ptr_conn->checkedUs : ptr_conn->idleSinceUs;
+        long long pingUs = lastUs + waitMs * 1000LL;
+        if(pingUs > now)
+        {
+            if(dueUs == 0 || pingUs < dueUs)
+                dueUs = pingUs;
+            
+            continue;
+        }
+        
+        pthread_mutex_lock(&ptr_conn->lock);
+        ptr_conn->task = MYSQLA_CONNECTION_PING;
+        pthread_cond_signal(&ptr_conn->taskAssigned);
+        pthread_mutex_unlock(&ptr_conn->lock);
+    }
+    
+    return dueUs;
+}
+
+/*
+ * Asynchronous background MySQL handler.
+ * Handles handing each new MySQL query to an idle connection's worker thread.
+ */
+static void *mysqla_query_handler(void *unused)
+{
+    // Only need to start the handler once. Starting it multiple times is a developer error.
+    static bool started = false;
+    if(started)
+    {
+        printf("ERROR: mysqla_query_handler() async handler already started.\n");
+        return NULL;
+    }
+    
+    started = true;
+    
+    // The first connection should be initialized before this function is called!
+    mysqla_connection_t *ptr_conn = first_async_connection;
+    if(ptr_conn == NULL)
+    {
+        printf("ERROR: mysqla_query_handler() async handler started before any connection was initialized\n");
+        started = false;
+        return NULL;
+    }
+    
+    // Tasks taken from the submission queue that are waiting for an idle connection, in submission order per route and priority class.
+    // Only this thread ever touches these lists, so they need no locking.
+    mysqla_task_t *ptr_firstPending[MYSQLA_ROUTES][MYSQLA_PRIORITY_CLASSES] = {{ NULL }};
+    mysqla_task_t *ptr_lastPending[MYSQLA_ROUTES][MYSQLA_PRIORITY_CLASSES] = {{ NULL }};
+    int credits[MYSQLA_ROUTES][MYSQLA_PRIORITY_CLASSES] = {{ 0 }};
+    
+    // Set when a lane let its next task go after that task's route was already handed out, so there's work without a wakeup
+    bool redispatch = false;
+    
+    // When the next ping of an idle connection is due, 0 if none is
+    long long pingDueUs = 0;
+    
+    // Infinite loop, because this threaded function is the background handler
+    while(true)
+    {
+        // Sleep until a task is submitted or a connection becomes idle. No polling, so no idle wakeups: only while pools are
+        // sized dynamically the queue waits are looked at regularly, and an idle connection wakes us up once its ping is due
+        long long wakeUs = 0;
+        if(__atomic_load_n(&mysqla_sizing_enabled, __ATOMIC_RELAXED))
+            wakeUs = mysqla_time_us() + MYSQLA_SIZING_CHECK_MS * 1000LL;
+        if(pingDueUs != 0 && (wakeUs == 0 || pingDueUs < wakeUs))
+            wakeUs = pingDueUs;
+        
+        pthread_mutex_lock(&mysqla_lock);
+        
+        if(wakeUs != 0)
+        {
+            long long waitUs = wakeUs - mysqla_time_us();
+            if(waitUs < 0)
+                waitUs = 0;
+            
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += waitUs / 1000000;
+            until.tv_nsec += (waitUs % 1000000) * 1000;
+            until.tv_sec += until.tv_nsec / 1000000000L;
+            until.tv_nsec %= 1000000000L;
+            
+            while(!mysqla_dispatch_pending && !redispatch && pthread_cond_timedwait(&mysqla_dispatch_cond, &mysqla_lock, &until) == 0)
+                ;
+        }
+        else
+        {
+            while(!mysqla_dispatch_pending && !redispatch)
+                pthread_cond_wait(&mysqla_dispatch_cond, &mysqla_lock);
+        }
+        
+        mysqla_dispatch_pending = false;
+        redispatch = false;
+        
+        pthread_mutex_unlock(&mysqla_lock);
+        
+        // Reads only wait for a replica while one can take them. With the replicas down (or all of them reconnecting),
+        // the primary answers the reads instead of them failing or waiting
+        bool haveReplicas = (__atomic_load_n(&mysqla_replica_connections, __ATOMIC_ACQUIRE) > 0 && !mysqla_route_down(MYSQLA_ROUTE_REPLICA));
+        if(!haveReplicas)
+        {
+            for(int i = 0; i < MYSQLA_PRIORITY_CLASSES; i++)
+            {
+                if(ptr_firstPending[MYSQLA_ROUTE_REPLICA][i] == NULL)
+                    continue;
+                
+                if(ptr_lastPending[MYSQLA_ROUTE_PRIMARY][i] == NULL)
+                    ptr_firstPending[MYSQLA_ROUTE_PRIMARY][i] = ptr_firstPending[MYSQLA_ROUTE_REPLICA][i];
+                else
+                    ptr_lastPending[MYSQLA_ROUTE_PRIMARY][i]->pending = ptr_firstPending[MYSQLA_ROUTE_REPLICA][i];
+                
+                ptr_lastPending[MYSQLA_ROUTE_PRIMARY][i] = ptr_lastPending[MYSQLA_ROUTE_REPLICA][i];
+                ptr_firstPending[MYSQLA_ROUTE_REPLICA][i] = NULL;
+                ptr_lastPending[MYSQLA_ROUTE_REPLICA][i] = NULL;
+            }
+        }
+        
+        // A connection that went idle finished its lane's task, so the lane's next task may go now
+        for(ptr_conn = __atomic_load_n(&first_async_connection, __ATOMIC_ACQUIRE); ptr_conn != NULL; ptr_conn = ptr_conn->next)
+        {
+            if(ptr_conn->lane != NULL && __atomic_load_n(&ptr_conn->task, __ATOMIC_ACQUIRE) == NULL)
+            {
+                mysqla_advance_lane(ptr_conn->lane, ptr_firstPending, ptr_lastPending, haveReplicas);
+                ptr_conn->lane = NULL;
+            }
+        }
+        
+        // Move all newly submitted tasks to the end of the pending list of their route and priority class,
+        // unless an earlier task of their lane is still pending or running
+        mysqla_qnode_t *ptr_node;
+        while((ptr_node = mysqla_queue_pop(&mysqla_submit_queue)) != NULL)
+        {
+            mysqla_task_t *ptr_task = (mysqla_task_t *)ptr_node;
+            if(ptr_task->lane == 0 || mysqla_enter_lane(ptr_task))
+                mysqla_add_pending(ptr_firstPending, ptr_lastPending, ptr_task, haveReplicas);
+        }
+        
+        for(int route = 0; route < MYSQLA_ROUTES; route++)
+        {
+            // The server can't be reached, so fail the reads right away instead of letting them wait for a connection,
+            // and spool the writes. Streams (which end through their own chunks) and prepared statements wait for the server to come back
+            if(mysqla_route_down(route))
+            {
+                for(int i = 0; i < MYSQLA_PRIORITY_CLASSES; i++)
+                {
+                    mysqla_task_t *ptr_task = ptr_firstPending[route][i];
+                    ptr_firstPending[route][i] = NULL;
+                    ptr_lastPending[route][i] = NULL;
+                    
+                    while(ptr_task != NULL)
+                    {
+                        mysqla_task_t *ptr_next = ptr_task->pending;
+                        mysqla_lane_t *ptr_lane = (ptr_task->lane != 0 ? mysqla_find_lane(ptr_task->lane) : NULL);
+                        
+                        bool completed;
+                        if(ptr_task->streamChunkRows == 0 && mysqla_task_is_read(ptr_task))
+                        {
+                            mysqla_fail_task(ptr_task);
+                            completed = true;
+                        }
+                        else
+                        {
+                            completed = mysqla_spool_waiting_task(ptr_task);
+                        }
+                        
+                        if(!completed)
+                        {
+                            ptr_task->pending = NULL;
+                            if(ptr_lastPending[route][i] == NULL)
+                                ptr_firstPending[route][i] = ptr_task;
+                            else
+                                ptr_lastPending[route][i]->pending = ptr_task;
+                            
+                            ptr_lastPending[route][i] = ptr_task;
+                        }
+                        else if(ptr_lane != NULL)
+                        {
+                            mysqla_advance_lane(ptr_lane, ptr_firstPending, ptr_lastPending, haveReplicas);
+                            redispatch = true;
+                        }
+                        
+                        ptr_task = ptr_next;
+                    }
+                }
+                
+                continue;
+            }
+            
+            // Connections only become idle behind our back, never busy, so this is a lower bound
+            int idle = 0;
+            int total = 0;
+            for(ptr_conn = __atomic_load_n(&first_async_connection, __ATOMIC_ACQUIRE); ptr_conn != NULL; ptr_conn = ptr_conn->next)
+            {
+                if(ptr_conn->pool->replica != (route == MYSQLA_ROUTE_REPLICA) || __atomic_load_n(&ptr_conn->task, __ATOMIC_ACQUIRE) == MYSQLA_CONNECTION_CLOSED)
+                    continue;
+                
+                total++;
+                if(__atomic_load_n(&ptr_conn->task, __ATOMIC_ACQUIRE) == NULL)
+                    idle++;
+            }
+            
+            // At least one connection has to be left for the other classes
+            int reserved = __atomic_load_n(&mysqla_reserved_connections, __ATOMIC_RELAXED);
+            if(reserved > total - 1)
+                reserved = total - 1;
+            
+            // Hand the pending tasks to idle connections
+            while(idle > 0)
+            {
+                int priority = mysqla_pick_priority(ptr_firstPending[route], credits[route], idle > reserved);
+                if(priority < 0)
+                    break;
+                
+                // Looked through all connections of the route and none is available
+                ptr_conn = mysqla_find_idle_connection(route);
+                if(ptr_conn == NULL)
+                    break;
+                
+                mysqla_task_t *ptr_task = ptr_firstPending[route][priority];
+                ptr_firstPending[route][priority] = ptr_task->pending;
+                if(ptr_firstPending[route][priority] == NULL)
+                    ptr_lastPending[route][priority] = NULL;
+                
+                mysqla_lane_t *ptr_lane = (ptr_task->lane != 0 ? mysqla_find_lane(ptr_task->lane) : NULL);
+                
+                // Cancelled while waiting (its player disconnected or it was shed), so give it back without using the connection
+                int state = MYSQLA_STATE_WAITING;
+                bool dropped = !__atomic_compare_exchange_n(&ptr_task->state, &state, MYSQLA_STATE_STARTED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+                if(dropped)
+                {
+                    __atomic_sub_fetch(&mysqla_priority_stats[priority].queued, 1, __ATOMIC_RELAXED);
+                }
+                else if(ptr_task->deadlineUs != 0 && mysqla_time_us() >= ptr_task->deadlineUs)
+                {
+                    // Timed out while waiting, no point in starting it anymore
+                    mysqla_count_started(ptr_task);
+                    mysqla_metric_inc(&mysqla_metrics.timedOut);
+                    ptr_task->timedOut = true;
+                    mysqla_leave_queue(ptr_task);
+                    dropped = true;
+                }
+                
+                if(dropped)
+                {
+                    // The lane's next task doesn't have to wait for this one. Its route may have been handed out already
+                    if(ptr_lane != NULL)
+                    {
+                        mysqla_advance_lane(ptr_lane, ptr_firstPending, ptr_lastPending, haveReplicas);
+                        redispatch = true;
+                    }
+                    
+                    // A stream is still linked in the game thread's list of streams, which releases it once its end chunk
+                    // arrives. So it ends through its own chunks, failed like a stream killed by its deadline while running
+                    if(ptr_task->streamChunkRows > 0)
+                    {
+                        while(!mysqla_push_chunk(ptr_task, NULL, -1))
+                            usleep(1000);
+                    }
+                    else
+                    {
+                        mysqla_queue_push(&mysqla_done_queue, &ptr_task->node);
+                    }
+                    
+                    continue;
+                }
+                
+                idle--;
+                mysqla_count_started(ptr_task);
+                __atomic_add_fetch(&ptr_conn->pool->outstanding, 1, __ATOMIC_RELAXED);
+                
+                // The connection went idle during this pass, so its previous lane wasn't advanced yet
+                if(ptr_conn->lane != NULL)
+                {
+                    mysqla_advance_lane(ptr_conn->lane, ptr_firstPending, ptr_lastPending, haveReplicas);
+                    redispatch = true;
+                }
+                
+                ptr_conn->lane = ptr_lane;
+                
+                // Wake up the connection's worker thread, it executes the query asynchronously
+                pthread_mutex_lock(&ptr_conn->lock);
+                ptr_conn->task = ptr_task;
+                pthread_cond_signal(&ptr_conn->taskAssigned);
+                pthread_mutex_unlock(&ptr_conn->lock);
+            }
+        }
+        
+        if(__atomic_load_n(&mysqla_sizing_enabled, __ATOMIC_RELAXED))
+            mysqla_resize_pools(ptr_firstPending);
+        
+        pingDueUs = mysqla_check_connections();
+    }
+    
+    return NULL;
+}
+
+/*
+ * Create a new task for a query. It isn't executed until it's handed to mysqla_submit_task().
+ * Returns NULL if the task couldn't be created.
+ */
+static mysqla_task_t *mysqla_create_task(const char *sql, gentity_t *entity, int saveResult)
+{
+    mysqla_task_t *ptr_taskNew = mysqla_alloc_task(sql);
+    if(ptr_taskNew == NULL)
+    {
+        printf("ERROR: mysqla_create_task() out of memory for query \"%s\"\n", sql);
+        return NULL;
+    }
+    
+    ptr_taskNew->rows = NULL;
+    ptr_taskNew->save = (saveResult > 0);
+    ptr_taskNew->scalar = (saveResult == MYSQLA_SAVE_SCALAR);
+    ptr_taskNew->entity = entity;
+    ptr_taskNew->entityDisconnected = false;
+    ptr_taskNew->read = mysqla_query_is_read(sql);
+    ptr_taskNew->timeoutMs = mysqla_default_timeout_ms;
+    
+    return ptr_taskNew;
+}
+
+/*
+ * Whether a task of the specified size would exceed the queue limits
+ */
+static bool mysqla_queue_full(int bytes)
+{
+    if(mysqla_max_queued_tasks > 0 && __atomic_load_n(&mysqla_queued_tasks, __ATOMIC_SEQ_CST) + 1 > mysqla_max_queued_tasks)
+        return true;
+    
+    if(mysqla_max_queued_bytes > 0 && __atomic_load_n(&mysqla_queued_bytes, __ATOMIC_SEQ_CST) + bytes > mysqla_max_queued_bytes)
+        return true;
+    
+    return false;
+}
+
+/*
+ * Cancel the oldest bulk task that is still waiting, its callback gets undefined.
+ * INSERTs that may be merged and streams are left alone. Returns false if there is no such task.
+ */
+static bool mysqla_shed_oldest(void)
+{
+    for(mysqla_task_t *ptr_task = first_async_task; ptr_task != NULL; ptr_task = ptr_task->next)
+    {
+        if(ptr_task->priority != MYSQLA_PRIORITY_BULK || ptr_task->persist || ptr_task->valuesOffset > 0 || ptr_task->streamChunkRows > 0 || ptr_task->followers != NULL)
+            continue;
+        
+        if(mysqla_cancel_task(ptr_task))
+        {
+            mysqla_metric_inc(&mysqla_metrics.dropped);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/*
+ * Count a new task against the queue limits, applying the queue policy if a limit is reached.
+ * Returns false if the task has to be rejected.
+ */
+static bool mysqla_admit_task(mysqla_task_t *ptr_task)
+{
+    int bytes = ptr_task->queryLen + 1 + ptr_task->paramBytes;
+    
+    if(mysqla_queue_policy == MYSQLA_POLICY_DROP_OLDEST)
+    {
+        while(mysqla_queue_full(bytes) && mysqla_shed_oldest())
+            ;
+    }
+    else if(mysqla_queue_policy == MYSQLA_POLICY_BLOCK && mysqla_queue_full(bytes))
+    {
+        // The workers finish tasks without the game thread's help, so waiting here can't deadlock.
+        // The flag and the counters are sequentially consistent, so a worker can't miss that we're waiting
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += mysqla_block_timeout_ms / 1000;
+        deadline.tv_nsec += (mysqla_block_timeout_ms % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        
+        pthread_mutex_lock(&mysqla_admission_lock);
+        __atomic_store_n(&mysqla_admission_waiting, true, __ATOMIC_SEQ_CST);
+        
+        while(mysqla_queue_full(bytes))
+        {
+            if(pthread_cond_timedwait(&mysqla_admission_cond, &mysqla_admission_lock, &deadline) != 0)
+                break;
+        }
+        
+        __atomic_store_n(&mysqla_admission_waiting, false, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&mysqla_admission_lock);
+    }
+    
+    if(mysqla_queue_full(bytes))
+    {
+        mysqla_metric_inc(&mysqla_metrics.rejected);
+        return false;
+    }
+    
+    ptr_task->queuedBytes = bytes;
+    int queued = __atomic_add_fetch(&mysqla_queued_tasks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mysqla_queued_bytes, bytes, __ATOMIC_RELAXED);
+    
+    mysqla_histogram_add(&mysqla_metrics.queueDepth, queued);
+    if(queued > mysqla_metrics.peakQueued)
+        __atomic_store_n(&mysqla_metrics.peakQueued, queued, __ATOMIC_RELAXED);
+    
+    return true;
+}
+
+/*
+ * While the spool holds writes, new writes are appended to it as well instead of being executed.
+ * That keeps them in order and saves them from failing one by one while the database is unreachable.
+ * Returns true if the task was spooled.
+ */
+static bool mysqla_spool_task(mysqla_task_t *ptr_task)
+{
+    if(!__atomic_load_n(&mysqla_spool_pending, __ATOMIC_ACQUIRE) || ptr_task->stmtId != 0 || ptr_task->streamChunkRows > 0)
+        return false;
+    
+    if(mysqla_query_is_read(ptr_task->query))
+        return false;
+    
+    return mysqla_spool_append(ptr_task->query, ptr_task->queryLen);
+}
+
+/*
+ * Assign an ID to a created task and hand it to the dispatcher
+ * Returns the ID of the task, or 0 if the queue is full (the task is freed then).
+ */
+static int mysqla_submit_task(mysqla_task_t *ptr_taskNew)
+{
+    bool spooled = false;
+    mysqla_task_t *ptr_leader = NULL;
+    
+    // Cache hits, reads joining an identical read and spooled writes don't need the database now,
+    // so they don't count against the queue limits
+    if(ptr_taskNew->rows != NULL)
+    {
+        ptr_taskNew->state = MYSQLA_STATE_STARTED;
+    }
+    else if((ptr_leader = mysqla_find_flight(ptr_taskNew)) != NULL)
+    {
+        ptr_taskNew->state = MYSQLA_STATE_STARTED;
+    }
+    else if(mysqla_spool_task(ptr_taskNew))
+    {
+        ptr_taskNew->state = MYSQLA_STATE_STARTED;
+        spooled = true;
+    }
+    else if(!mysqla_admit_task(ptr_taskNew))
+    {
+        if(ptr_taskNew->streamChunkRows > 0)
+            sem_destroy(&ptr_taskNew->streamSlots);
+        
+        mysqla_free_task(ptr_taskNew);
+        return 0;
+    }
+    
+    // Each query has their own ID. It doesn't really matter if this overflows (it's a 32-bit integer)
+    // This ID should not be randomized, as it increases the chances of a duplicate ID
+    static int queryId = 0;
+    
+    queryId++;
+    
+    // Append the task to the end of the list
+    mysqla_task_t *ptr_prevTask = last_async_task;
+    
+    ptr_taskNew->taskId = queryId;
+    ptr_taskNew->prev = ptr_prevTask;
+    ptr_taskNew->next = NULL;
+    
+    // If we've just set up the first task, reflect that into our global pointer
+    if(ptr_prevTask == NULL)
+    {
+        first_async_task = ptr_taskNew;
+    }
+    else
+    {
+        ptr_taskNew->prev->next = ptr_taskNew;
+    }
+    
+    last_async_task = ptr_taskNew;
+    
+    // Index the task by its entity, so a disconnect only has to look at that entity's tasks
+    int num = mysqla_entity_index(ptr_taskNew->entity);
+    if(num >= 0)
+    {
+        ptr_taskNew->prevOfEntity = NULL;
+        ptr_taskNew->nextOfEntity = mysqla_entity_tasks[num];
+        if(ptr_taskNew->nextOfEntity != NULL)
+            ptr_taskNew->nextOfEntity->prevOfEntity = ptr_taskNew;
+        
+        mysqla_entity_tasks[num] = ptr_taskNew;
+    }
+    
+    // Cache hits already have their rows, they complete on the next frame without touching a connection
+    if(ptr_taskNew->rows != NULL)
+    {
+        mysqla_queue_push(&mysqla_done_queue, &ptr_taskNew->node);
+        return queryId;
+    }
+    
+    // The read it joined hands over its rows when it finishes, see mysqla_land_flight()
+    if(ptr_leader != NULL)
+    {
+        ptr_taskNew->cacheTtl = 0;
+        ptr_taskNew->nextFollower = NULL;
+        
+        mysqla_task_t **ptr_link = &ptr_leader->followers;
+        while(*ptr_link != NULL)
+            ptr_link = &(*ptr_link)->nextFollower;
+        
+        *ptr_link = ptr_taskNew;
+        mysqla_metric_inc(&mysqla_metrics.deduplicated);
+        return queryId;
+    }
+    
+    if((mysqla_cache_max_bytes > 0 || mysqla_flight_count > 0) && !mysqla_query_is_read(ptr_taskNew->query))
+        mysqla_cache_invalidate(ptr_taskNew->query);
+    
+    // A player has to see their own writes, which a lagging replica may not have yet
+    if(num >= 0)
+    {
+        if(!ptr_taskNew->read)
+            mysqla_entity_write_ms[num] = mysqla_time_ms();
+        else if(mysqla_time_ms() - mysqla_entity_write_ms[num] < mysqla_read_your_writes_ms)
+            ptr_taskNew->read = false;
+    }
+    
+    // The replayer executes spooled writes, so they complete on the next frame (without a result)
+    if(spooled)
+    {
+        mysqla_queue_push(&mysqla_done_queue, &ptr_taskNew->node);
+        return queryId;
+    }
+    
+    // Plain INSERTs may be held back to be merged with others at the end of the frame
+    if(mysqla_coalesce_max_rows > 1 && ptr_taskNew->stmtId == 0 && ptr_taskNew->groupSize == 0 && !ptr_taskNew->save && ptr_taskNew->lane == 0)
+    {
+        ptr_taskNew->valuesOffset = mysqla_get_values_offset(ptr_taskNew->query);
+        if(ptr_taskNew->valuesOffset > 0 && mysqla_coalesce_task(ptr_taskNew))
+            return queryId;
+    }
+    
+    // Identical reads submitted while this one is in flight share its result
+    if(mysqla_may_share_flight(ptr_taskNew))
+        mysqla_enter_flight(ptr_taskNew);
+    
+    mysqla_dispatch_task(ptr_taskNew);
+    
+    return queryId;
+}
+
+/*
+ * Hand a submitted task to the dispatcher
+ */
+static void mysqla_dispatch_task(mysqla_task_t *ptr_task)
+{
+    ptr_task->queuedAt = mysqla_time_us();
+    if(ptr_task->timeoutMs > 0)
+    {
+        ptr_task->deadlineUs = ptr_task->queuedAt + ptr_task->timeoutMs * 1000LL;
+        
+        // The watchdog is only needed once deadlines are used
+        if(!mysqla_watchdog_started)
+        {
+            pthread_t watchdog;
+            if(pthread_create(&watchdog, NULL, mysqla_deadline_watchdog, NULL) == 0)
+            {
+                pthread_detach(watchdog);
+                mysqla_watchdog_started = true;
+            }
+            else
+            {
+                printf("ERROR: mysqla_dispatch_task() error creating deadline watchdog thread, queries won't be killed\n");
+            }
+        }
+    }
+    
+    mysqla_queue_push(&mysqla_submit_queue, &ptr_task->node);
+    mysqla_wake_dispatcher();
+}
+
+/*
+ * Initialize a MySQL query (i.e. create a new task for it). A negative timeoutMs uses the default deadline.
+ * A positive lane runs the task after the earlier tasks with the same lane, as does MYSQLA_FLAG_ORDERED for the entity's tasks.
+ * Returns the ID of the new task, or 0 if it couldn't be created.
+ */
+static int mysqla_query_initializer(const char *sql, gentity_t *entity, int saveResult, int priority, int flags, int timeoutMs, int lane)
+{
+    mysqla_task_t *ptr_taskNew = mysqla_create_task(sql, entity, saveResult);
+    if(ptr_taskNew == NULL)
+        return 0;
+    
+    ptr_taskNew->priority = priority;
+    if(timeoutMs >= 0)
+        ptr_taskNew->timeoutMs = timeoutMs;
+    ptr_taskNew->persist = (flags & MYSQLA_FLAG_PERSIST) != 0;
+    ptr_taskNew->idempotent = (flags & MYSQLA_FLAG_IDEMPOTENT) != 0;
+    if(flags & MYSQLA_FLAG_READ)
+        ptr_taskNew->read = true;
+    if(flags & MYSQLA_FLAG_PRIMARY)
+        ptr_taskNew->read = false;
+    
+    // Entity lanes get negative keys, so they never collide with the caller's keys
+    if(lane > 0)
+        ptr_taskNew->lane = lane;
+    else if((flags & MYSQLA_FLAG_ORDERED) && mysqla_entity_index(entity) >= 0)
+        ptr_taskNew->lane = -(mysqla_entity_index(entity) + 1);
+    
+    return mysqla_submit_task(ptr_taskNew);
+}
+
+/*
+ * Initialize a read query whose result may be served from, and is stored in, the result cache.
+ * Returns the ID of the new task, or 0 if it couldn't be created.
+ */
+static int mysqla_cached_query_initializer(const char *sql, gentity_t *entity, int ttl, int saveResult, int priority)
+{
+    // Caching a result nobody wants makes no sense
+    if(saveResult == 0)
+        saveResult = 1;
+    
+    mysqla_task_t *ptr_taskNew = mysqla_create_task(sql, entity, saveResult);
+    if(ptr_taskNew == NULL)
+        return 0;
+    
+    ptr_taskNew->priority = priority;
+    
+    if(mysqla_cache_max_bytes > 0 && ttl > 0 && mysqla_query_is_read(sql))
+    {
+        ptr_taskNew->rows = mysqla_cache_lookup(sql);
+        if(ptr_taskNew->rows == NULL)
+        {
+            ptr_taskNew->cacheTtl = ttl;
+            mysqla_metric_inc(&mysqla_metrics.cacheMisses);
+        }
+        else
+        {
+            mysqla_metric_inc(&mysqla_metrics.cacheHits);
+        }
+    }
+    
+    return mysqla_submit_task(ptr_taskNew);
+}
+
+/*
+ * Create a task executing the query strings passed from GSC (starting at firstParam) as one transaction.
+ * Returns the ID of the new task, or 0 if it couldn't be created.
+ */
+static int mysqla_group_initializer(gentity_t *entity, int saveResult, int firstParam)
+{
+    static const char begin[] = "START TRANSACTION;";
+    static const char commit[] = "COMMIT";
+    
+    int groupSize = stackGetNumberOfParams() - firstParam;
+    if(groupSize <= 0)
+    {
+        stackError("ERROR: mysqla_create_group_query() needs at least one query");
+        return 0;
+    }
+    
+    // Join the statements, without their own trailing semicolons
+    int len = sizeof(begin) - 1 + sizeof(commit) - 1;
+    for(int i = 0; i < groupSize; i++)
+    {
+        char *query;
+        stackGetParamString(firstParam + i, &query);
+        len += strlen(query) + 1;
+    }
+    
+    char *ptr_joined = (char *)malloc(len + 1);
+    if(ptr_joined == NULL)
+    {
+        printf("ERROR: mysqla_group_initializer() out of memory\n");
+        return 0;
+    }
+    
+    memcpy(ptr_joined, begin, sizeof(begin) - 1);
+    int pos = sizeof(begin) - 1;
+    for(int i = 0; i < groupSize; i++)
+    {
+        char *query;
+        stackGetParamString(firstParam + i, &query);
+        
+        int queryLen = strlen(query);
+        while(queryLen > 0 && strchr(" \t\n\r;", query[queryLen - 1]) != NULL)
+            queryLen--;
+        
+        memcpy(ptr_joined + pos, query, queryLen);
+        pos += queryLen;
+        ptr_joined[pos++] = ';';
+    }
+    
+    memcpy(ptr_joined + pos, commit, sizeof(commit));
+    
+    mysqla_task_t *ptr_taskNew = mysqla_create_task(ptr_joined, entity, saveResult);
+    free(ptr_joined);
+    
+    if(ptr_taskNew == NULL)
+        return 0;
+    
+    ptr_taskNew->groupSize = groupSize;
+    
+    return mysqla_submit_task(ptr_taskNew);
+}
+
+/*
+ * Create a task for a query whose rows are passed to a GSC callback in chunks of chunkRows rows.
+ * Returns the ID of the new task, or 0 if it couldn't be created.
+ */
+static int mysqla_stream_initializer(const char *sql, gentity_t *entity, int chunkRows, int callback)
+{
+    mysqla_task_t *ptr_taskNew = mysqla_create_task(sql, entity, 1);
+    if(ptr_taskNew == NULL)
+        return 0;
+    
+    if(sem_init(&ptr_taskNew->streamSlots, 0, MYSQLA_STREAM_WINDOW) != 0)
+    {
+        printf("ERROR: mysqla_stream_initializer() semaphore initialization failed\n");
+        mysqla_free_task(ptr_taskNew);
+        return 0;
+    }
+    
+    ptr_taskNew->streamChunkRows = chunkRows;
+    ptr_taskNew->streamCallback = callback;
+    mysqla_queue_init(&ptr_taskNew->streamChunks);
+    
+    int id = mysqla_submit_task(ptr_taskNew);
+    if(id == 0)
+        return 0;
+    
+    ptr_taskNew->nextStream = mysqla_streams;
+    mysqla_streams = ptr_taskNew;
+    
+    return id;
+}
+
+/*
+ * Create a task executing a prepared statement with the parameters passed from GSC, starting at firstParam.
+ * Returns the ID of the new task, or 0 if it couldn't be created.
+ */
+static int mysqla_statement_initializer(int stmtId, gentity_t *entity, int saveResult, int firstParam)
+{
+    if(stmtId <= 0 || stmtId > mysqla_statement_count)
+    {
+        stackError("ERROR: mysqla_execute_statement() invalid statement handle");
+        return 0;
+    }
+    
+    mysqla_statement_t *ptr_statement = &mysqla_statements[stmtId - 1];
+    
+    int numParams = stackGetNumberOfParams() - firstParam;
+    if(numParams != ptr_statement->numParams)
+    {
+        stackError("ERROR: mysqla_execute_statement() parameter count doesn't match the statement");
+        return 0;
+    }
+    
+    // Store the parameters and their string values in one block
+    int paramBytes = sizeof(mysqla_param_t) * numParams;
+    for(int i = 0; i < numParams; i++)
+    {
+        if(stackGetParamType(firstParam + i) == STACK_STRING)
+        {
+            char *str;
+            stackGetParamString(firstParam + i, &str);
+            paramBytes += strlen(str) + 1;
+        }
+    }
+    
+    mysqla_task_t *ptr_taskNew = mysqla_create_task(ptr_statement->query, entity, saveResult);
+    if(ptr_taskNew == NULL)
+        return 0;
+    
+    if(numParams > 0)
+    {
+        ptr_taskNew->params = (mysqla_param_t *)mysqla_alloc_block(paramBytes);
+        if(ptr_taskNew->params == NULL)
+        {
+            printf("ERROR: mysqla_statement_initializer() out of memory for statement \"%s\"\n", ptr_statement->query);
+            mysqla_free_task(ptr_taskNew);
+            return 0;
+        }
+    }
+    
+    ptr_taskNew->stmtId = stmtId;
+    ptr_taskNew->numParams = numParams;
+    ptr_taskNew->paramBytes = paramBytes;
+    
+    char *ptr_strings = (char *)(ptr_taskNew->params + numParams);
+    for(int i = 0; i < numParams; i++)
+    {
+        mysqla_param_t *ptr_param = &ptr_taskNew->params[i];
+        ptr_param->type = stackGetParamType(firstParam + i);
+        ptr_param->strVal = NULL;
+        ptr_param->strLen = 0;
+        
+        switch(ptr_param->type)
+        {
+            case STACK_INT:
+                stackGetParamInt(firstParam + i, &ptr_param->intVal);
+                break;
+            case STACK_FLOAT:
+                stackGetParamFloat(firstParam + i, &ptr_param->floatVal);
+                break;
+            case STACK_STRING:
+            {
+                char *str;
+                stackGetParamString(firstParam + i, &str);
+                
+                ptr_param->strLen = strlen(str);
+                ptr_param->strVal = ptr_strings;
+                memcpy(ptr_strings, str, ptr_param->strLen + 1);
+                ptr_strings += ptr_param->strLen + 1;
+                break;
+            }
+            default: // Anything else (e.g. undefined) is passed as NULL
+                ptr_param->type = STACK_UNDEFINED;
+                break;
+        }
+    }
+    
+    return mysqla_submit_task(ptr_taskNew);
+}
+
+/*
+ * Get the priority class passed from GSC at the specified parameter, MYSQLA_PRIORITY_NORMAL if none was passed
+ */
+static int mysqla_get_priority_param(int param)
+{
+    int priority = MYSQLA_PRIORITY_NORMAL;
+    if(param >= (int)stackGetNumberOfParams())
+        return priority;
+    
+    stackGetParamInt(param, &priority);
+    if(priority < 0 || priority >= MYSQLA_PRIORITY_CLASSES)
+    {
+        stackError("ERROR: invalid priority class, expected 0 (interactive), 1 (normal) or 2 (bulk)");
+        return MYSQLA_PRIORITY_NORMAL;
+    }
+    
+    return priority;
+}
+
+/*
+ * Create a pool for the connections to one database server
+ */
+static mysqla_pool_t *mysqla_create_pool(const char *name, bool replica, const char *host, const char *user, const char *pass, const char *db, int port)
+{
+    mysqla_pool_t *ptr_pool = new mysqla_pool_t;
+    ptr_pool->name = strdup(name);
+    ptr_pool->replica = replica;
+    ptr_pool->host = strdup(host);
+    ptr_pool->user = strdup(user);
+    ptr_pool->pass = strdup(pass);
+    ptr_pool->db = strdup(db);
+    ptr_pool->port = port;
+    ptr_pool->connectionCount = 0;
+    ptr_pool->readyConnections = 0;
+    ptr_pool->minConnections = 0;
+    ptr_pool->maxConnections = 0;
+    ptr_pool->growWaitMs = 0;
+    ptr_pool->idleTimeoutMs = 0;
+    ptr_pool->opening = 0;
+    ptr_pool->connecting = 0;
+    ptr_pool->killConnection = NULL;
+    ptr_pool->outstanding = 0;
+    ptr_pool->executed = 0;
+    ptr_pool->failures = 0;
+    
+    // Keep the pools in the order they were created. Other threads walk the list, so link the pool once it's complete
+    ptr_pool->next = NULL;
+    mysqla_pool_t **ptr_link = &mysqla_pools;
+    while(*ptr_link != NULL)
+        ptr_link = &(*ptr_link)->next;
+    __atomic_store_n(ptr_link, ptr_pool, __ATOMIC_RELEASE);
+    
+    return ptr_pool;
+}
+
+/*
+ * Start the worker thread of a connection, which connects it to its pool's server in the background.
+ * The connection keeps the MYSQLA_CONNECTION_CLOSED placeholder until it is connected, so the dispatcher leaves it alone.
+ * A connection the pool sizing grew the pool by (grown) counts as connecting until then.
+ * Returns false if the worker thread couldn't be created.
+ */
+static bool mysqla_start_connection(mysqla_connection_t *ptr_conn, bool grown)
+{
+    mysqla_pool_t *ptr_pool = ptr_conn->pool;
+    
+    ptr_conn->task = MYSQLA_CONNECTION_CLOSED;
+    ptr_conn->connection = NULL;
+    ptr_conn->statements = NULL;
+    ptr_conn->statementCount = 0;
+    ptr_conn->closed = false;
+    ptr_conn->idleSinceUs = mysqla_time_us();
+    ptr_conn->deadlineUs = 0;
+    ptr_conn->deadlineHit = false;
+    ptr_conn->grown = grown;
+    
+    // Counted before the worker runs, it may be connected before pthread_create() returns
+    if(grown)
+        __atomic_add_fetch(&ptr_pool->connecting, 1, __ATOMIC_RELAXED);
+    
+    // Start the persistent worker thread of this connection. It waits for tasks until the process ends (or the pool shrinks)
+    if(pthread_create(&ptr_conn->worker, NULL, mysqla_connection_worker, ptr_conn))
+    {
+        if(grown)
+            __atomic_sub_fetch(&ptr_pool->connecting, 1, __ATOMIC_RELAXED);
+        
+        ptr_conn->closed = true;
+        return false;
+    }
+    
+    pthread_detach(ptr_conn->worker);
+    
+    __atomic_add_fetch(&ptr_pool->connectionCount, 1, __ATOMIC_RELAXED);
+    
+    return true;
+}
+
+/*
+ * Make a connection of a pool and start its worker thread. The dispatcher uses it once it is connected.
+ * See mysqla_start_connection() for grown.
+ * Returns NULL if the worker thread couldn't be created.
+ */
+static mysqla_connection_t *mysqla_open_connection(mysqla_pool_t *ptr_pool, bool grown)
+{
+    // Create and initialize the new connection struct
+    mysqla_connection_t *ptr_newConnection = new mysqla_connection_t;
+    ptr_newConnection->next = NULL;
+    ptr_newConnection->pool = ptr_pool;
+    ptr_newConnection->lane = NULL;
+    ptr_newConnection->busyUs = 0;
+    ptr_newConnection->statsBusyUs[MYSQLA_STATS_GSC] = 0;
+    ptr_newConnection->statsBusyUs[MYSQLA_STATS_FILE] = 0;
+    pthread_mutex_init(&ptr_newConnection->lock, NULL);
+    pthread_cond_init(&ptr_newConnection->taskAssigned, NULL);
+    pthread_mutex_init(&ptr_newConnection->deadlineLock, NULL);
+    pthread_cond_init(&ptr_newConnection->killDone, NULL);
+    ptr_newConnection->killing = false;
+    
+    if(!mysqla_start_connection(ptr_newConnection, grown))
+    {
+        delete ptr_newConnection;
+        return NULL;
+    }
+    
+    // Add our newly created connection to the linked list. The dispatcher walks it concurrently, but nodes are only prepended
+    ptr_newConnection->next = first_async_connection;
+    __atomic_store_n(&first_async_connection, ptr_newConnection, __ATOMIC_RELEASE);
+    
+    return ptr_newConnection;
+}
+
+/*
+ * Background thread opening the connections the dispatcher asks for when a dynamically sized pool grows.
+ * Connections closed before are opened again, so the connection list never shrinks (the dispatcher walks it without locking).
+ */
+static void *mysqla_pool_opener(void *unused)
+{
+    while(true)
+    {
+        pthread_mutex_lock(&mysqla_opener_lock);
+        
+        while(!mysqla_opener_pending)
+            pthread_cond_wait(&mysqla_opener_cond, &mysqla_opener_lock);
+        
+        mysqla_opener_pending = false;
+        
+        pthread_mutex_unlock(&mysqla_opener_lock);
+        
+        for(mysqla_pool_t *ptr_pool = __atomic_load_n(&mysqla_pools, __ATOMIC_ACQUIRE); ptr_pool != NULL; ptr_pool = ptr_pool->next)
+        {
+            while(__atomic_load_n(&ptr_pool->opening, __ATOMIC_RELAXED) > 0)
+            {
+                // Reuse a connection closed by the pool sizing if there is one
+                mysqla_connection_t *ptr_conn = __atomic_load_n(&first_async_connection, __ATOMIC_ACQUIRE);
+                while(ptr_conn != NULL && (ptr_conn->pool != ptr_pool || !__atomic_load_n(&ptr_conn->closed, __ATOMIC_ACQUIRE)))
+                    ptr_conn = ptr_conn->next;
+                
+                bool opened;
+                if(ptr_conn != NULL)
+                    opened = mysqla_start_connection(ptr_conn, true);
+                else
+                    opened = (mysqla_open_connection(ptr_pool, true) != NULL);
+                
+                __atomic_sub_fetch(&ptr_pool->opening, 1, __ATOMIC_RELAXED);
+                
+                if(!opened)
+                {
+                    printf("ERROR: mysqla_pool_opener() error creating connection worker thread for pool %s\n", ptr_pool->name);
+                    continue;
+                }
+                
+                mysqla_metric_inc(&mysqla_metrics.poolGrown);
+                printf("mysqla: opening a connection of pool %s, %d open\n", ptr_pool->name, __atomic_load_n(&ptr_pool->connectionCount, __ATOMIC_RELAXED));
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+/************************************************************
+ *              Functions callable from GSC                 *
+ ************************************************************/
+ 
+ /** Start of async MySQL functions **/
+
+/*
+ * Create a new query task on an entity
+ * 
+ * Arguments from GSC:
+ *     char *query      - query string
+ *     int saveResult   - whether or not to store the result, 2 to get a single-row, single-column result as the value itself
+ *     int priority     - 0 (interactive), 1 (normal, default) or 2 (bulk)
+ *     int flags        - 1 (persist) to execute a read even if the player disconnects before it starts,
+ *                        2 (read) to allow a non-SELECT on a replica, 4 (primary) to keep a read on the primary,
+ *                        8 (ordered) to execute it after the player's earlier ordered tasks have finished,
+ *                        16 (idempotent) to spool a write even if the connection was lost while executing it
+ *     int timeoutMs    - deadline from now on, 0 for none (default: see mysqla_set_query_timeout())
+ *     int lane         - tasks with the same (positive) lane are executed one after another, in order (optional)
+ * Returns to GSC:
+ *     int id           - id of the newly created task
+ * Reads that haven't started when the player disconnects are dropped. Writes are always executed.
+ */
+void gsc_mysqla_create_entity_query(int num)
+{
+	printf("hey\n");
+    char *query = NULL;
+    int saveResult = 0; // By default we don't save the result
+    
+    // Obtain the arguments from GSC call
+    printf("hello\n");
+    stackGetParamString(0, &query);
+    printf("world\n");
+    stackGetParamInt(1, &saveResult);
+    printf("foo\n");
+    
+    gentity_t *ptr_gentity = &g_entities[num];
+    printf("bar\n");
+    if(ptr_gentity == NULL) // Make sure the entity is known
+    {
+        printf("WARN: Calling query \"%s\" on non-existing entity\n", query);
+        stackPushUndefined();
+        return;
+    }
+    
+    // Send back the ID of the newly created query task
+    int flags = 0;
+    if(stackGetNumberOfParams() > 3)
+        stackGetParamInt(3, &flags);
+    
+    int timeoutMs = -1;
+    if(stackGetNumberOfParams() > 4)
+        stackGetParamInt(4, &timeoutMs);
+    
+    int lane = 0;
+    if(stackGetNumberOfParams() > 5)
+        stackGetParamInt(5, &lane);
+    
+    int id = mysqla_query_initializer(query, ptr_gentity, saveResult, mysqla_get_priority_param(2), flags, timeoutMs, lane);
+    if(id == 0)
+        stackPushUndefined();
+    else
+        stackPushInt(id);
+}
+
+/*
+ * Create a new query task on the level
+ * 
+ * Arguments from GSC:
+ *     char *query      - query string
+ *     int saveResult   - whether or not to store the result, 2 to get a single-row, single-column result as the value itself
+ *     int priority     - 0 (interactive), 1 (normal, default) or 2 (bulk)
+ *     int flags        - 2 (read) to allow a non-SELECT on a replica, 4 (primary) to keep a read on the primary,
+ *                        16 (idempotent) to spool a write even if the connection was lost while executing it
+ *     int timeoutMs    - deadline from now on, 0 for none (default: see mysqla_set_query_timeout())
+ *     int lane         - tasks with the same (positive) lane are executed one after another, in order (optional)
+ * Returns to GSC:
+ *     int id           - id of the newly created task
+ */
+void gsc_mysqla_create_level_query(void)
+{
+    char *query = NULL;
+    int saveResult = 0; // By default we don't save the result
+    
+    // Obtain the arguments from GSC call
+    stackGetParamString(0, &query);
+    stackGetParamInt(1, &saveResult);
+    
+    int flags = 0;
+    if(stackGetNumberOfParams() > 3)
+        stackGetParamInt(3, &flags);
+    
+    int timeoutMs = -1;
+    if(stackGetNumberOfParams() > 4)
+        stackGetParamInt(4, &timeoutMs);
+    
+    int lane = 0;
+    if(stackGetNumberOfParams() > 5)
+        stackGetParamInt(5, &lane);
+    
+    // Send back the ID of the newly created query task
+    int id = mysqla_query_initializer(query, NULL, saveResult, mysqla_get_priority_param(2), flags, timeoutMs, lane);
+    if(id == 0)
+        stackPushUndefined();
+    else
+        stackPushInt(id);
+}
+
+/*
+ * Create a new query task on an entity whose result is cached. Identical queries within the ttl are answered
+ * from the cache on the next frame. Writes to a table the query mentions drop its cached result.
+ * Only has an effect once the cache is enabled with mysqla_set_result_cache().
+ * 
+ * Arguments from GSC:
+ *     char *query      - query string (a SELECT, SHOW, DESCRIBE or EXPLAIN)
+ *     int ttl          - milliseconds the result may be reused
+ *     int saveResult   - 1 (default) for the rows, 2 to get a single-row, single-column result as the value itself
+ *     int priority     - 0 (interactive), 1 (normal, default) or 2 (bulk)
+ * Returns to GSC:
+ *     int id           - id of the newly created task
+ */
+void gsc_mysqla_create_entity_cached_query(int num)
+{
+    char *query = NULL;
+    int ttl = 0;
+    int saveResult = 1;
+    
+    stackGetParamString(0, &query);
+    stackGetParamInt(1, &ttl);
+    if(stackGetNumberOfParams() > 2)
+        stackGetParamInt(2, &saveResult);
+    
+    int id = mysqla_cached_query_initializer(query, &g_entities[num], ttl, saveResult, mysqla_get_priority_param(3));
+    if(id == 0)
+        stackPushUndefined();
+    else
+        stackPushInt(id);
+}
+
+/*
+ * Create a new query task on the level whose result is cached. See gsc_mysqla_create_entity_cached_query().
+ * 
+ * Arguments from GSC:
+ *     char *query      - query string (a SELECT, SHOW, DESCRIBE or EXPLAIN)
+ *     int ttl          - milliseconds the result may be reused
+ *     int saveResult   - 1 (default) for the rows, 2 to get a single-row, single-column result as the value itself
+ *     int priority     - 0 (interactive), 1 (normal, default) or 2 (bulk)
+ * Returns to GSC:
+ *     int id           - id of the newly created task
+ */
+void gsc_mysqla_create_level_cached_query(void)
+{
+    char *query = NULL;
+    int ttl = 0;
+    int saveResult = 1;
+    
+    stackGetParamString(0, &query);
+    stackGetParamInt(1, &ttl);
+    if(stackGetNumberOfParams() > 2)
+        stackGetParamInt(2, &saveResult);
+    
+    int id = mysqla_cached_query_initializer(query, NULL, ttl, saveResult, mysqla_get_priority_param(3));
+    if(id == 0)
+        stackPushUndefined();
+    else
+        stackPushInt(id);
+}
+
+/*
+ * Create a new task on an entity executing multiple queries back-to-back on one connection, as one transaction
+ * 
+ * Arguments from GSC:
+ *     int saveResult   - whether or not to store the results, 2 to get single-row, single-column results as the value itself
+ *     char *query...   - one or more query strings
+ * Returns to GSC:
+ *     int id           - id of the newly created task
+ * The callback receives an array with the result of each query, or undefined if the transaction was rolled back.
+ */
+void gsc_mysqla_create_entity_group_query(int num)
+{
+    int saveResult = 0;
+    stackGetParamInt(0, &saveResult);
+    
+    int id = mysqla_group_initializer(&g_entities[num], saveResult, 1);
+    if(id == 0)
+        stackPushUndefined();
+    else
+        stackPushInt(id);
+}
+
+/*
+ * Create a new task on the level executing multiple queries back-to-back on one connection, as one transaction
+ * 
+ * Arguments from GSC:
+ *     int saveResult   - whether or not to store the results, 2 to get single-row, single-column results as the value itself
+ *     char *query...   - one or more query strings
+ * Returns to GSC:
+ *     int id           - id of the newly created task
+ * The callback receives an array with the result of each query, or undefined if the transaction was rolled back.
+ */
+void gsc_mysqla_create_level_group_query(void)
+{
+    int saveResult = 0;
+    stackGetParamInt(0, &saveResult);
+    
+    int id = mysqla_group_initializer(NULL, saveResult, 1);
+    if(id == 0)
+        stackPushUndefined();
+    else
+        stackPushInt(id);
+}
+
+/*
+ * Create a new streaming query task on an entity. The rows are fetched incrementally and passed to the
+ * callback in chunks, at most one chunk per frame, followed by a final call when the stream has ended.
+ * 
+ * Arguments from GSC:
+ *     char *query      - query string
+ *     int chunkRows    - maximum amount of rows per chunk
+ *     function callback - called as callback(id, rows, status), status is 0 for a chunk of rows,
+ *                         1 for the end of the stream and -1 if the stream failed or timed out
+ * Returns to GSC:
+ *     int id           - id of the newly created task
+ */
+void gsc_mysqla_create_entity_stream_query(int num)
+{
+    char *query = NULL;
+    int chunkRows = 0;
+    int callback = -1;
+    
+    stackGetParamString(0, &query);
+    stackGetParamInt(1, &chunkRows);
+    stackGetParamFunction(2, &callback);
+    
+    if(chunkRows <= 0 || callback == -1)
+    {
+        stackError("ERROR: mysqla_create_stream_query() needs a positive chunk size and a callback");
+        stackPushUndefined();
+        return;
+    }
+    
+    int id = mysqla_stream_initializer(query, &g_entities[num], chunkRows, callback);
+    if(id == 0)
+        stackPushUndefined();
+    else
+        stackPushInt(id);
+}
+
+/*
+ * Create a new streaming query task on the level. The rows are fetched incrementally and passed to the
+ * callback in chunks, at most one chunk per frame, followed by a final call when the stream has ended.
+ * 
+ * Arguments from GSC:
+ *     char *query      - query string
+ *     int chunkRows    - maximum amount of rows per chunk
+ *     function callback - called as callback(id, rows, status), status is 0 for a chunk of rows,
+ *                         1 for the end of the stream and -1 if the stream failed or timed out
+ * Returns to GSC:
+ *     int id           - id of the newly created task
+ */
+void gsc_mysqla_create_level_stream_query(void)
+{
+    char *query = NULL;
+    int chunkRows = 0;
+    int callback = -1;
+    
+    stackGetParamString(0, &query);
+    stackGetParamInt(1, &chunkRows);
+    stackGetParamFunction(2, &callback);
+    
+    if(chunkRows <= 0 || callback == -1)
+    {
+        stackError("ERROR: mysqla_create_stream_query() needs a positive chunk size and a callback");
+        stackPushUndefined();
+        return;
+    }
+    
+    int id = mysqla_stream_initializer(query, NULL, chunkRows, callback);
+    if(id == 0)
+        stackPushUndefined();
+    else
+        stackPushInt(id);
+}
+
+/*
+ * Register a prepared statement. Each connection prepares it once, the first time it executes it.
+ * Registering the same statement text again returns the existing handle.
+ * 
+ * Arguments from GSC:
+ *     char *query      - statement string with a ? placeholder for each parameter
+ * Returns to GSC:
+ *     int handle       - handle to pass to mysqla_execute_statement
+ */
+void gsc_mysqla_prepare(void)
+{
+    char *query = NULL;
+    stackGetParamString(0, &query);
+    
+    if(query == NULL)
+    {
+        stackPushUndefined();
+        return;
+    }
+    
+    for(int i = 0; i < mysqla_statement_count; i++)
+    {
+        if(strcmp(mysqla_statements[i].query, query) == 0)
+        {
+            stackPushInt(i + 1);
+            return;
+        }
+    }
+    
+    int numParams = mysqla_count_placeholders(query);
+    if(numParams > MYSQLA_MAX_STATEMENT_PARAMS)
+    {
+        stackError("ERROR: gsc_mysqla_prepare() statement has too many parameters");
+        stackPushUndefined();
+        return;
+    }
+    
+    mysqla_statement_t *ptr_statements = (mysqla_statement_t *)realloc(mysqla_statements, sizeof(mysqla_statement_t) * (mysqla_statement_count + 1));
+    char *ptr_query = strdup(query);
+    if(ptr_statements == NULL || ptr_query == NULL)
+    {
+        printf("ERROR: gsc_mysqla_prepare() out of memory for statement \"%s\"\n", query);
+        if(ptr_statements != NULL)
+            mysqla_statements = ptr_statements;
+        free(ptr_query);
+        stackPushUndefined();
+        return;
+    }
+    
+    mysqla_statements = ptr_statements;
+    mysqla_statements[mysqla_statement_count].query = ptr_query;
+    mysqla_statements[mysqla_statement_count].numParams = numParams;
+    mysqla_statement_count++;
+    
+    stackPushInt(mysqla_statement_count);
+}
+
+/*
+ * Execute a prepared statement on an entity
+ * 
+ * Arguments from GSC:
+ *     int handle       - handle obtained from mysqla_prepare
+ *     int saveResult   - whether or not to store the result, 2 to get a single-row, single-column result as the value itself
+ *     ...              - a parameter for each placeholder (int, float, string or undefined for NULL)
+ * Returns to GSC:
+ *     int id           - id of the newly created task
+ */
+void gsc_mysqla_execute_entity_statement(int num)
+{
+    int stmtId = 0;
+    int saveResult = 0;
+    
+    stackGetParamInt(0, &stmtId);
+    stackGetParamInt(1, &saveResult);
+    
+    int id = mysqla_statement_initializer(stmtId, &g_entities[num], saveResult, 2);
+    if(id == 0)
+        stackPushUndefined();
+    else
+        stackPushInt(id);
+}
+
+/*
+ * Execute a prepared statement on the level
+ * 
+ * Arguments from GSC:
+ *     int handle       - handle obtained from mysqla_prepare
+ *     int saveResult   - whether or not to store the result, 2 to get a single-row, single-column result as the value itself
+ *     ...              - a parameter for each placeholder (int, float, string or undefined for NULL)
+ * Returns to GSC:
+ *     int id           - id of the newly created task
+ */
+void gsc_mysqla_execute_level_statement(void)
+{
+    int stmtId = 0;
+    int saveResult = 0;
+    
+    stackGetParamInt(0, &stmtId);
+    stackGetParamInt(1, &saveResult);
+    
+    int id = mysqla_statement_initializer(stmtId, NULL, saveResult, 2);
+    if(id == 0)
+        stackPushUndefined();
+    else
+        stackPushInt(id);
+}
+
+/*
+ * Choose how finished tasks are passed to GSC. Starting a script thread per task gets expensive when many tasks
+ * finish in the same frame, so the batched modes call a batch callback with all of them at once:
+ *     callback(results) - results is an array of [id, result, timedOut] entries, in the order the tasks finished.
+ * Per frame, the callback is called on the level and each entry has the entity (or undefined) as a fourth element.
+ * Per entity, it is called on each entity with tasks that finished this frame (and on the level for level tasks).
+ * 
+ * Arguments from GSC:
+ *     int mode         - 0 (per task, default, uses the callback of mysqla_initializer()), 1 (per frame) or 2 (per entity)
+ *     function         - batch callback (required for the batched modes)
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_batch_delivery(void)
+{
+    int mode = MYSQLA_DELIVERY_TASK;
+    stackGetParamInt(0, &mode);
+    
+    if(mode < MYSQLA_DELIVERY_TASK || mode > MYSQLA_DELIVERY_ENTITY)
+    {
+        stackError("ERROR: gsc_mysqla_set_batch_delivery() invalid mode, expected 0 (per task), 1 (per frame) or 2 (per entity)");
+        return;
+    }
+    
+    if(mode != MYSQLA_DELIVERY_TASK)
+    {
+        int callback = -1;
+        if(stackGetNumberOfParams() > 1)
+            stackGetParamFunction(1, &callback);
+        
+        if(callback == -1)
+        {
+            stackError("ERROR: gsc_mysqla_set_batch_delivery() needs a callback for batched delivery");
+            return;
+        }
+        
+        mysqla_batch_callback = callback;
+    }
+    
+    mysqla_delivery_mode = mode;
+}
+
+/*
+ * Enable or disable merging of INSERTs. INSERTs into the same table and columns submitted during the same frame
+ * are then executed as one multi-row INSERT at the end of the frame. Each task still gets its own callback.
+ * 
+ * Arguments from GSC:
+ *     int maxRows      - maximum amount of rows per merged INSERT, 0 or 1 disables merging
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_insert_coalescing(void)
+{
+    int maxRows = 0;
+    stackGetParamInt(0, &maxRows);
+    
+    mysqla_coalesce_max_rows = maxRows;
+}
+
+/*
+ * Enable or disable sharing of identical reads. A read whose query text is identical to a read that is still
+ * queued or running doesn't go to the database, it gets a copy of that read's result instead.
+ * Only plain reads whose result is saved are shared. A write drops the reads in flight that mention its tables,
+ * so reads submitted after it are executed again.
+ * 
+ * Arguments from GSC:
+ *     int enabled      - 1 to share identical reads, 0 (default) to execute each
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_single_flight(void)
+{
+    int enabled = 0;
+    stackGetParamInt(0, &enabled);
+    
+    mysqla_single_flight = (enabled != 0);
+    
+    // Reads in flight keep their followers, but no new ones join
+    if(!mysqla_single_flight)
+    {
+        for(mysqla_task_t *ptr_task = first_async_task; ptr_task != NULL; ptr_task = ptr_task->next)
+            mysqla_leave_flight(ptr_task);
+    }
+}
+
+/*
+ * Limit the tasks that are queued (submitted but not finished by the database yet), so a slow database
+ * can't make the server's memory grow without bounds.
+ * 
+ * Arguments from GSC:
+ *     int maxTasks     - maximum amount of queued tasks, 0 for no limit
+ *     int maxBytes     - maximum amount of query text and parameter bytes of the queued tasks, 0 for no limit
+ *     int policy       - what happens to a new task when a limit is reached:
+ *                        0 (default) rejects it (the create function returns undefined),
+ *                        1 cancels the oldest waiting bulk task (its callback gets undefined) to make room, rejecting if there is none,
+ *                        2 makes the server wait for queued tasks to finish, rejecting after blockTimeout
+ *     int blockTimeout - longest wait in milliseconds of policy 2 (default 50). Note the whole server waits!
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_queue_limits(void)
+{
+    int maxTasks = 0;
+    int maxBytes = 0;
+    int policy = MYSQLA_POLICY_REJECT;
+    int blockTimeout = 50;
+    
+    stackGetParamInt(0, &maxTasks);
+    stackGetParamInt(1, &maxBytes);
+    if(stackGetNumberOfParams() > 2)
+        stackGetParamInt(2, &policy);
+    if(stackGetNumberOfParams() > 3)
+        stackGetParamInt(3, &blockTimeout);
+    
+    if(policy < MYSQLA_POLICY_REJECT || policy > MYSQLA_POLICY_BLOCK)
+    {
+        stackError("ERROR: mysqla_set_queue_limits() invalid policy, expected 0 (reject), 1 (drop oldest) or 2 (block)");
+        return;
+    }
+    
+    mysqla_max_queued_tasks = (maxTasks > 0) ? maxTasks : 0;
+    mysqla_max_queued_bytes = (maxBytes > 0) ? maxBytes : 0;
+    mysqla_queue_policy = policy;
+    mysqla_block_timeout_ms = (blockTimeout > 0) ? blockTimeout : 0;
+}
+
+/*
+ * Obtain how full the task queue is, so scripts can skip optional queries before they get rejected
+ * 
+ * Arguments from GSC:
+ *     -
+ * Returns to GSC:
+ *     float pressure   - fill level of the fullest queue limit, 0 (empty or no limits) to 1 (full)
+ */
+void gsc_mysqla_get_queue_pressure(void)
+{
+    float pressure = 0;
+    
+    if(mysqla_max_queued_tasks > 0)
+        pressure = __atomic_load_n(&mysqla_queued_tasks, __ATOMIC_RELAXED) / (float)mysqla_max_queued_tasks;
+    
+    if(mysqla_max_queued_bytes > 0)
+    {
+        float bytesPressure = __atomic_load_n(&mysqla_queued_bytes, __ATOMIC_RELAXED) / (float)mysqla_max_queued_bytes;
+        if(bytesPressure > pressure)
+            pressure = bytesPressure;
+    }
+    
+    stackPushFloat(pressure);
+}
+
+/*
+ * Configure how the connections are shared between the priority classes. Tasks are started in weighted
+ * round-robin order between the classes, so even a long burst of one class leaves room for the others.
+ * 
+ * Arguments from GSC:
+ *     int reservedConnections  - connections only interactive tasks may use (at least one is always left for the others)
+ *     int interactiveWeight    - share of the interactive class (default 4)
+ *     int normalWeight         - share of the normal class (default 2)
+ *     int bulkWeight           - share of the bulk class (default 1)
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_scheduling(void)
+{
+    int reserved = 0;
+    stackGetParamInt(0, &reserved);
+    __atomic_store_n(&mysqla_reserved_connections, (reserved > 0) ? reserved : 0, __ATOMIC_RELAXED);
+    
+    for(int i = 0; i < MYSQLA_PRIORITY_CLASSES && i + 1 < (int)stackGetNumberOfParams(); i++)
+    {
+        int weight = 1;
+        stackGetParamInt(i + 1, &weight);
+        __atomic_store_n(&mysqla_priority_weights[i], (weight > 0) ? weight : 1, __ATOMIC_RELAXED);
+    }
+    
+    // Let the dispatcher apply it to the tasks already waiting
+    if(first_async_connection != NULL)
+        mysqla_wake_dispatcher();
+}
+
+/*
+ * Configure how long a player's reads stay on the primary after they wrote something, so they always see
+ * their own writes even if a replica lags behind. Only applies to entity queries, level reads always use the replicas.
+ * 
+ * Arguments from GSC:
+ *     int ms           - time in ms (default 2000), 0 to send all reads to the replicas
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_read_your_writes(void)
+{
+    int ms = 0;
+    stackGetParamInt(0, &ms);
+    mysqla_read_your_writes_ms = (ms > 0) ? ms : 0;
+}
+
+/*
+ * Set the deadline of tasks that aren't given one. A task past its deadline is killed on the server
+ * (KILL QUERY through a side connection, the connection itself stays in the pool) or not started at all.
+ * Its callback then gets timedOut set and an undefined result.
+ * 
+ * Arguments from GSC:
+ *     int ms           - deadline from submission in ms, 0 (default) for none
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_query_timeout(void)
+{
+    int ms = 0;
+    stackGetParamInt(0, &ms);
+    mysqla_default_timeout_ms = (ms > 0) ? ms : 0;
+}
+
+/*
+ * Configure the health checks of the async connections. Connections idle for pingInterval seconds are pinged,
+ * and replaced if the server dropped them, so the first query after a quiet period doesn't pay for (or fail on)
+ * a dead connection. After failureThreshold consecutive failed connects a pool's circuit breaker opens:
+ * its reads fail right away until a connection gets through again. Writes are spooled to be replayed later,
+ * prepared statements keep waiting for the server, reads meant for the replicas go to the primary while those are down.
+ * 
+ * Arguments from GSC:
+ *     int pingInterval     - seconds a connection may be idle before it is pinged, 0 to never ping (default 60)
+ *     int failureThreshold - consecutive failures that open the circuit breaker, 0 to never open it (default 3)
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_health_check(void)
+{
+    int pingInterval = 60, failureThreshold = 3;
+    if(stackGetNumberOfParams() > 0)
+        stackGetParamInt(0, &pingInterval);
+    if(stackGetNumberOfParams() > 1)
+        stackGetParamInt(1, &failureThreshold);
+    
+    __atomic_store_n(&mysqla_ping_interval_ms, (pingInterval > 0) ? pingInterval * 1000 : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&mysqla_breaker_threshold, (failureThreshold > 0) ? failureThreshold : 0, __ATOMIC_RELAXED);
+    
+    // The dispatcher only wakes up for the pings it knows of, so let it plan with the new interval
+    mysqla_wake_dispatcher();
+}
+
+/*
+ * Obtain how many connections of a pool are connected. Right after mysqla_initializer() (or mysqla_add_replica())
+ * the connections are still connecting in the background, queries created until then wait for the first one.
+ * 
+ * Arguments from GSC:
+ *     char *pool       - name of the pool (default "primary")
+ * Returns to GSC:
+ *     int ready        - connected connections, or undefined if there is no such pool
+ */
+void gsc_mysqla_get_ready_connections(void)
+{
+    char *name = (char *)"primary";
+    if(stackGetNumberOfParams() > 0)
+        stackGetParamString(0, &name);
+    
+    mysqla_pool_t *ptr_pool = mysqla_pools;
+    while(ptr_pool != NULL && strcmp(ptr_pool->name, name) != 0)
+        ptr_pool = ptr_pool->next;
+    
+    if(ptr_pool == NULL)
+    {
+        stackPushUndefined();
+        return;
+    }
+    
+    stackPushInt(__atomic_load_n(&ptr_pool->readyConnections, __ATOMIC_RELAXED));
+}
+
+/*
+ * Obtain the load of each database server the async connections go to
+ * 
+ * Arguments from GSC:
+ *     -
+ * Returns to GSC:
+ *     array            - per pool (the primary first, then the replicas in the order they were added) an array of:
+ *                        [0] name, [1] 1 for a replica, [2] open connections,
+ *                        [3] tasks being executed, [4] tasks executed so far,
+ *                        [5] minimum and [6] maximum connections (0 if the pool has a fixed size),
+ *                        [7] connected connections (the others are still connecting),
+ *                        [8] 1 if the circuit breaker is open (the server is taken to be unreachable)
+ */
+void gsc_mysqla_get_pool_stats(void)
+{
+    stackPushArray();
+    
+    for(mysqla_pool_t *ptr_pool = mysqla_pools; ptr_pool != NULL; ptr_pool = ptr_pool->next)
+    {
+        stackPushArray();
+        
+        stackPushString(ptr_pool->name);
+        stackPushArrayLast();
+        
+        stackPushInt(ptr_pool->replica);
+        stackPushArrayLast();
+        
+        stackPushInt(__atomic_load_n(&ptr_pool->connectionCount, __ATOMIC_RELAXED));
+        stackPushArrayLast();
+        
+        stackPushInt(__atomic_load_n(&ptr_pool->outstanding, __ATOMIC_RELAXED));
+        stackPushArrayLast();
+        
+        stackPushInt(__atomic_load_n(&ptr_pool->executed, __ATOMIC_RELAXED));
+        stackPushArrayLast();
+        
+        stackPushInt(__atomic_load_n(&ptr_pool->minConnections, __ATOMIC_RELAXED));
+        stackPushArrayLast();
+        
+        stackPushInt(__atomic_load_n(&ptr_pool->maxConnections, __ATOMIC_RELAXED));
+        stackPushArrayLast();
+        
+        stackPushInt(__atomic_load_n(&ptr_pool->readyConnections, __ATOMIC_RELAXED));
+        stackPushArrayLast();
+        
+        stackPushInt(mysqla_breaker_open(ptr_pool));
+        stackPushArrayLast();
+        
+        stackPushArrayLast();
+    }
+}
+
+/*
+ * Obtain the queue wait of each priority class. The wait figures cover the tasks started since the previous call.
+ * 
+ * Arguments from GSC:
+ *     -
+ * Returns to GSC:
+ *     array[3]         - per class (interactive, normal, bulk) an array of:
+ *                        [0] tasks waiting for a connection, [1] tasks started so far,
+ *                        [2] average queue wait in ms, [3] longest queue wait in ms
+ */
+void gsc_mysqla_get_queue_stats(void)
+{
+    stackPushArray();
+    
+    for(int i = 0; i < MYSQLA_PRIORITY_CLASSES; i++)
+    {
+        mysqla_priority_stats_t *ptr_stats = &mysqla_priority_stats[i];
+        
+        int waitCount = __atomic_exchange_n(&ptr_stats->waitCount, 0, __ATOMIC_RELAXED);
+        long long totalWaitUs = __atomic_exchange_n(&ptr_stats->totalWaitUs, 0, __ATOMIC_RELAXED);
+        int maxWaitUs = __atomic_exchange_n(&ptr_stats->maxWaitUs, 0, __ATOMIC_RELAXED);
+        
+        stackPushArray();
+        
+        stackPushInt(__atomic_load_n(&ptr_stats->queued, __ATOMIC_RELAXED));
+        stackPushArrayLast();
+        
+        stackPushInt(__atomic_load_n(&ptr_stats->started, __ATOMIC_RELAXED));
+        stackPushArrayLast();
+        
+        stackPushFloat((waitCount > 0) ? totalWaitUs / (float)waitCount / 1000 : 0);
+        stackPushArrayLast();
+        
+        stackPushFloat(maxWaitUs / 1000.0f);
+        stackPushArrayLast();
+        
+        stackPushArrayLast();
+    }
+}
+
+/*
+ * Enable the result cache used by mysqla_create_cached_query(). When the cap is reached, the least recently
+ * used results are dropped.
+ * 
+ * Arguments from GSC:
+ *     int maxBytes     - memory cap of the cache, 0 disables it and drops everything cached
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_result_cache(void)
+{
+    int maxBytes = 0;
+    stackGetParamInt(0, &maxBytes);
+    
+    mysqla_cache_max_bytes = (maxBytes > 0) ? maxBytes : 0;
+    
+    if(mysqla_cache_max_bytes == 0)
+        mysqla_cache_clear();
+    
+    while(mysqla_cache_oldest != NULL && mysqla_cache_bytes > mysqla_cache_max_bytes)
+        mysqla_cache_remove(mysqla_cache_oldest);
+}
+
+/*
+ * Initialize all database connection structs. The connections connect in parallel in the background (and keep
+ * trying until the database can be reached), so queries can be created right away and start once a connection
+ * is ready. See mysqla_get_ready_connections().
+ * 
+ * Arguments from GSC:
+ *     char *host           - MySQL database server IP
+ *     char *user           - MySQL database user name
+ *     char *pass           - MySQL database user password
+ *     char *db             - MySQL database name
+ *     int port             - MySQL database server port
+ *     int connectionCount  - Maximum amount of simultaneous connections to use
+ * Returns to GSC:
+ *     nothing
+ */
+void gsc_mysqla_initializer(void)
+{
+    // If the first entry of the linked list has already been set, then we've already initialized the database connections
+    if(first_async_connection != NULL)
+    {
+        printf("ERROR: gsc_mysqla_initializer() async mysql already initialized\n");
+        stackPushUndefined();
+        return;
+    }
+    
+    // Initialize the MySQL async lock
+    if(pthread_mutex_init(&mysqla_lock, NULL) != 0)
+    {
+        printf("ERROR: Async mutex initialization failed\n");
+        stackPushUndefined();
+        return;
+    }
+    
+    // Initialize the condition the dispatcher sleeps on
+    if(pthread_cond_init(&mysqla_dispatch_cond, NULL) != 0)
+    {
+        printf("ERROR: Async dispatcher condition initialization failed\n");
+        stackPushUndefined();
+        return;
+    }
+    
+    // Initialize what the game thread waits on when the queue is full
+    if(pthread_mutex_init(&mysqla_admission_lock, NULL) != 0 || pthread_cond_init(&mysqla_admission_cond, NULL) != 0)
+    {
+        printf("ERROR: Async admission lock initialization failed\n");
+        stackPushUndefined();
+        return;
+    }
+    
+    // Initialize the file IO lock
+    if(pthread_mutex_init(&mysqla_file_lock, NULL) != 0)
+    {
+        printf("ERROR: File IO mutex initialization failed\n");
+        stackPushUndefined();
+        return;
+    }
+    
+    mysqla_queue_init(&mysqla_submit_queue);
+    mysqla_queue_init(&mysqla_done_queue);
+    
+    // Obtain our GSC arguments
+    int port, connection_count, callback;
+    char *host, *user, *pass, *db;
+    
+    stackGetParamString(0, &host);
+    stackGetParamString(1, &user);
+    stackGetParamString(2, &pass);
+    stackGetParamString(3, &db);
+    stackGetParamInt(4, &port);
+    stackGetParamInt(5, &connection_count);
+    stackGetParamFunction(6, &callback);
+    
+    if(callback == -1)
+    {
+        stackError("ERROR: gsc_mysqla_initializer() needs a callback");
+        stackPushUndefined();
+        return;
+    }
+    
+    mysql_result_callback = callback;
+    
+    mysqla_db_host = strdup(host);
+    mysqla_db_user = strdup(user);
+    mysqla_db_pass = strdup(pass);
+    mysqla_db_name = strdup(db);
+    mysqla_db_port = port;
+    
+    // Check if the GSC developer is on drugs
+    if(connection_count <= 0)
+    {
+        stackError("ERROR: gsc_mysqla_initializer() needs a positive connection_count in mysqla_initializer");
+        stackPushUndefined();
+        return;
+    }
+    
+    mysqla_pool_t *ptr_primary = mysqla_create_pool("primary", false, host, user, pass, db, port);
+    for(int i = 0; i < connection_count; i++)
+    {
+        if(mysqla_open_connection(ptr_primary, false) == NULL)
+        {
+            stackError("ERROR: gsc_mysqla_initializer() error creating connection worker thread");
+            return;
+        }
+    }
+    
+    pthread_t async_handler;
+    if(pthread_create(&async_handler, NULL, mysqla_query_handler, NULL))
+    {
+        stackError("ERROR: gsc_mysqla_initializer() error detaching async handler thread");
+        return;
+    }
+    
+    pthread_detach(async_handler);
+    
+    // Writes that can't reach the database are kept on disk and replayed by a thread of their own.
+    // Without the spool they are lost like before, so a failure here isn't fatal
+    pthread_mutex_init(&mysqla_spool_lock, NULL);
+    pthread_cond_init(&mysqla_spool_cond, NULL);
+    
+    pthread_t spool_replayer;
+    if(mysqla_spool_open())
+    {
+        if(pthread_create(&spool_replayer, NULL, mysqla_spool_replayer, NULL) == 0)
+        {
+            pthread_detach(spool_replayer);
+        }
+        else
+        {
+            printf("ERROR: gsc_mysqla_initializer() error creating spool replayer thread, writes won't be spooled\n");
+            close(mysqla_spool_fd);
+            mysqla_spool_fd = -1;
+        }
+    }
+    
+    mysqla_stats_read_us[MYSQLA_STATS_GSC] = mysqla_time_us();
+    
+    pthread_t stats_writer;
+    if(pthread_create(&stats_writer, NULL, mysqla_stats_writer, NULL) == 0)
+        pthread_detach(stats_writer);
+    else
+        printf("ERROR: gsc_mysqla_initializer() error creating stats writer thread\n");
+}
+
+/*
+ * Add a read replica of the primary database. SELECTs (and queries flagged as reads) are spread over the replicas,
+ * each going to the replica with the least outstanding tasks. Writes, and reads of a player shortly after they
+ * wrote something (see mysqla_set_read_your_writes()), stay on the primary.
+ * Can be called multiple times (after mysqla_initializer()) to add several replicas.
+ * 
+ * Arguments from GSC:
+ *     char *name           - Name of the replica, used in mysqla_get_pool_stats()
+ *     char *host           - MySQL replica server IP
+ *     char *user           - MySQL database user name
+ *     char *pass           - MySQL database user password
+ *     char *db             - MySQL database name
+ *     int port             - MySQL replica server port
+ *     int connection_count - Amount of connections to the replica
+ * Returns to GSC:
+ *     int connections      - Connections added, or undefined on error
+ */
+void gsc_mysqla_add_replica(void)
+{
+    if(first_async_connection == NULL)
+    {
+        stackError("ERROR: gsc_mysqla_add_replica() called before mysqla_initializer()");
+        stackPushUndefined();
+        return;
+    }
+    
+    int port, connection_count;
+    char *name, *host, *user, *pass, *db;
+    
+    stackGetParamString(0, &name);
+    stackGetParamString(1, &host);
+    stackGetParamString(2, &user);
+    stackGetParamString(3, &pass);
+    stackGetParamString(4, &db);
+    stackGetParamInt(5, &port);
+    stackGetParamInt(6, &connection_count);
+    
+    if(connection_count <= 0)
+    {
+        stackError("ERROR: gsc_mysqla_add_replica() needs a positive connection_count");
+        stackPushUndefined();
+        return;
+    }
+    
+    mysqla_pool_t *ptr_pool = mysqla_create_pool(name, true, host, user, pass, db, port);
+    for(int i = 0; i < connection_count; i++)
+    {
+        if(mysqla_open_connection(ptr_pool, false) == NULL)
+        {
+            printf("ERROR: gsc_mysqla_add_replica() error creating connection worker thread\n");
+            break;
+        }
+    }
+    
+    // Once one of them is connected, reads wait for a replica connection instead of a primary one
+    stackPushInt(ptr_pool->connectionCount);
+}
+
+/*
+ * Let a pool grow and shrink with the load instead of keeping a fixed amount of connections.
+ * Another connection is opened (in the background, one at a time) when a task waited longer than growWaitMs
+ * for one, and a connection above the minimum is closed after it was idle for idleTimeout seconds.
+ * Resizing is counted in mysqla_get_stats() and logged to the console.
+ * 
+ * Arguments from GSC:
+ *     int minConnections   - connections always kept open (at least 1)
+ *     int maxConnections   - most connections opened, 0 to keep the current connections (fixed size)
+ *     int growWaitMs       - queue wait that opens another connection (default 100)
+ *     int idleTimeout      - seconds a connection above the minimum may stay idle (default 60)
+ *     char *pool           - name of the pool (default "primary")
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_pool_size(void)
+{
+    if(first_async_connection == NULL)
+    {
+        stackError("ERROR: gsc_mysqla_set_pool_size() called before mysqla_initializer()");
+        return;
+    }
+    
+    int minConnections = 1, maxConnections = 0, growWaitMs = 100, idleTimeout = 60;
+    char *name = (char *)"primary";
+    
+    int numParams = stackGetNumberOfParams();
+    stackGetParamInt(0, &minConnections);
+    stackGetParamInt(1, &maxConnections);
+    if(numParams > 2)
+        stackGetParamInt(2, &growWaitMs);
+    if(numParams > 3)
+        stackGetParamInt(3, &idleTimeout);
+    if(numParams > 4)
+        stackGetParamString(4, &name);
+    
+    mysqla_pool_t *ptr_pool = mysqla_pools;
+    while(ptr_pool != NULL && strcmp(ptr_pool->name, name) != 0)
+        ptr_pool = ptr_pool->next;
+    
+    if(ptr_pool == NULL)
+    {
+        stackError("ERROR: gsc_mysqla_set_pool_size() unknown pool");
+        return;
+    }
+    
+    if(maxConnections != 0 && (minConnections < 1 || maxConnections < minConnections))
+    {
+        stackError("ERROR: gsc_mysqla_set_pool_size() needs 1 <= minConnections <= maxConnections");
+        return;
+    }
+    
+    // The opener thread is only needed once a pool is sized dynamically
+    if(maxConnections != 0 && !mysqla_opener_started)
+    {
+        pthread_mutex_init(&mysqla_opener_lock, NULL);
+        pthread_cond_init(&mysqla_opener_cond, NULL);
+        
+        pthread_t opener;
+        if(pthread_create(&opener, NULL, mysqla_pool_opener, NULL))
+        {
+            stackError("ERROR: gsc_mysqla_set_pool_size() error creating connection opener thread");
+            return;
+        }
+        
+        pthread_detach(opener);
+        mysqla_opener_started = true;
+    }
+    
+    __atomic_store_n(&ptr_pool->minConnections, minConnections, __ATOMIC_RELAXED);
+    __atomic_store_n(&ptr_pool->growWaitMs, (growWaitMs > 0) ? growWaitMs : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ptr_pool->idleTimeoutMs, (idleTimeout > 0) ? idleTimeout * 1000 : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ptr_pool->maxConnections, (maxConnections > 0) ? maxConnections : 0, __ATOMIC_RELAXED);
+    
+    if(maxConnections != 0)
+        __atomic_store_n(&mysqla_sizing_enabled, true, __ATOMIC_RELAXED);
+    
+    // The dispatcher opens connections up to the minimum (and closes those above the maximum) right away
+    mysqla_wake_dispatcher();
+}
+
+/*
+ * Obtain memory usage of the async task storage
+ * 
+ * Arguments from GSC:
+ *     -
+ * Returns to GSC:
+ *     int array[3]     - [0] number of live tasks, [1] bytes allocated for tasks and query text, [2] bytes used by the result cache
+ */
+void gsc_mysqla_get_memory_stats(void)
+{
+    stackPushArray();
+    
+    stackPushInt(mysqla_live_tasks);
+    stackPushArrayLast();
+    
+    stackPushInt(mysqla_slab_bytes);
+    stackPushArrayLast();
+    
+    stackPushInt(mysqla_cache_bytes);
+    stackPushArrayLast();
+}
+
+/*
+ * Push a summary of a metrics histogram to the GSC caller, scaled by scale
+ */
+static void pushHistogram(const mysqla_histogram_t *histogram, float scale)
+{
+    stackPushArray();
+    
+    stackPushInt(__atomic_load_n(&histogram->count, __ATOMIC_RELAXED));
+    stackPushArrayLast();
+    
+    stackPushFloat(mysqla_histogram_average(histogram) * scale);
+    stackPushArrayLast();
+    
+    stackPushFloat(mysqla_histogram_percentile(histogram, 50) * scale);
+    stackPushArrayLast();
+    
+    stackPushFloat(mysqla_histogram_percentile(histogram, 99) * scale);
+    stackPushArrayLast();
+    
+    stackPushFloat(__atomic_load_n(&histogram->max, __ATOMIC_RELAXED) * scale);
+    stackPushArrayLast();
+}
+
+/*
+ * Obtain the metrics of the async subsystem. Counters and histograms cover the time since it was started,
+ * busy ratios the time since the previous call. The same figures are written to ../mysql_stats_<port>.log
+ * every mysqla_set_stats_interval() seconds.
+ * 
+ * Arguments from GSC:
+ *     -
+ * Returns to GSC:
+ *     array            - [0] queued tasks, [1] most tasks queued at once, [2] tasks executed, [3] errors,
+ *                        [4] errors caused by an unreachable database, [5] writes spooled, [6] tasks rejected,
+ *                        [7] tasks dropped to make room, [8] tasks cancelled by disconnects, [9] cache hits, [10] cache misses,
+ *                        [11] queue depth, [12] queue wait (ms), [13] execution time (ms), [14] result rows, [15] result bytes,
+ *                        each an array of [0] count, [1] average, [2] median, [3] 99th percentile, [4] maximum,
+ *                        [16] array with the busy ratio (0 to 1) of each connection,
+ *                        [17] connections opened and [18] connections closed by the pool sizing,
+ *                        [19] tasks that passed their deadline, [20] reads that shared an identical read's result,
+ *                        [21] connections replaced after they were lost, [22] tasks failed while the circuit breaker was open
+ */
+void gsc_mysqla_get_stats(void)
+{
+    int counters[] = {
+        __atomic_load_n(&mysqla_queued_tasks, __ATOMIC_RELAXED), mysqla_metrics.peakQueued, mysqla_metrics.executed,
+        mysqla_metrics.errors, mysqla_metrics.connectionErrors, mysqla_metrics.spooled, mysqla_metrics.rejected,
+        mysqla_metrics.dropped, mysqla_metrics.cancelled, mysqla_metrics.cacheHits, mysqla_metrics.cacheMisses
+    };
+    
+    stackPushArray();
+    
+    for(unsigned int i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+    {
+        stackPushInt(counters[i]);
+        stackPushArrayLast();
+    }
+    
+    pushHistogram(&mysqla_metrics.queueDepth, 1);
+    stackPushArrayLast();
+    pushHistogram(&mysqla_metrics.queueWaitUs, 0.001f);
+    stackPushArrayLast();
+    pushHistogram(&mysqla_metrics.execUs, 0.001f);
+    stackPushArrayLast();
+    pushHistogram(&mysqla_metrics.resultRows, 1);
+    stackPushArrayLast();
+    pushHistogram(&mysqla_metrics.resultBytes, 1);
+    stackPushArrayLast();
+    
+    float busy[64];
+    int connections = mysqla_read_busy_ratios(MYSQLA_STATS_GSC, busy, 64);
+    
+    stackPushArray();
+    for(int i = 0; i < connections; i++)
+    {
+        stackPushFloat(busy[i]);
+        stackPushArrayLast();
+    }
+    
+    stackPushArrayLast();
+    
+    stackPushInt(mysqla_metrics.poolGrown);
+    stackPushArrayLast();
+    stackPushInt(mysqla_metrics.poolShrunk);
+    stackPushArrayLast();
+    stackPushInt(mysqla_metrics.timedOut);
+    stackPushArrayLast();
+    stackPushInt(mysqla_metrics.deduplicated);
+    stackPushArrayLast();
+    stackPushInt(mysqla_metrics.reconnects);
+    stackPushArrayLast();
+    stackPushInt(mysqla_metrics.failedFast);
+    stackPushArrayLast();
+}
+
+/*
+ * Set how often the metrics are appended to ../mysql_stats_<port>.log
+ * 
+ * Arguments from GSC:
+ *     int seconds      - seconds between writes (default 60), 0 stops writing the file
+ * Returns to GSC:
+ *     -
+ */
+void gsc_mysqla_set_stats_interval(void)
+{
+    int seconds = 0;
+    stackGetParamInt(0, &seconds);
+    
+    __atomic_store_n(&mysqla_stats_interval, (seconds > 0) ? seconds : 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * This is called by the GSC when a player disconnects to make sure the task callbacks are no longer executed on this player.
+ * Reads of this player that haven't started yet are cancelled, so they don't hold up a connection for nothing.
+ */
+void gsc_mysqla_ondisconnect(int num)
+{
+    if(num < 0 || num >= MYSQLA_MAX_ENTITIES)
+        return;
+    
+    // The next player in this slot starts a session of their own
+    mysqla_entity_write_ms[num] = 0;
+    
+    // The task index is only used by the game thread, so no locking is needed
+    mysqla_task_t *ptr_taskIterator = mysqla_entity_tasks[num];
+    while(ptr_taskIterator != NULL)
+    {
+        ptr_taskIterator->entityDisconnected = true;
+        
+        // Streams are released by their end chunk, so they have to run. Reads other tasks joined run for them
+        if(!ptr_taskIterator->persist && ptr_taskIterator->streamChunkRows == 0 && ptr_taskIterator->followers == NULL && mysqla_query_is_read(ptr_taskIterator->query))
+        {
+            // Fails if the dispatcher already started it, then it runs and its result is thrown away
+            if(mysqla_cancel_task(ptr_taskIterator))
+                mysqla_metric_inc(&mysqla_metrics.cancelled);
+        }
+        
+        ptr_taskIterator = ptr_taskIterator->nextOfEntity;
+    }
+}
+
+#ifdef MYSQLA_BENCHMARK
+
+typedef struct mysqla_bench_slot // Hand-over between the benchmark's "dispatcher" and its worker, like a connection's task
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // Signalled (under lock) when pending changes either way
+    bool pending;               // Set by the dispatcher, cleared by the worker once it took the task
+    bool quit;                  // Ends the persistent worker
+} mysqla_bench_slot_t;
+
+/*
+ * Thread of the thread-per-task variant: takes its single task and ends
+ */
+static void *mysqla_bench_task_thread(void *ptr_arg)
+{
+    mysqla_bench_slot_t *ptr_slot = (mysqla_bench_slot_t *)ptr_arg;
+    
+    pthread_mutex_lock(&ptr_slot->lock);
+    ptr_slot->pending = false;
+    pthread_cond_signal(&ptr_slot->cond);
+    pthread_mutex_unlock(&ptr_slot->lock);
+    
+    return NULL;
+}
+
+/*
+ * Thread of the persistent worker variant: sleeps until a task is handed to it, like mysqla_connection_worker()
+ */
+static void *mysqla_bench_worker(void *ptr_arg)
+{
+    mysqla_bench_slot_t *ptr_slot = (mysqla_bench_slot_t *)ptr_arg;
+    
+    pthread_mutex_lock(&ptr_slot->lock);
+    
+    while(true)
+    {
+        while(!ptr_slot->pending && !ptr_slot->quit)
+            pthread_cond_wait(&ptr_slot->cond, &ptr_slot->lock);
+        
+        if(ptr_slot->quit)
+            break;
+        
+        ptr_slot->pending = false;
+        pthread_cond_signal(&ptr_slot->cond);
     }
     
+    pthread_mutex_unlock(&ptr_slot->lock);
+    
     return NULL;
 }
 
 /*
- * Initialize a MySQL query (i.e. create a new task for it)
+ * Hand a task over and wait until the worker took it
  */
-static int mysqla_query_initializer(const char *sql, gentity_t *entity, bool save)
+static void mysqla_bench_wait_taken(mysqla_bench_slot_t *ptr_slot)
 {
-    // Each query has their own ID. It doesn't really matter if this overflows (it's a 32-bit integer)
-    // This ID should not be randomized, as it increases the chances of a duplicate ID
-    static int queryId = 0;
+    pthread_mutex_lock(&ptr_slot->lock);
     
-    pthread_mutex_lock(&mysqla_lock);
+    while(ptr_slot->pending)
+        pthread_cond_wait(&ptr_slot->cond, &ptr_slot->lock);
     
-    queryId++;
+    pthread_mutex_unlock(&ptr_slot->lock);
+}
+
+/*
+ * Measure the dispatch overhead per task: spawning and detaching a thread for every task (as the dispatcher used to)
+ * against handing it to a persistent worker. Only the hand-over is timed, no query is executed, so no database is needed.
+ * Only built with -DMYSQLA_BENCHMARK.
+ * 
+ * Arguments from GSC:
+ *     int iterations   - tasks dispatched by each variant (default 10000)
+ * Returns to GSC:
+ *     array            - microseconds per task: [0] with a thread per task, [1] with a persistent worker
+ */
+void gsc_mysqla_benchmark_dispatch(void)
+{
+    int iterations = 10000;
+    if(stackGetNumberOfParams() > 0)
+        stackGetParamInt(0, &iterations);
     
-    // Find the first task that is NULL so we can create a new task there
-    mysqla_task_t *ptr_freeTask = first_async_task;
-    mysqla_task_t *ptr_prevTask = NULL;
-    while(ptr_freeTask != NULL)
+    if(iterations <= 0)
     {
-        ptr_prevTask = ptr_freeTask;
-        ptr_freeTask = ptr_freeTask->next;
+        stackError("ERROR: mysqla_benchmark_dispatch() iterations must be positive");
+        return;
     }
     
-    mysqla_task_t *ptr_taskNew = new mysqla_task_t;
+    mysqla_bench_slot_t slot;
+    pthread_mutex_init(&slot.lock, NULL);
+    pthread_cond_init(&slot.cond, NULL);
+    slot.pending = false;
+    slot.quit = false;
     
-    ptr_taskNew->taskId = queryId;
-    snprintf(ptr_taskNew->query, sizeof(ptr_taskNew->query), "%s", sql);
-    ptr_taskNew->prev = ptr_prevTask;
-    ptr_taskNew->result = NULL;
-    ptr_taskNew->save = save;
-    ptr_taskNew->done = false;
-    ptr_taskNew->next = NULL;
-    ptr_taskNew->entity = entity;
-    ptr_taskNew->entityDisconnected = false;
-    ptr_taskNew->started = false;
+    long long startUs = mysqla_time_us();
+    for(int i = 0; i < iterations; i++)
+    {
+        slot.pending = true;
+        
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, mysqla_bench_task_thread, &slot) != 0)
+        {
+            printf("ERROR: mysqla_benchmark_dispatch() error creating a task thread\n");
+            stackPushUndefined();
+            return;
+        }
+        
+        pthread_detach(thread);
+        mysqla_bench_wait_taken(&slot);
+    }
     
-    // If we've just set up the first task, reflect that into our global pointer
-    if(ptr_prevTask == NULL)
+    float spawnUs = (float)(mysqla_time_us() - startUs) / iterations;
+    
+    pthread_t worker;
+    if(pthread_create(&worker, NULL, mysqla_bench_worker, &slot) != 0)
     {
-        first_async_task = ptr_taskNew;
+        printf("ERROR: mysqla_benchmark_dispatch() error creating the worker thread\n");
+        stackPushUndefined();
+        return;
     }
-    else
+    
+    startUs = mysqla_time_us();
+    for(int i = 0; i < iterations; i++)
     {
-        ptr_taskNew->prev->next = ptr_taskNew;
+        pthread_mutex_lock(&slot.lock);
+        slot.pending = true;
+        pthread_cond_signal(&slot.cond);
+        pthread_mutex_unlock(&slot.lock);
+        
+        mysqla_bench_wait_taken(&slot);
     }
     
-    pthread_mutex_unlock(&mysqla_lock);
+    float workerUs = (float)(mysqla_time_us() - startUs) / iterations;
     
-    return queryId;
+    pthread_mutex_lock(&slot.lock);
+    slot.quit = true;
+    pthread_cond_signal(&slot.cond);
+    pthread_mutex_unlock(&slot.lock);
+    pthread_join(worker, NULL);
+    
+    pthread_cond_destroy(&slot.cond);
+    pthread_mutex_destroy(&slot.lock);
+    
+    printf("mysqla_benchmark_dispatch() %d tasks: %.2f us per task with a thread per task, %.2f us with a persistent worker\n", iterations, spawnUs, workerUs);
+    
+    stackPushArray();
+    stackPushFloat(spawnUs);
+    stackPushArrayLast();
+    stackPushFloat(workerUs);
+    stackPushArrayLast();
 }
 
-/************************************************************
- *              Functions callable from GSC                 *
- ************************************************************/
- 
- /** Start of async MySQL functions **/
-
 /*
- * Create a new query task on an entity
- * 
- * Arguments from GSC:
- *     char *query      - query string
- *     int saveResult   - whether or not to store the result
- * Returns to GSC:
- *     int id           - id of the newly created task
+ * Wait until the task with the specified ID finishes, without delivering it. Other finished tasks are handed back
+ * to the done queue, so they are delivered on the next frame as usual. The caller releases the returned task.
+ * Returns NULL if the task didn't finish within timeoutMs.
  */
-void gsc_mysqla_create_entity_query(int num)
+static mysqla_task_t *mysqla_selftest_wait(int taskId, int timeoutMs)
 {
-	printf("hey\n");
-    char *query = NULL;
-    int saveResult = 0; // By default we don't save the result
+    mysqla_task_t *ptr_found = NULL;
+    mysqla_task_t *ptr_firstOther = NULL;
+    mysqla_task_t *ptr_lastOther = NULL;
+    long long endMs = mysqla_time_ms() + timeoutMs;
     
-    // Obtain the arguments from GSC call
-    printf("hello\n");
-    stackGetParamString(0, &query);
-    printf("world\n");
-    stackGetParamInt(1, &saveResult);
-    printf("foo\n");
+    while(ptr_found == NULL && mysqla_time_ms() < endMs)
+    {
+        mysqla_task_t *ptr_task = (mysqla_task_t *)mysqla_queue_pop(&mysqla_done_queue);
+        if(ptr_task == NULL)
+        {
+            usleep(1000);
+            continue;
+        }
+        
+        if(ptr_task->taskId == taskId)
+        {
+            ptr_found = ptr_task;
+            continue;
+        }
+        
+        ptr_task->nextInBatch = NULL;
+        if(ptr_lastOther == NULL)
+            ptr_firstOther = ptr_task;
+        else
+            ptr_lastOther->nextInBatch = ptr_task;
+        ptr_lastOther = ptr_task;
+    }
     
-    gentity_t *ptr_gentity = &g_entities[num];
-    printf("bar\n");
-    if(ptr_gentity == NULL) // Make sure the entity is known
+    while(ptr_firstOther != NULL)
     {
-        printf("WARN: Calling query \"%s\" on non-existing entity\n", query);
-        stackPushUndefined();
-        return;
+        mysqla_task_t *ptr_next = ptr_firstOther->nextInBatch;
+        mysqla_queue_push(&mysqla_done_queue, &ptr_firstOther->node);
+        ptr_firstOther = ptr_next;
     }
     
-    // Send back the ID of the newly created query task
-    int id = mysqla_query_initializer(query, ptr_gentity, (saveResult > 0));
-    stackPushInt(id);
+    return ptr_found;
 }
 
 /*
- * Create a new query task on the level
- * 
- * Arguments from GSC:
- *     char *query      - query string
- *     int saveResult   - whether or not to store the result
- * Returns to GSC:
- *     int id           - id of the newly created task
+ * A query running past its deadline is killed on the server, instead of holding its connection until it's done
  */
-void gsc_mysqla_create_level_query(void)
+static int mysqla_selftest_deadline(void)
 {
-    char *query = NULL;
-    int saveResult = 0; // By default we don't save the result
+    long long startMs = mysqla_time_ms();
+    int id = mysqla_query_initializer("SELECT SLEEP(5)", NULL, 1, MYSQLA_PRIORITY_NORMAL, 0, 300, 0);
+    mysqla_task_t *ptr_task = mysqla_selftest_wait(id, 10000);
+    if(ptr_task == NULL)
+        return 0;
     
-    // Obtain the arguments from GSC call
-    stackGetParamString(0, &query);
-    stackGetParamInt(1, &saveResult);
+    bool passed = (ptr_task->timedOut && mysqla_time_ms() - startMs < 2000);
+    mysqla_release_task(ptr_task);
     
-    // Send back the ID of the newly created query task
-    int id = mysqla_query_initializer(query, NULL, (saveResult > 0));
-    stackPushInt(id);
+    return passed;
 }
 
 /*
- * Initialize all database connection structs and return their addresses
- * 
- * Arguments from GSC:
- *     char *host           - MySQL database server IP
- *     char *user           - MySQL database user name
- *     char *pass           - MySQL database user password
- *     char *db             - MySQL database name
- *     int port             - MySQL database server port
- *     int connectionCount  - Maximum amount of simultaneous connections to use
- * Returns to GSC:
- *     nothing
+ * A stream whose deadline passes while it waits for a connection ends through its own chunks, with status -1
  */
-void gsc_mysqla_initializer(void)
+static int mysqla_selftest_stream(void)
 {
-    // If the first entry of the linked list has already been set, then we've already initialized the database connections
-    if(first_async_connection != NULL)
+    // Occupy every connection the stream could get, so it has to wait in the queue behind these
+    int sleepers = 0;
+    for(mysqla_pool_t *ptr_pool = __atomic_load_n(&mysqla_pools, __ATOMIC_ACQUIRE); ptr_pool != NULL; ptr_pool = ptr_pool->next)
+        sleepers += (ptr_pool->maxConnections > 0) ? ptr_pool->maxConnections : __atomic_load_n(&ptr_pool->connectionCount, __ATOMIC_RELAXED);
+    
+    int *ptr_sleeperIds = (int *)malloc(sleepers * sizeof(int));
+    if(ptr_sleeperIds == NULL)
+        return 0;
+    
+    for(int i = 0; i < sleepers; i++)
+        ptr_sleeperIds[i] = mysqla_query_initializer("SELECT SLEEP(1)", NULL, 0, MYSQLA_PRIORITY_NORMAL, 0, 0, 0);
+    
+    // Streams take the default deadline
+    int defaultTimeoutMs = mysqla_default_timeout_ms;
+    mysqla_default_timeout_ms = 200;
+    int streamId = mysqla_stream_initializer("SELECT 1", NULL, 1, 0);
+    mysqla_default_timeout_ms = defaultTimeoutMs;
+    
+    // The stream was put at the head of the list. Its chunks are taken from it here instead of being passed to GSC
+    mysqla_task_t *ptr_stream = (streamId != 0) ? mysqla_streams : NULL;
+    int status = 0;
+    long long endMs = mysqla_time_ms() + 10000;
+    while(ptr_stream != NULL && status == 0 && mysqla_time_ms() < endMs)
     {
-        printf("ERROR: gsc_mysqla_initializer() async mysql already initialized\n");
-        stackPushUndefined();
-        return;
+        mysqla_chunk_t *ptr_chunk = (mysqla_chunk_t *)mysqla_queue_pop(&ptr_stream->streamChunks);
+        if(ptr_chunk == NULL)
+        {
+            usleep(1000);
+            continue;
+        }
+        
+        if(ptr_chunk->rows != NULL)
+        {
+            mysqla_free_rows(ptr_chunk->rows);
+            sem_post(&ptr_stream->streamSlots);
+        }
+        
+        status = ptr_chunk->status;
+        free(ptr_chunk);
     }
     
-    // Initialize the MySQL async lock
-    if(pthread_mutex_init(&mysqla_lock, NULL) != 0)
+    bool passed = false;
+    if(status != 0)
     {
-        printf("ERROR: Async mutex initialization failed\n");
-        stackPushUndefined();
-        return;
+        // A stream that started would have ended with status 1, it returns its row right away
+        passed = (status == -1 && ptr_stream->timedOut);
+        
+        mysqla_task_t **ptr_link = &mysqla_streams;
+        while(*ptr_link != ptr_stream)
+            ptr_link = &(*ptr_link)->nextStream;
+        *ptr_link = ptr_stream->nextStream;
+        
+        sem_destroy(&ptr_stream->streamSlots);
+        mysqla_release_task(ptr_stream);
     }
     
-    // Initialize the file IO lock
-    if(pthread_mutex_init(&mysqla_file_lock, NULL) != 0)
+    for(int i = 0; i < sleepers; i++)
     {
-        printf("ERROR: File IO mutex initialization failed\n");
-        stackPushUndefined();
-        return;
+        mysqla_task_t *ptr_task = (ptr_sleeperIds[i] != 0) ? mysqla_selftest_wait(ptr_sleeperIds[i], 10000) : NULL;
+        if(ptr_task != NULL)
+            mysqla_release_task(ptr_task);
     }
     
-    // Obtain our GSC arguments
-    int port, connection_count, callback;
-    char *host, *user, *pass, *db;
+    free(ptr_sleeperIds);
     
-    stackGetParamString(0, &host);
-    stackGetParamString(1, &user);
-    stackGetParamString(2, &pass);
-    stackGetParamString(3, &db);
-    stackGetParamInt(4, &port);
-    stackGetParamInt(5, &connection_count);
-    stackGetParamFunction(6, &callback);
+    return passed;
+}
+
+/*
+ * A player's read right after their write goes to the primary, even though it would go to a replica otherwise.
+ * Skipped (-1) without a replica or with read-your-writes switched off.
+ */
+static int mysqla_selftest_read_your_writes(gentity_t *entity)
+{
+    bool haveReplica = false;
+    for(mysqla_pool_t *ptr_pool = __atomic_load_n(&mysqla_pools, __ATOMIC_ACQUIRE); ptr_pool != NULL; ptr_pool = ptr_pool->next)
+        haveReplica |= ptr_pool->replica;
     
-    if(callback == -1)
-    {
-        stackError("ERROR: gsc_mysqla_initializer() needs a callback");
-        stackPushUndefined();
-        return;
-    }
+    if(!haveReplica || mysqla_read_your_writes_ms <= 0)
+        return -1;
     
-    mysql_result_callback = callback;
+    int writeId = mysqla_query_initializer("DO 0", entity, 0, MYSQLA_PRIORITY_NORMAL, 0, 0, 0);
+    mysqla_task_t *ptr_task = mysqla_selftest_wait(writeId, 5000);
+    if(ptr_task == NULL)
+        return 0;
     
-    // Check if the GSC developer is on drugs
-    if(connection_count <= 0)
-    {
-        stackError("ERROR: gsc_mysqla_initializer() needs a positive connection_count in mysqla_initializer");
-        stackPushUndefined();
-        return;
-    }
+    mysqla_release_task(ptr_task);
     
-    pthread_mutex_lock(&mysqla_lock);
-
-    for(int i = 0; i < connection_count; i++)
+    // The server's id of the connection that executed the read tells which pool it came from.
+    // Its connection only notes that id for a task with a deadline, so the read gets one
+    int readId = mysqla_query_initializer("SELECT CONNECTION_ID()", entity, 1, MYSQLA_PRIORITY_NORMAL, 0, 5000, 0);
+    ptr_task = mysqla_selftest_wait(readId, 5000);
+    if(ptr_task == NULL)
+        return 0;
+    
+    unsigned long serverThreadId = 0;
+    if(ptr_task->rows != NULL && ptr_task->rows->numRows == 1 && ptr_task->rows->offsets[0] >= 0)
     {
-        // Create and initialize the new connection struct
-        mysqla_connection_t *ptr_newConnection = new mysqla_connection_t;
-        ptr_newConnection->next = NULL;
-        
-        ptr_newConnection->connection = mysql_init(NULL);
-        
-        ptr_newConnection->connection = mysql_real_connect((MYSQL*)ptr_newConnection->connection, host, user, pass, db, port, NULL, 0);
-        my_bool reconnect = true;
-        mysql_options(ptr_newConnection->connection, MYSQL_OPT_RECONNECT, &reconnect);
-        ptr_newConnection->task = NULL;
-        
-        // Add our newly created connection to the linked list
-        ptr_newConnection->next = first_async_connection;
-        first_async_connection = ptr_newConnection;
+        // CONNECTION_ID() is a BIGINT, so it comes as a string
+        const char *cell = ptr_task->rows->data + ptr_task->rows->offsets[0];
+        if(cell[0] == MYSQLA_CELL_INT)
+        {
+            int intVal;
+            memcpy(&intVal, cell + 1, sizeof(int));
+            serverThreadId = intVal;
+        }
+        else
+        {
+            serverThreadId = strtoul(cell + 1, NULL, 10);
+        }
     }
     
-    pthread_mutex_unlock(&mysqla_lock);
+    mysqla_release_task(ptr_task);
     
-    pthread_t async_handler;
-    if(pthread_create(&async_handler, NULL, mysqla_query_handler, NULL))
+    bool passed = false;
+    for(mysqla_connection_t *ptr_conn = __atomic_load_n(&first_async_connection, __ATOMIC_ACQUIRE); ptr_conn != NULL; ptr_conn = ptr_conn->next)
     {
-        stackError("ERROR: gsc_mysqla_initializer() error detaching async handler thread");
-        return;
+        if(!ptr_conn->pool->replica && ptr_conn->serverThreadId == serverThreadId)
+            passed = true;
     }
     
-    pthread_detach(async_handler);
+    return passed;
 }
 
 /*
- * This is called by the GSC when a player disconnects to make sure the task callbacks are no longer executed on this player
+ * Check the behaviour that needs a real server against a local mysqld, which the async connections were initialized with:
+ * a query killed by its deadline, a stream that expires while it's queued, and a player's read after their write
+ * going to the primary (add the same server with mysqla_add_replica for that one). Run it while nothing else is queued.
+ * Blocks the game thread for a few seconds, tasks of the game finishing meanwhile are delivered on the next frame.
+ * Only built with -DMYSQLA_BENCHMARK.
+ * 
+ * Arguments from GSC:
+ *     -
+ * Returns to GSC:
+ *     array            - [0] deadline kill, [1] stream expiring while queued, [2] read-your-writes,
+ *                        each 1 if it passed, 0 if it failed and -1 if it was skipped
  */
-void gsc_mysqla_ondisconnect(int num)
+void gsc_mysqla_selftest(int num)
 {
-    gentity_t *ptr_gentity = &g_entities[num];
-    
-    if(ptr_gentity == NULL)
+    if(first_async_connection == NULL)
+    {
+        stackError("ERROR: gsc_mysqla_selftest() called before mysqla_initializer()");
+        stackPushUndefined();
         return;
+    }
     
-    pthread_mutex_lock(&mysqla_lock);
+    const char *outcomes[] = { "skipped", "FAILED", "passed" };
     
-    mysqla_task_t *ptr_taskIterator = first_async_task;
-    while(ptr_taskIterator != NULL)
-    {
-        // Check if the entity upon which this query was called just disconnected
-        if(ptr_taskIterator->entity == ptr_gentity)
-            ptr_taskIterator->entityDisconnected = true;
-        
-        ptr_taskIterator = ptr_taskIterator->next;
-    }
+    int deadline = mysqla_selftest_deadline();
+    printf("mysqla_selftest() query killed by its deadline: %s\n", outcomes[deadline + 1]);
     
-    pthread_mutex_unlock(&mysqla_lock);
+    int readYourWrites = mysqla_selftest_read_your_writes(&g_entities[num]);
+    printf("mysqla_selftest() read after a write on the primary: %s\n", outcomes[readYourWrites + 1]);
+    
+    int stream = mysqla_selftest_stream();
+    printf("mysqla_selftest() stream expiring while queued: %s\n", outcomes[stream + 1]);
+    
+    stackPushArray();
+    stackPushInt(deadline);
+    stackPushArrayLast();
+    stackPushInt(stream);
+    stackPushArrayLast();
+    stackPushInt(readYourWrites);
+    stackPushArrayLast();
 }
 
+#endif
+
 
 /** Start of synchronous MySQL functions **/
 
@@ -616,6 +7038,11 @@ void gsc_mysqls_real_connect(void)
     stackGetParamString(3, &db);
     stackGetParamInt(4, &port);
 
+#ifdef MYSQL_WAIT_READ
+    // Allows mysqls_query_nonblocking() to use the *_start/*_cont functions, blocking calls keep working
+    mysql_options(mysql, MYSQL_OPT_NONBLOCK, 0);
+#endif
+    
     int result = (int)mysql_real_connect(mysql, host, user, pass, db, port, NULL, 0);
     if(result != (int)mysql)
     {
@@ -643,6 +7070,9 @@ void gsc_mysqls_close_connection(void)
         return;
     }
     
+    // Non-blocking queries still get their results (GSC is notified next frame)
+    mysqls_pump_nonblocking(true);
+    
     mysql_close((MYSQL *)sync_mysql_connection);
 }
 
@@ -651,7 +7081,7 @@ void gsc_mysqls_close_connection(void)
  * 
  * Arguments from GSC:
  *     char *query    - Query string to execute
- *     int saveResult - Whether or not resulting rows should be returned
+ *     int saveResult - Whether or not resulting rows should be returned, 2 to get a single-row, single-column result as the value itself
  * Returns to GSC:
  *     Resulting fields of all rows or undefined
  */
@@ -670,6 +7100,15 @@ void gsc_mysqls_query(void)
     int saveResult = 0;
     stackGetParamInt(1, &saveResult);
     printf("Adding query %s, saving: %d\n", query, saveResult);
+    
+    // The connection can only work on one query at a time, so non-blocking ones sent before this have to finish first
+    if(mysqls_nb_first != NULL)
+        mysqls_pump_nonblocking(true);
+    
+    // Writes made here may change what the async queries have cached as well
+    if(mysqla_cache_max_bytes > 0 && !mysqla_query_is_read(query))
+        mysqla_cache_invalidate(query);
+    
     // If the query resulted in an error, handle it and return
     int ret = mysql_query((MYSQL *)sync_mysql_connection, query);
     if(ret != 0)
@@ -695,7 +7134,7 @@ void gsc_mysqls_query(void)
         {
 						printf("Result not NULL\n");
             // Pass the results to the GSC
-            pushResultRows(result);
+            pushResultRows(result, (saveResult == MYSQLA_SAVE_SCALAR));
 
             // Free the MySQL result structure
             mysql_free_result(result);
@@ -708,6 +7147,76 @@ void gsc_mysqls_query(void)
     stackPushUndefined();
 }
 
+/*
+ * Start a MySQL query on the synchronous connection without waiting for it
+ * The query is advanced a step each frame (no thread involved) and GSC is notified once it's done:
+ *     level waittill("mysql_query_done", id, result, error);
+ * Queries finish in the order they were started. A mysql_query() call waits for the ones still running.
+ * Needs the non-blocking client API of MariaDB's client library, the async queries work with either library.
+ * 
+ * Arguments from GSC:
+ *     char *query    - Query string to execute
+ *     int saveResult - Whether or not resulting rows should be passed to the notify, 2 to get a single-row, single-column result as the value itself
+ * Returns to GSC:
+ *     int id         - Id the notify is sent with, or undefined if there is no connection
+ */
+void gsc_mysqls_query_nonblocking(void)
+{
+    if(sync_mysql_connection == NULL)
+    {
+        printf("ERROR: gsc_mysqls_query_nonblocking() no connection\n");
+        stackPushUndefined();
+        return;
+    }
+    
+#ifndef MYSQL_WAIT_READ
+    // Without it each step would block the game thread, the very thing this function is there to avoid
+    printf("ERROR: gsc_mysqls_query_nonblocking() needs a client library with the non-blocking API (MariaDB), use mysqla_create_level_query() instead\n");
+    stackPushUndefined();
+    return;
+#endif
+    
+    char *query;
+    stackGetParamString(0, &query);
+    
+    int saveResult = 0;
+    if(stackGetNumberOfParams() > 1)
+        stackGetParamInt(1, &saveResult);
+    
+    // Writes made here may change what the async queries have cached as well
+    if(mysqla_cache_max_bytes > 0 && !mysqla_query_is_read(query))
+        mysqla_cache_invalidate(query);
+    
+    int len = strlen(query);
+    mysqls_nb_query_t *ptr_query = (mysqls_nb_query_t *)calloc(1, sizeof(mysqls_nb_query_t) + len);
+    if(ptr_query == NULL)
+    {
+        printf("ERROR: gsc_mysqls_query_nonblocking() out of memory\n");
+        stackPushUndefined();
+        return;
+    }
+    
+    memcpy(ptr_query->query, query, len + 1);
+    ptr_query->saveResult = saveResult;
+    ptr_query->step = MYSQLS_STEP_QUERY;
+    
+    mysqls_nb_next_id++;
+    if(mysqls_nb_next_id <= 0)
+        mysqls_nb_next_id = 1;
+    ptr_query->id = mysqls_nb_next_id;
+    
+    if(mysqls_nb_last == NULL)
+        mysqls_nb_first = ptr_query;
+    else
+        mysqls_nb_last->next = ptr_query;
+    mysqls_nb_last = ptr_query;
+    
+    // Get the query on its way already, the frame loop takes it from there
+    mysqls_pump_nonblocking(false);
+    
+    stackPushInt(ptr_query->id);
+}
+
 /*
  * Obtain error code of MySQL query of current connection
  * 
@@ -7,14 +7,46 @@ void mysql_handle_result_callbacks(void);
 
 void gsc_mysqla_create_entity_query(int num);
 void gsc_mysqla_create_level_query(void);
+void gsc_mysqla_create_entity_cached_query(int num);
+void gsc_mysqla_create_level_cached_query(void);
+void gsc_mysqla_create_entity_group_query(int num);
+void gsc_mysqla_create_level_group_query(void);
+void gsc_mysqla_create_entity_stream_query(int num);
+void gsc_mysqla_create_level_stream_query(void);
+void gsc_mysqla_prepare(void);
+void gsc_mysqla_execute_entity_statement(int num);
+void gsc_mysqla_execute_level_statement(void);
 void gsc_mysqla_get_done_list(void);
 void gsc_mysqla_initializer(void);
+void gsc_mysqla_add_replica(void);
+void gsc_mysqla_set_pool_size(void);
+void gsc_mysqla_set_read_your_writes(void);
+void gsc_mysqla_set_query_timeout(void);
+void gsc_mysqla_set_health_check(void);
+void gsc_mysqla_get_ready_connections(void);
+void gsc_mysqla_get_pool_stats(void);
+void gsc_mysqla_set_insert_coalescing(void);
+void gsc_mysqla_set_batch_delivery(void);
+void gsc_mysqla_set_single_flight(void);
+void gsc_mysqla_set_result_cache(void);
+void gsc_mysqla_set_queue_limits(void);
+void gsc_mysqla_get_queue_pressure(void);
+void gsc_mysqla_set_scheduling(void);
+void gsc_mysqla_get_queue_stats(void);
 void gsc_mysqla_ondisconnect(int num);
+void gsc_mysqla_get_memory_stats(void);
+void gsc_mysqla_get_stats(void);
+void gsc_mysqla_set_stats_interval(void);
+#ifdef MYSQLA_BENCHMARK
+void gsc_mysqla_benchmark_dispatch(void);
+void gsc_mysqla_selftest(int num);
+#endif
 
 void gsc_mysqls_get_existing_connection(void);
 void gsc_mysqls_real_connect(void);
 void gsc_mysqls_close_connection(void);
 void gsc_mysqls_query(void);
+void gsc_mysqls_query_nonblocking(void);
 void gsc_mysqls_errno(void);
 void gsc_mysqls_error(void);
 void gsc_mysqls_affected_rows(void);
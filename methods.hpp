@@ -1,5 +1,12 @@
 {"mysqla_create_query", gsc_mysqla_create_entity_query, 0},
+{"mysqla_create_cached_query", gsc_mysqla_create_entity_cached_query, 0},
+{"mysqla_create_group_query", gsc_mysqla_create_entity_group_query, 0},
+{"mysqla_create_stream_query", gsc_mysqla_create_entity_stream_query, 0},
+{"mysqla_execute_statement", gsc_mysqla_execute_entity_statement, 0},
 {"mysqla_ondisconnect", gsc_mysqla_ondisconnect, 0},
+#ifdef MYSQLA_BENCHMARK
+{"mysqla_selftest", gsc_mysqla_selftest, 0},
+#endif
 {"saveposition_initclient", gsc_saveposition_initclient, 0},
 {"saveposition_save", gsc_saveposition_save, 0},
 {"saveposition_selectsave", gsc_saveposition_selectsave, 0},
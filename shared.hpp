@@ -47,6 +47,7 @@
 #define stackPushArrayLast  Scr_AddArray
 
 #define stackGetParamType Scr_GetType
+#define stackGetNumberOfParams Scr_GetNumParam
 
 #define STACK_UNDEFINED           0x00
 #define STACK_BEGIN_REF           0x01
@@ -82,6 +83,8 @@
 #define Com_DPrintf Printf
 #define stackError Scr_Error
 
+#define stackNotifyLevel(name, numArgs) Scr_NotifyLevel(SL_GetString(name, 0), numArgs)
+
 #endif // #else ifdef COD4
 #endif // #ifdef COD2
 